@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PKCS11SIGN_H
+#define _PKCS11SIGN_H
+
+#include <stddef.h>
+
+/*
+ * Batch signing
+ *
+ * Gettable parameter of a sign operation (EVP_PKEY_sign_init()). Its
+ * value is an octet string of struct ps_sign_batch_item elements. On
+ * EVP_PKEY_CTX_get_params(), each tbs is signed with the key and the
+ * parameters of the operation, as by EVP_PKEY_sign(). The signature is
+ * written to sig, its length to siglen, and status is set to 1 on
+ * success or to 0 on error.
+ */
+#define PS_SIGNATURE_PARAM_BATCH	"pkcs11sign-sign-batch"
+
+struct ps_sign_batch_item {
+	const unsigned char *tbs;
+	size_t tbslen;
+	unsigned char *sig;
+	size_t sigsize;
+	size_t siglen;
+	int status;
+};
+
+#endif /* _PKCS11SIGN_H */
@@ -44,6 +44,7 @@ PKCS#11 for operations with private keys in PKCS#11 tokens.
 %license COPYING
 %doc README.md openssl-*.cnf.sample
 %{modulesdir}/pkcs11sign.so
+%{_includedir}/pkcs11sign.h
 %{_mandir}/man5/pkcs11sign.cnf.5*
 %{_mandir}/man7/pkcs11sign.7*
 
@@ -19,6 +19,7 @@
 #include "pkcs11.h"
 #include "keymgmt.h"
 #include "consttime.h"
+#include "worker.h"
 
 #define WORD_LO(x)	((x) & 0xff)
 #define WORD_HI(x)	(WORD_LO((x) >> 8))
@@ -36,12 +37,6 @@ DISPATCH_ASYMCIPHER(decrypt, ps_asym_rsa_decrypt);
 DISPATCH_ASYMCIPHER(gettable_ctx_params, ps_asym_rsa_gettable_ctx_params);
 DISPATCH_ASYMCIPHER(settable_ctx_params, ps_asym_rsa_settable_ctx_params);
 
-struct rsa_pkcs1_tls_params {
-	bool padding;
-	unsigned int client_version;
-	unsigned int alt_version;
-};
-
 static int ps_asym_op_newctx_fwd(struct op_ctx *opctx,
 					    int pkey_type)
 {
@@ -95,11 +90,7 @@ static struct op_ctx *ps_asym_op_newctx(struct provider_ctx *pctx,
 		return NULL;
 	}
 
-	if (ps_asym_op_newctx_fwd(opctx, pkey_type) != OSSL_RV_OK) {
-		op_ctx_free(opctx);
-		return NULL;
-	}
-
+	/* the forward context is created on init or on demand */
 	ps_dbg_debug(&pctx->dbg, "opctx: %p", opctx);
 	return opctx;
 }
@@ -132,6 +123,9 @@ static void *ps_asym_op_dupctx(void *vopctx)
 		return NULL;
 	}
 
+	if (!opctx->fwd_op_ctx)
+		goto out;
+
 	opctx_new->fwd_op_ctx = fwd_dupctx_fn(opctx->fwd_op_ctx);
 	if (!opctx_new->fwd_op_ctx) {
 		put_error_op_ctx(opctx, PS_ERR_DEFAULT_PROV_FUNC_FAILED,
@@ -141,15 +135,208 @@ static void *ps_asym_op_dupctx(void *vopctx)
 	}
 	opctx_new->fwd_op_ctx_free = opctx->fwd_op_ctx_free;
 
+out:
 	ps_opctx_debug(opctx, "opctx_new: %p", opctx_new);
 	return opctx_new;
 }
 
+/* params kept in opctx->params (see op_ctx_params_native()) */
+static const char * const asym_param_keys[] = {
+	OSSL_ASYM_CIPHER_PARAM_PAD_MODE,
+	OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST,
+	OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST,
+	OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL,
+	OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION,
+	OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION,
+	NULL
+};
+
+/* oaep digest, defaults to sha1 as in the default provider */
+static const char *asym_oaep_digest(struct op_ctx *opctx)
+{
+	if (opctx->params.digest[0])
+		return opctx->params.digest;
+
+	return (opctx->params.padmode == RSA_PKCS1_OAEP_PADDING) ?
+		"SHA1" : "";
+}
+
+static int asym_params_get(struct op_ctx *opctx, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+	int rv = OSSL_RV_OK;
+
+	for (p = params; p && p->key && rv; p++) {
+		if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_PAD_MODE))
+			rv = ossl_param_set_padmode(p, opctx->params.padmode);
+		else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST))
+			rv = OSSL_PARAM_set_utf8_string(p,
+					asym_oaep_digest(opctx));
+		else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST))
+			rv = OSSL_PARAM_set_utf8_string(p,
+					opctx->params.mgf1[0] ?
+						opctx->params.mgf1 :
+						asym_oaep_digest(opctx));
+		else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL))
+			rv = OSSL_PARAM_set_octet_ptr(p, opctx->params.label,
+						      opctx->params.labellen);
+		else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION))
+			rv = OSSL_PARAM_set_uint(p, opctx->rsa.client_version);
+		else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION))
+			rv = OSSL_PARAM_set_uint(p, opctx->rsa.alt_version);
+	}
+
+	if (!rv) {
+		put_error_op_ctx(opctx, PS_ERR_INVALID_PARAM,
+				 "unable to get param: %s", (p - 1)->key);
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
+static int asym_params_set(struct op_ctx *opctx, const OSSL_PARAM params[])
+{
+	const OSSL_PARAM *p;
+	void *label = NULL;
+	size_t labellen;
+	char *str;
+
+	for (p = params; p && p->key; p++) {
+		if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_PAD_MODE)) {
+			if (ossl_param_get_padmode(p, &opctx->params.padmode) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_PADDING,
+						 "invalid pad mode");
+				return OSSL_RV_ERR;
+			}
+			opctx->params.padmode_set = true;
+		} else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST)) {
+			str = opctx->params.digest;
+			if (OSSL_PARAM_get_utf8_string(p, &str,
+					sizeof(opctx->params.digest)) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_MD,
+						 "invalid oaep digest");
+				return OSSL_RV_ERR;
+			}
+		} else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST)) {
+			str = opctx->params.mgf1;
+			if (OSSL_PARAM_get_utf8_string(p, &str,
+					sizeof(opctx->params.mgf1)) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_MD,
+						 "invalid mgf1 digest");
+				return OSSL_RV_ERR;
+			}
+		} else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL)) {
+			if (OSSL_PARAM_get_octet_string(p, &label, 0,
+							&labellen) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_PARAM,
+						 "invalid oaep label");
+				return OSSL_RV_ERR;
+			}
+			OPENSSL_free(opctx->params.label);
+			opctx->params.label = label;
+			opctx->params.labellen = label ? labellen : 0;
+			label = NULL;
+		} else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION)) {
+			if (OSSL_PARAM_get_uint(p, &opctx->rsa.client_version) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_PARAM,
+						 "invalid tls client version");
+				return OSSL_RV_ERR;
+			}
+		} else if (!strcmp(p->key, OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION)) {
+			if (OSSL_PARAM_get_uint(p, &opctx->rsa.alt_version) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_PARAM,
+						 "invalid tls negotiated version");
+				return OSSL_RV_ERR;
+			}
+		}
+	}
+
+	return OSSL_RV_OK;
+}
+
+static int asym_set_ctx_params_fwd(struct op_ctx *opctx,
+				   const OSSL_PARAM params[])
+{
+	OSSL_FUNC_asym_cipher_set_ctx_params_fn *fwd_set_params_fn;
+
+	fwd_set_params_fn = (OSSL_FUNC_asym_cipher_set_ctx_params_fn *)
+		fwd_asym_get_func(&opctx->pctx->fwd, opctx->type,
+				  OSSL_FUNC_ASYM_CIPHER_SET_CTX_PARAMS,
+				  &opctx->pctx->dbg);
+
+	/* fwd_set_params_fn is optional */
+	if ((fwd_set_params_fn) &&
+	    (fwd_set_params_fn(opctx->fwd_op_ctx, params) != OSSL_RV_OK)) {
+		put_error_op_ctx(opctx,
+				 PS_ERR_DEFAULT_PROV_FUNC_FAILED,
+				 "fwd_set_params_fn failed");
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
+/*
+ * Decrypt operations of token keys keep their parameters in the op_ctx
+ * and do not need a forward context. It is created for parameters
+ * served by the default provider only, and set up with the state of
+ * the op_ctx.
+ */
+static int asym_op_ctx_fwd(struct op_ctx *opctx)
+{
+	OSSL_PARAM params[7], *p = params;
+
+	if (opctx->fwd_op_ctx)
+		return OSSL_RV_OK;
+
+	if (ps_asym_op_newctx_fwd(opctx, opctx->type) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	ps_opctx_debug(opctx, "opctx: %p, forward context created", opctx);
+
+	if (!op_ctx_params_native(opctx))
+		return OSSL_RV_OK;
+
+	if (opctx->params.padmode_set)
+		*p++ = OSSL_PARAM_construct_int(OSSL_ASYM_CIPHER_PARAM_PAD_MODE,
+						&opctx->params.padmode);
+	if (opctx->params.digest[0])
+		*p++ = OSSL_PARAM_construct_utf8_string(
+				OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST,
+				opctx->params.digest, 0);
+	if (opctx->params.mgf1[0])
+		*p++ = OSSL_PARAM_construct_utf8_string(
+				OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST,
+				opctx->params.mgf1, 0);
+	if (opctx->params.label)
+		*p++ = OSSL_PARAM_construct_octet_string(
+				OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL,
+				opctx->params.label, opctx->params.labellen);
+	if (opctx->rsa.client_version)
+		*p++ = OSSL_PARAM_construct_uint(
+				OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION,
+				&opctx->rsa.client_version);
+	if (opctx->rsa.alt_version)
+		*p++ = OSSL_PARAM_construct_uint(
+				OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION,
+				&opctx->rsa.alt_version);
+	*p = OSSL_PARAM_construct_end();
+
+	if (asym_set_ctx_params_fwd(opctx, params) != OSSL_RV_OK) {
+		op_ctx_free_fwd(opctx);
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
 static int ps_asym_op_get_ctx_params(void *vopctx, OSSL_PARAM params[])
 {
 	OSSL_FUNC_asym_cipher_get_ctx_params_fn *fwd_get_params_fn;
 	struct op_ctx *opctx = vopctx;
 	const OSSL_PARAM *p;
+	bool native;
 
 	if (!opctx)
 		return OSSL_RV_ERR;
@@ -158,6 +345,13 @@ static int ps_asym_op_get_ctx_params(void *vopctx, OSSL_PARAM params[])
 	for (p = params; p && p->key; p++)
 		ps_opctx_debug(opctx, "param: %s", p->key);
 
+	native = op_ctx_params_native(opctx);
+	if (native && !op_ctx_params_fwd(params, asym_param_keys))
+		return asym_params_get(opctx, params);
+
+	if (asym_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	fwd_get_params_fn = (OSSL_FUNC_asym_cipher_get_ctx_params_fn *)
 		fwd_asym_get_func(&opctx->pctx->fwd, opctx->type,
 				  OSSL_FUNC_ASYM_CIPHER_GET_CTX_PARAMS,
@@ -171,14 +365,25 @@ static int ps_asym_op_get_ctx_params(void *vopctx, OSSL_PARAM params[])
 		return OSSL_RV_ERR;
 	}
 
-	return OSSL_RV_OK;
+	return native ? asym_params_get(opctx, params) : OSSL_RV_OK;
 }
 
+/* params the prepared mechanism is derived from */
+static const char * const asym_mech_param_keys[] = {
+	OSSL_ASYM_CIPHER_PARAM_PAD_MODE,
+	OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST,
+	OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST,
+	OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL,
+	OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION,
+	OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION,
+	NULL
+};
+
 static int ps_asym_op_set_ctx_params(void *vopctx, const OSSL_PARAM params[])
 {
-	OSSL_FUNC_asym_cipher_set_ctx_params_fn *fwd_set_params_fn;
 	struct op_ctx *opctx = vopctx;
 	const OSSL_PARAM *p;
+	bool native;
 
 	if (!opctx)
 		return OSSL_RV_ERR;
@@ -187,90 +392,41 @@ static int ps_asym_op_set_ctx_params(void *vopctx, const OSSL_PARAM params[])
 	for (p = params; p && p->key; p++)
 		ps_opctx_debug(opctx, "param: %s", p->key);
 
-	fwd_set_params_fn = (OSSL_FUNC_asym_cipher_set_ctx_params_fn *)
-		fwd_asym_get_func(&opctx->pctx->fwd, opctx->type,
-				  OSSL_FUNC_ASYM_CIPHER_SET_CTX_PARAMS,
-				  &opctx->pctx->dbg);
-
-	/* fwd_set_params_fn is optional */
-	if ((fwd_set_params_fn) &&
-	    (fwd_set_params_fn(opctx->fwd_op_ctx, params) != OSSL_RV_OK)) {
-		put_error_op_ctx(opctx,
-				 PS_ERR_DEFAULT_PROV_FUNC_FAILED,
-				 "fwd_set_params_fn failed");
+	native = op_ctx_params_native(opctx);
+	if (native && (asym_params_set(opctx, params) != OSSL_RV_OK))
 		return OSSL_RV_ERR;
+
+	if (!native || opctx->fwd_op_ctx ||
+	    op_ctx_params_fwd(params, asym_param_keys)) {
+		if ((asym_op_ctx_fwd(opctx) != OSSL_RV_OK) ||
+		    (asym_set_ctx_params_fwd(opctx, params) != OSSL_RV_OK))
+			return OSSL_RV_ERR;
 	}
 
+	op_ctx_mech_params_check(opctx, params, asym_mech_param_keys);
 	return OSSL_RV_OK;
 }
 
-static int asym_mechanism_prepare(struct op_ctx *opctx, CK_MECHANISM_PTR mech,
-				  CK_RSA_PKCS_OAEP_PARAMS_PTR oaep_params,
-				  struct rsa_pkcs1_tls_params *tls_params)
+static int asym_mechanism_prepare_rsa(struct op_ctx *opctx,
+				      CK_MECHANISM_PTR mech,
+				      CK_RSA_PKCS_OAEP_PARAMS_PTR oaep_params)
 {
-	char digest[32], mgf[32];
-	int padmode;
-
-	OSSL_PARAM s_params[] = {
-		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_OAEP_DIGEST,
-				       &digest, sizeof(digest)),
-		OSSL_PARAM_utf8_string(OSSL_ASYM_CIPHER_PARAM_MGF1_DIGEST,
-				       &mgf, sizeof(mgf)),
-		OSSL_PARAM_END
-	};
-	OSSL_PARAM i_params[] = {
-		OSSL_PARAM_int(OSSL_ASYM_CIPHER_PARAM_PAD_MODE, &padmode),
-		OSSL_PARAM_END
-	};
-	OSSL_PARAM p_params[] = {
-		OSSL_PARAM_octet_ptr(OSSL_ASYM_CIPHER_PARAM_OAEP_LABEL,
-				     &oaep_params->pSourceData,
-				     sizeof(oaep_params->pSourceData)),
-		OSSL_PARAM_END
-	};
-	OSSL_PARAM u_params[] = {
-		OSSL_PARAM_uint(OSSL_ASYM_CIPHER_PARAM_TLS_CLIENT_VERSION,
-				&tls_params->client_version),
-		OSSL_PARAM_uint(OSSL_ASYM_CIPHER_PARAM_TLS_NEGOTIATED_VERSION,
-				&tls_params->alt_version),
-		OSSL_PARAM_END
-	};
-
-	if (ps_asym_op_get_ctx_params(opctx, s_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_asym_op_get_ctx_params(string) failed");
-		return OSSL_RV_ERR;
-	}
-
-	if (ps_asym_op_get_ctx_params(opctx, i_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_asym_op_get_ctx_params(int) failed");
-		return OSSL_RV_ERR;
-	}
-
-	if (ps_asym_op_get_ctx_params(opctx, u_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_asym_op_get_ctx_params(uint) failed");
-		return OSSL_RV_ERR;
-	}
-
-	if (ps_asym_op_get_ctx_params(opctx, p_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_asym_op_get_ctx_params(ptr) failed");
-		return OSSL_RV_ERR;
-	}
+	const char *digest = asym_oaep_digest(opctx);
+	const char *mgf = opctx->params.mgf1[0] ?
+				opctx->params.mgf1 :
+				digest;
+	int padmode = opctx->params.padmode;
 
 	if (mechtype_by_id(padmode, &mech->mechanism) != OSSL_RV_OK) {
 		ps_opctx_debug(opctx, "ERROR: mechtype_by_id() failed");
 		return OSSL_RV_ERR;
 	}
 
-	tls_params->padding = (padmode == RSA_PKCS1_WITH_TLS_PADDING);
-	if (!OSSL_PARAM_modified(&u_params[0]))
-		tls_params->client_version = 0;
-	if (!OSSL_PARAM_modified(&u_params[1]))
-		tls_params->alt_version = 0;
+	opctx->rsa.tls_padding = (padmode == RSA_PKCS1_WITH_TLS_PADDING);
 
 	switch(mech->mechanism) {
 	case CKM_RSA_PKCS_OAEP:
-		if (!OSSL_PARAM_modified(&s_params[0]) ||
-		    !OSSL_PARAM_modified(&s_params[1])) {
+		if (!digest[0]) {
 			ps_opctx_debug(opctx, "ERROR: oaep parameters missing");
 			return OSSL_RV_ERR;
 		}
@@ -287,9 +443,10 @@ static int asym_mechanism_prepare(struct op_ctx *opctx, CK_MECHANISM_PTR mech,
 			return OSSL_RV_ERR;
 		}
 
-		if (OSSL_PARAM_modified(&p_params[0])) {
+		if (opctx->params.label) {
 			oaep_params->source = CKZ_DATA_SPECIFIED;
-			oaep_params->ulSourceDataLen = p_params[0].return_size;
+			oaep_params->pSourceData = opctx->params.label;
+			oaep_params->ulSourceDataLen = opctx->params.labellen;
 		} else {
 			oaep_params->source = 0;
 			oaep_params->pSourceData = NULL;
@@ -313,6 +470,23 @@ static int asym_mechanism_prepare(struct op_ctx *opctx, CK_MECHANISM_PTR mech,
 	return OSSL_RV_OK;
 }
 
+/*
+ * The mechanism is built once per init and kept in the op_ctx. It is
+ * rebuilt only if set_ctx_params changed one of its inputs.
+ */
+static int asym_mechanism_prepare(struct op_ctx *opctx, CK_MECHANISM_PTR *mech)
+{
+	if (!opctx->mech.valid) {
+		if (asym_mechanism_prepare_rsa(opctx, &opctx->mech.mech,
+					       &opctx->mech.params.oaep) != OSSL_RV_OK)
+			return OSSL_RV_ERR;
+		opctx->mech.valid = true;
+	}
+
+	*mech = &opctx->mech.mech;
+	return OSSL_RV_OK;
+}
+
 static const OSSL_PARAM *ps_asym_op_gettable_ctx_params(struct op_ctx *opctx,
 							struct provider_ctx *pctx,
 							int pkey_type)
@@ -413,6 +587,9 @@ static int ps_asym_op_encrypt_init(void *vctx, void *vkey,
 		return OSSL_RV_ERR;
 	}
 
+	if (asym_op_ctx_fwd(ctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	return ps_asym_op_encrypt_init_fwd(ctx, key, params);
 }
 
@@ -460,10 +637,13 @@ static int ps_asym_op_decrypt_init(void *vctx, void *vkey,
 		return OSSL_RV_ERR;
 	}
 
-	if (!key->use_pkcs11)
-		return ps_asym_op_decrypt_init_fwd(opctx, key, params);
+	if (key->use_pkcs11)
+		return ps_asym_op_set_ctx_params(opctx, params);
 
-	return OSSL_RV_OK;
+	if (asym_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	return ps_asym_op_decrypt_init_fwd(opctx, key, params);
 }
 
 static int ps_asym_op_encrypt_fwd(struct op_ctx *opctx,
@@ -514,8 +694,7 @@ static int ps_asym_op_encrypt(void *vctx,
 
 static CK_RV asym_op_decrypt_tls(struct op_ctx *opctx,
 			       unsigned char *out, size_t *outlen,
-			       const unsigned char *in, size_t inlen,
-			       struct rsa_pkcs1_tls_params *tls_params)
+			       const unsigned char *in, size_t inlen)
 {
 	CK_BYTE tmp[2][2 + SSL_MAX_MASTER_KEY_LENGTH];
 	size_t len = 2 + SSL_MAX_MASTER_KEY_LENGTH;
@@ -536,13 +715,13 @@ static CK_RV asym_op_decrypt_tls(struct op_ctx *opctx,
 	good &= ct_equals(len, (2 + SSL_MAX_MASTER_KEY_LENGTH));
 
 	ver = 1;
-	ver &= ct_equals(WORD_HI(tls_params->client_version), tmp[1][0]);
-	ver &= ct_equals(WORD_LO(tls_params->client_version), tmp[1][1]);
+	ver &= ct_equals(WORD_HI(opctx->rsa.client_version), tmp[1][0]);
+	ver &= ct_equals(WORD_LO(opctx->rsa.client_version), tmp[1][1]);
 
-	if (tls_params->alt_version > 0) {
+	if (opctx->rsa.alt_version > 0) {
 		alt = 1;
-		alt &= ct_equals(WORD_HI(tls_params->alt_version), tmp[1][0]);
-		alt &= ct_equals(WORD_LO(tls_params->alt_version), tmp[1][1]);
+		alt &= ct_equals(WORD_HI(opctx->rsa.alt_version), tmp[1][0]);
+		alt &= ct_equals(WORD_LO(opctx->rsa.alt_version), tmp[1][1]);
 		ver |= alt;
 	}
 	good &= ver;
@@ -582,19 +761,77 @@ static int ps_asym_op_decrypt_fwd(struct op_ctx *opctx,
 	return OSSL_RV_OK;
 }
 
+struct decrypt_req {
+	struct op_ctx *opctx;
+	CK_MECHANISM_PTR mech;
+	const unsigned char *in;
+	size_t inlen;
+	unsigned char *out;
+	size_t *outlen;
+	int rv;
+};
+
+static void asym_op_decrypt_fn(void *arg)
+{
+	int rv[2] = { OSSL_RV_ERR, OSSL_RV_OK };
+	struct decrypt_req *req = arg;
+	struct op_ctx *opctx = req->opctx;
+	CK_MECHANISM_PTR mech = req->mech;
+	unsigned int good;
+	CK_RV ck_rv;
+
+	req->rv = OSSL_RV_ERR;
+	ck_rv = pkcs11_decrypt_init(&opctx->pctx->pkcs11, opctx->hsession,
+				    mech, opctx->hobject, &opctx->pctx->dbg);
+	if ((ck_rv != CKR_OK) && op_ctx_object_retry(opctx, ck_rv))
+		ck_rv = pkcs11_decrypt_init(&opctx->pctx->pkcs11,
+					    opctx->hsession, mech,
+					    opctx->hobject, &opctx->pctx->dbg);
+	if (ck_rv != CKR_OK) {
+		ps_opctx_debug(opctx, "ERROR: pkcs11_decrypt_init() failed");
+		return;
+	}
+	op_ctx_session_dirty(opctx, true);
+
+	/* the following code must be const time */
+	good = 1;
+	if ((mech->mechanism == CKM_RSA_PKCS) && opctx->rsa.tls_padding) {
+		good &= ct_equals(asym_op_decrypt_tls(opctx, req->out,
+						      req->outlen,
+						      req->in, req->inlen),
+				  CKR_OK);
+	} else {
+		good &= ct_equals(pkcs11_decrypt(&opctx->pctx->pkcs11,
+						 opctx->hsession,
+						 req->in, req->inlen,
+						 req->out, req->outlen,
+						 &opctx->pctx->dbg),
+				  CKR_OK);
+		/*
+		 * out holds at least the modulus size, so C_Decrypt()
+		 * always terminates the operation. The tls path decrypts
+		 * into a short buffer and keeps the session dirty.
+		 */
+		op_ctx_session_dirty(opctx, false);
+	}
+
+	good = !!good;
+	req->rv = rv[good];
+}
+
 static int ps_asym_op_decrypt(struct op_ctx *opctx,
 			      unsigned char *out, size_t *outlen,
 			      size_t outsize, const unsigned char *in,
 			      size_t inlen)
 {
-	struct rsa_pkcs1_tls_params tls_params = {
-		.padding = false,
-		.alt_version = 0,
+	struct decrypt_req req = {
+		.opctx = opctx,
+		.in = in,
+		.inlen = inlen,
+		.out = out,
+		.rv = OSSL_RV_ERR,
 	};
-	int rv[2] = { OSSL_RV_ERR, OSSL_RV_OK };
-	CK_RSA_PKCS_OAEP_PARAMS oaep_params;
-	CK_MECHANISM mech;
-	unsigned int good;
+	CK_MECHANISM_PTR mech;
 	size_t len;
 	int s;
 
@@ -605,17 +842,11 @@ static int ps_asym_op_decrypt(struct op_ctx *opctx,
 		return ps_asym_op_decrypt_fwd(opctx, out, outlen, outsize,
 					      in, inlen);
 
-	if (asym_mechanism_prepare(opctx, &mech, &oaep_params,
-				   &tls_params) != OSSL_RV_OK) {
+	if (asym_mechanism_prepare(opctx, &mech) != OSSL_RV_OK) {
 		ps_opctx_debug(opctx, "ERROR: asym_mechanism_prepare failed");
 		return OSSL_RV_ERR;
 	}
 
-	if (op_ctx_object_ensure(opctx) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: op_ctx_object_ensure() failed");
-		return OSSL_RV_ERR;
-	}
-
 	s = keymgmt_get_size(opctx->key);
 	if (s < 0) {
 		ps_opctx_debug(opctx, "ERROR: keymgmt_get_size failed");
@@ -623,7 +854,7 @@ static int ps_asym_op_decrypt(struct op_ctx *opctx,
 	}
 
 	len = s;
-	if ((mech.mechanism == CKM_RSA_PKCS) && tls_params.padding)
+	if ((mech->mechanism == CKM_RSA_PKCS) && opctx->rsa.tls_padding)
 		len = SSL_MAX_MASTER_KEY_LENGTH;
 
 	if (!out) {
@@ -635,31 +866,15 @@ static int ps_asym_op_decrypt(struct op_ctx *opctx,
 		return OSSL_RV_ERR;
 	}
 
-	if (pkcs11_decrypt_init(&opctx->pctx->pkcs11, opctx->hsession,
-				&mech, opctx->hobject,
-				&opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_decrypt_init() failed");
-		return OSSL_RV_ERR;
-	}
-
-	/* the following code must be const time */
-	good = 1;
-	if ((mech.mechanism == CKM_RSA_PKCS) && tls_params.padding) {
-		good &= ct_equals(asym_op_decrypt_tls(opctx, out, &len,
-						      in, inlen, &tls_params),
-				  CKR_OK);
-	} else {
-		good &= ct_equals(pkcs11_decrypt(&opctx->pctx->pkcs11,
-						 opctx->hsession, in, inlen,
-						 out, &len, &opctx->pctx->dbg),
-				  CKR_OK);
-	}
+	req.mech = mech;
+	req.outlen = &len;
 
+	if (op_ctx_run(opctx, asym_op_decrypt_fn, &req) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
 	*outlen = len;
-	good = !!good;
 
-	ps_opctx_debug(opctx, "good: %lu, outlen: %lu", good, *outlen);
-	return rv[good];
+	ps_opctx_debug(opctx, "rv: %d, outlen: %lu", req.rv, *outlen);
+	return req.rv;
 }
 
 static void *ps_asym_rsa_newctx(void *vprovctx)
@@ -3,13 +3,24 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <string.h>
 #include <openssl/evp.h>
 #include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/rsa.h>
 
 #include "common.h"
 #include "ossl.h"
 #include "object.h"
 #include "fork.h"
+#include "session.h"
+#include "worker.h"
+
+#ifdef RSA_PSS_SALTLEN_AUTO_DIGEST_MAX
+#define PS_PSS_SALTLEN_DEFAULT	RSA_PSS_SALTLEN_AUTO_DIGEST_MAX
+#else
+#define PS_PSS_SALTLEN_DEFAULT	RSA_PSS_SALTLEN_AUTO
+#endif
 
 static int op_ctx_init_key(struct op_ctx *octx, struct obj *key)
 {
@@ -39,33 +50,124 @@ static int op_ctx_init_key(struct op_ctx *octx, struct obj *key)
 	}
 
 	/* update/replace key (implicit NULL check) */
-	obj_free(octx->key);
-	octx->key = obj_get(key);
+	obj_ref_put(octx->key, octx->key_ref);
+	octx->key = key;
+	octx->key_ref = obj_ref_get(key);
 
 	return OSSL_RV_OK;
 }
 
+/*
+ * A thread-bound session is looked up again on each use, as the op_ctx
+ * may be used by another thread than before.
+ */
+static CK_RV op_ctx_session_thread(struct op_ctx *opctx)
+{
+	CK_SESSION_HANDLE hsession = CK_INVALID_HANDLE;
+	CK_RV ck_rv;
+
+	ck_rv = session_thread_get(&opctx->pctx->pkcs11, opctx->key->slot_id,
+				   opctx->key->pin, &hsession, &opctx->tslot,
+				   &opctx->pctx->dbg);
+	if (ck_rv != CKR_OK) {
+		opctx->tslot = NULL;
+		opctx->hsession = CK_INVALID_HANDLE;
+		return ck_rv;
+	}
+
+	opctx->hsession = hsession;
+	return CKR_OK;
+}
+
+/*
+ * Handles of the operation context are only valid in the process, which
+ * created them. After a fork, they are dropped on their next use.
+ */
+void op_ctx_fork_check(struct op_ctx *opctx)
+{
+	unsigned int gen = atfork_generation();
+
+	if (opctx->fork_gen == gen)
+		return;
+
+	ps_opctx_debug(opctx, "opctx: %p, handles dropped (fork)", opctx);
+	opctx->hsession = CK_INVALID_HANDLE;
+	opctx->hsession_dirty = false;
+	opctx->tslot = NULL;
+	opctx->hobject = CK_INVALID_HANDLE;
+	opctx->fork_gen = gen;
+}
+
 int op_ctx_session_ensure(struct op_ctx *opctx)
 {
+	CK_RV ck_rv;
+
 	if (!opctx->key->use_pkcs11) {
 		ps_opctx_debug(opctx, "opctx: %p, fwd-only", opctx);
 		return OSSL_RV_OK;
 	}
 
-	if ((opctx->hsession == CK_INVALID_HANDLE) &&
-	    (pkcs11_session_open_login(&opctx->pctx->pkcs11, opctx->key->slot_id,
-				       &opctx->hsession, opctx->key->pin,
-				       &opctx->pctx->dbg) != CKR_OK)) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_session_open_login() failed");
-		return OSSL_RV_ERR;
+	op_ctx_fork_check(opctx);
+
+	/* a pooled context may hold a session of another slot */
+	if ((opctx->hsession != CK_INVALID_HANDLE) && !opctx->tslot &&
+	    (opctx->hsession_slot != opctx->key->slot_id))
+		session_pool_put(&opctx->pctx->pkcs11, opctx->hsession_slot,
+				 &opctx->hsession, &opctx->pctx->dbg);
+
+	/*
+	 * Within an ASYNC_JOB, the thread may run other jobs, while a worker
+	 * is using the session. Thread sessions are not used in this case.
+	 */
+	if (opctx->tslot && worker_async(&opctx->pctx->pkcs11)) {
+		opctx->tslot = NULL;
+		opctx->hsession = CK_INVALID_HANDLE;
+	}
+
+	if (opctx->pctx->pkcs11.spool.affinity &&
+	    !worker_async(&opctx->pctx->pkcs11) &&
+	    ((opctx->hsession == CK_INVALID_HANDLE) || opctx->tslot)) {
+		ck_rv = op_ctx_session_thread(opctx);
+		if (ck_rv == CKR_OK)
+			goto out;
+		if (ck_rv != CKR_SESSION_COUNT) {
+			ps_opctx_debug(opctx, "ERROR: session_thread_get() failed");
+			pkcs11_token_event(&opctx->pctx->pkcs11, ck_rv);
+			return OSSL_RV_ERR;
+		}
+		/* thread session limit reached, use the session pool */
+	}
+
+	if (opctx->hsession == CK_INVALID_HANDLE) {
+		ck_rv = session_pool_get(&opctx->pctx->pkcs11,
+					 opctx->key->slot_id, opctx->key->pin,
+					 &opctx->hsession, &opctx->pctx->dbg);
+		if (ck_rv != CKR_OK) {
+			ps_opctx_debug(opctx, "ERROR: session_pool_get() failed");
+			pkcs11_token_event(&opctx->pctx->pkcs11, ck_rv);
+			return OSSL_RV_ERR;
+		}
 	}
+	opctx->hsession_slot = opctx->key->slot_id;
 
+out:
 	ps_opctx_debug(opctx, "opctx: %p, hsession: %d",
 		       opctx, opctx->hsession);
 
 	return OSSL_RV_OK;
 }
 
+/*
+ * Mark the session, while a token operation may be active on it. A dirty
+ * thread session is replaced on its next use.
+ */
+void op_ctx_session_dirty(struct op_ctx *opctx, bool dirty)
+{
+	opctx->hsession_dirty = dirty;
+	if (opctx->tslot)
+		opctx->tslot->dirty = dirty;
+}
+
 int op_ctx_object_ensure(struct op_ctx *opctx)
 {
 	if (!opctx->key->use_pkcs11) {
@@ -76,22 +178,98 @@ int op_ctx_object_ensure(struct op_ctx *opctx)
 	if (op_ctx_session_ensure(opctx) != OSSL_RV_OK)
 		return OSSL_RV_ERR;
 
-	if ((opctx->hobject == CK_INVALID_HANDLE) &&
-	    (pkcs11_object_handle(&opctx->pctx->pkcs11,
-				  opctx->hsession,
-				  opctx->key->attrs, opctx->key->nattrs,
-				  &opctx->hobject,
-				  &opctx->pctx->dbg) != CKR_OK)) {
+	if (opctx->hobject != CK_INVALID_HANDLE)
+		goto out;
+
+	opctx->hobject = obj_get_handle(opctx->key);
+	if (opctx->hobject != CK_INVALID_HANDLE) {
+		ps_opctx_debug(opctx, "opctx: %p, hobject: %d (cached)",
+			       opctx, opctx->hobject);
+		return OSSL_RV_OK;
+	}
+
+	if (pkcs11_object_handle(&opctx->pctx->pkcs11,
+				 opctx->hsession,
+				 opctx->key->attrs, opctx->key->nattrs,
+				 &opctx->hobject,
+				 &opctx->pctx->dbg) != CKR_OK) {
 		ps_opctx_debug(opctx, "ERROR: pkcs11_object_handle() failed");
 		return OSSL_RV_ERR;
 	}
 
+	if (opctx->hobject == CK_INVALID_HANDLE) {
+		ps_opctx_debug(opctx, "ERROR: key object not found");
+		pkcs11_token_event(&opctx->pctx->pkcs11,
+				   CKR_OBJECT_HANDLE_INVALID);
+		return OSSL_RV_ERR;
+	}
+
+	obj_set_handle(opctx->key, opctx->hobject);
+out:
 	ps_opctx_debug(opctx, "opctx: %p, hobject: %d",
 		       opctx, opctx->hobject);
 
 	return OSSL_RV_OK;
 }
 
+/*
+ * Check, if an operation failed due to a stale object handle. In this case,
+ * the cached handle is dropped and looked up again, so that the caller can
+ * retry the operation once.
+ */
+int op_ctx_object_retry(struct op_ctx *opctx, CK_RV ck_rv)
+{
+	switch (ck_rv) {
+	case CKR_KEY_HANDLE_INVALID:
+	case CKR_OBJECT_HANDLE_INVALID:
+		break;
+	default:
+		return OSSL_RV_FALSE;
+	}
+
+	ps_opctx_debug(opctx, "opctx: %p, hobject: %d invalid",
+		       opctx, opctx->hobject);
+	pkcs11_token_event(&opctx->pctx->pkcs11, ck_rv);
+
+	obj_invalidate_handle(opctx->key, opctx->hobject);
+	opctx->hobject = CK_INVALID_HANDLE;
+
+	return (op_ctx_object_ensure(opctx) == OSSL_RV_OK) ?
+		OSSL_RV_TRUE : OSSL_RV_FALSE;
+}
+
+/*
+ * Run a token operation of opctx. Slots with a worker queue run it by a
+ * queue worker, otherwise it is run with the session of opctx.
+ */
+int op_ctx_run(struct op_ctx *opctx, void (*fn)(void *arg), void *arg)
+{
+	struct worker_queue *wq;
+
+	wq = worker_queue_get(&opctx->pctx->pkcs11, opctx->key->slot_id);
+	if (wq)
+		return worker_queue_run(wq, opctx, fn, arg);
+
+	if (op_ctx_object_ensure(opctx) != OSSL_RV_OK) {
+		ps_opctx_debug(opctx, "ERROR: op_ctx_object_ensure() failed");
+		return OSSL_RV_ERR;
+	}
+
+	worker_run(&opctx->pctx->pkcs11, fn, arg, &opctx->pctx->dbg);
+	return OSSL_RV_OK;
+}
+
+/* defaults of the operation parameters, as set by the forward provider */
+static void op_ctx_params_reset(struct op_ctx *opctx)
+{
+	OPENSSL_free(opctx->params.label);
+	memset(&opctx->params, 0, sizeof(opctx->params));
+	memset(&opctx->rsa, 0, sizeof(opctx->rsa));
+
+	opctx->params.padmode = RSA_PKCS1_PADDING;
+	opctx->params.saltlen = PS_PSS_SALTLEN_DEFAULT;
+}
+
 int op_ctx_init(struct op_ctx *octx, struct obj *key, int operation)
 {
 	struct dbg *dbg = &octx->pctx->dbg;
@@ -103,10 +281,434 @@ int op_ctx_init(struct op_ctx *octx, struct obj *key, int operation)
 	    return OSSL_RV_ERR;
 
 	octx->operation = operation;
+	octx->mech.valid = false;
+	op_ctx_params_reset(octx);
+
+	return OSSL_RV_OK;
+}
+
+/*
+ * Sign and decrypt operations with token keys keep their parameters in
+ * opctx->params and create the forward context only on demand.
+ */
+bool op_ctx_params_native(struct op_ctx *opctx)
+{
+	if (!opctx->key || !opctx->key->use_pkcs11)
+		return false;
+
+	switch (opctx->operation) {
+	case EVP_PKEY_OP_SIGN:
+	case EVP_PKEY_OP_DECRYPT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* check, if params contain a key, which is not kept natively */
+bool op_ctx_params_fwd(const OSSL_PARAM params[], const char * const keys[])
+{
+	const OSSL_PARAM *p;
+	const char * const *k;
+
+	for (p = params; p && p->key; p++) {
+		for (k = keys; *k; k++) {
+			if (strcmp(p->key, *k) == 0)
+				break;
+		}
+		if (!*k)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Drop the prepared mechanism, if params set one of the keys it has
+ * been derived from.
+ */
+void op_ctx_mech_params_check(struct op_ctx *opctx, const OSSL_PARAM params[],
+			      const char * const keys[])
+{
+	const char * const *k;
+
+	if (!opctx->mech.valid || !params)
+		return;
+
+	for (k = keys; *k; k++) {
+		if (OSSL_PARAM_locate_const(params, *k)) {
+			ps_opctx_debug(opctx, "opctx: %p, mechanism invalidated by param: %s",
+				       opctx, *k);
+			opctx->mech.valid = false;
+			return;
+		}
+	}
+}
+
+void op_ctx_free_fwd(struct op_ctx *opctx)
+{
+	if (!opctx || !opctx->fwd_op_ctx || !opctx->fwd_op_ctx_free)
+		return;
+
+	opctx->fwd_op_ctx_free(opctx->fwd_op_ctx);
+	opctx->fwd_op_ctx = NULL;
+}
+
+/*
+ * Released operation contexts are kept in a pool for reuse by the next
+ * op_ctx_new(). Each thread caches up to size contexts without locking,
+ * the shared list of the pool takes up to size more from other threads
+ * and from exiting threads. A pooled context keeps its allocation, its
+ * (reset) digest context and its property string. Its session is returned
+ * to the session pool, which bounds the idle sessions.
+ */
+static void op_ctx_destroy(struct op_ctx *opctx)
+{
+	op_ctx_teardown_pkcs11(opctx);
+
+	op_ctx_free_fwd(opctx);
+	EVP_MD_free(opctx->md);
+	EVP_MD_CTX_free(opctx->mdctx);
+	obj_ref_put(opctx->key, opctx->key_ref);
+	OPENSSL_free(opctx->params.label);
+	OPENSSL_free(opctx->prop);
+	OPENSSL_free(opctx);
+}
+
+/* reset opctx to the state of a new context, keeping reusable resources */
+static bool op_ctx_recycle(struct op_ctx *opctx)
+{
+	struct op_ctx keep;
+
+	op_ctx_fork_check(opctx);
+
+	/* thread sessions stay with their thread */
+	if (opctx->tslot)
+		opctx->hsession = CK_INVALID_HANDLE;
+	else if (opctx->hsession_dirty)
+		pkcs11_session_close(&opctx->pctx->pkcs11, &opctx->hsession,
+				     &opctx->pctx->dbg);
+
+	if (opctx->mdctx && (EVP_MD_CTX_reset(opctx->mdctx) != OSSL_RV_OK))
+		return false;
+
+	op_ctx_free_fwd(opctx);
+	EVP_MD_free(opctx->md);
+	obj_ref_put(opctx->key, opctx->key_ref);
+	OPENSSL_free(opctx->params.label);
+
+	keep = *opctx;
+	memset(opctx, 0, sizeof(*opctx));
+	opctx->pctx = keep.pctx;
+	opctx->prop = keep.prop;
+	opctx->mdctx = keep.mdctx;
+	opctx->hsession = keep.hsession;
+	opctx->hsession_slot = keep.hsession_slot;
+	opctx->hobject = CK_INVALID_HANDLE;
+	opctx->fork_gen = keep.fork_gen;
+
+	return true;
+}
+
+/*
+ * Pools with per-thread caches. The exit handler of a thread may still
+ * run, while the pool is torn down: a thread cache is owned by whoever
+ * unlinks it from its pool under tcaches.mutex, the exit handler of its
+ * thread or the teardown. The handler looks the cache up by address and
+ * thread (the cache may be freed already) and the teardown waits for
+ * handlers moving contexts of the pool. The mutex is never destroyed.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct op_ctx_pool *pools;
+} tcaches = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void op_ctx_pool_thread_exit(void *arg)
+{
+	struct op_ctx_tcache **ptc, *tc = NULL;
+	struct op_ctx_pool *pool;
+	struct op_ctx *opctx;
 
+	if (pthread_mutex_lock(&tcaches.mutex))
+		return;
+
+	/* ----- locked ----- */
+	for (pool = tcaches.pools; pool && !tc; pool = pool->tnext) {
+		for (ptc = &pool->threads; *ptc; ptc = &(*ptc)->next) {
+			if ((*ptc == arg) &&
+			    pthread_equal((*ptc)->thread, pthread_self())) {
+				tc = *ptc;
+				*ptc = tc->next;
+				pool->texiting++;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&tcaches.mutex);
+	/* ----- unlocked ----- */
+
+	/* taken by the teardown */
+	if (!tc)
+		return;
+
+	pool = tc->pool;
+	if (pthread_mutex_lock(&pool->mutex))
+		goto out;
+
+	/* ----- locked ----- */
+	while (tc->free && (pool->nfree < pool->size)) {
+		opctx = tc->free;
+		tc->free = opctx->next;
+		opctx->next = pool->free;
+		pool->free = opctx;
+		pool->nfree++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+out:
+	while ((opctx = tc->free)) {
+		tc->free = opctx->next;
+		op_ctx_destroy(opctx);
+	}
+	OPENSSL_free(tc);
+
+	pthread_mutex_lock(&tcaches.mutex);
+	if (!--pool->texiting)
+		pthread_cond_broadcast(&tcaches.cond);
+	pthread_mutex_unlock(&tcaches.mutex);
+}
+
+static struct op_ctx_tcache *op_ctx_pool_thread(struct op_ctx_pool *pool,
+						 bool create)
+{
+	struct op_ctx_tcache *tc;
+
+	tc = pthread_getspecific(pool->tkey);
+	if (tc || !create)
+		return tc;
+
+	tc = OPENSSL_zalloc(sizeof(*tc));
+	if (!tc)
+		return NULL;
+	tc->pool = pool;
+	tc->thread = pthread_self();
+
+	if (pthread_mutex_lock(&tcaches.mutex)) {
+		OPENSSL_free(tc);
+		return NULL;
+	}
+
+	/* ----- locked ----- */
+	if (pthread_setspecific(pool->tkey, tc)) {
+		pthread_mutex_unlock(&tcaches.mutex);
+		OPENSSL_free(tc);
+		return NULL;
+	}
+	tc->next = pool->threads;
+	pool->threads = tc;
+	pthread_mutex_unlock(&tcaches.mutex);
+	/* ----- unlocked ----- */
+
+	return tc;
+}
+
+static struct op_ctx *op_ctx_pool_get(struct op_ctx_pool *pool)
+{
+	struct op_ctx_tcache *tc;
+	struct op_ctx *opctx = NULL;
+
+	if (!pool->size)
+		return NULL;
+
+	tc = op_ctx_pool_thread(pool, false);
+	if (tc && tc->free) {
+		opctx = tc->free;
+		tc->free = opctx->next;
+		tc->nfree--;
+		goto out;
+	}
+
+	if (pthread_mutex_lock(&pool->mutex))
+		return NULL;
+
+	/* ----- locked ----- */
+	opctx = pool->free;
+	if (opctx) {
+		pool->free = opctx->next;
+		pool->nfree--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+out:
+	if (opctx)
+		opctx->next = NULL;
+	return opctx;
+}
+
+static bool op_ctx_pool_put(struct op_ctx_pool *pool, struct op_ctx *opctx)
+{
+	struct op_ctx_tcache *tc;
+
+	if (!pool->size)
+		return false;
+
+	/* idle sessions are kept (and bounded) by the session pool */
+	op_ctx_teardown_pkcs11(opctx);
+
+	tc = op_ctx_pool_thread(pool, true);
+	if (tc && (tc->nfree < pool->size)) {
+		opctx->next = tc->free;
+		tc->free = opctx;
+		tc->nfree++;
+		return true;
+	}
+
+	if (pthread_mutex_lock(&pool->mutex))
+		return false;
+
+	/* ----- locked ----- */
+	if (pool->nfree >= pool->size) {
+		pthread_mutex_unlock(&pool->mutex);
+		return false;
+	}
+	opctx->next = pool->free;
+	pool->free = opctx;
+	pool->nfree++;
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+	return true;
+}
+
+int op_ctx_pool_init(struct pkcs11_module *pkcs, unsigned int size,
+		     struct dbg *dbg)
+{
+	struct op_ctx_pool *pool = &pkcs->opool;
+	int rc;
+
+	memset(pool, 0, sizeof(*pool));
+	ps_dbg_debug(dbg, "pkcs: %p, op_ctx pool size: %u", pkcs, size);
+
+	if (!size)
+		return OSSL_RV_OK;
+
+	rc = pthread_mutex_init(&pool->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	rc = pthread_key_create(&pool->tkey, op_ctx_pool_thread_exit);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_key_create() failed: %d",
+			     pkcs, rc);
+		pthread_mutex_destroy(&pool->mutex);
+		return OSSL_RV_ERR;
+	}
+
+	pool->tcache = true;
+	pool->size = size;
+
+	pthread_mutex_lock(&tcaches.mutex);
+	pool->tnext = tcaches.pools;
+	tcaches.pools = pool;
+	pthread_mutex_unlock(&tcaches.mutex);
 	return OSSL_RV_OK;
 }
 
+void op_ctx_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct op_ctx_pool *pool = &pkcs->opool, **ppool;
+	struct op_ctx_tcache *tc, *threads;
+	struct op_ctx *opctx;
+
+	if (!pool->tcache)
+		return;
+
+	/* no more thread exit handlers from here on */
+	pthread_key_delete(pool->tkey);
+
+	pthread_mutex_lock(&tcaches.mutex);
+	for (ppool = &tcaches.pools; *ppool; ppool = &(*ppool)->tnext) {
+		if (*ppool == pool) {
+			*ppool = pool->tnext;
+			break;
+		}
+	}
+	threads = pool->threads;
+	pool->threads = NULL;
+	while (pool->texiting)
+		pthread_cond_wait(&tcaches.cond, &tcaches.mutex);
+	pthread_mutex_unlock(&tcaches.mutex);
+
+	pool->tcache = false;
+	pool->size = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while ((tc = threads)) {
+		threads = tc->next;
+		while ((opctx = tc->free)) {
+			tc->free = opctx->next;
+			op_ctx_destroy(opctx);
+		}
+		OPENSSL_free(tc);
+	}
+
+	while ((opctx = pool->free)) {
+		pool->free = opctx->next;
+		op_ctx_destroy(opctx);
+	}
+	pool->nfree = 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	ps_dbg_info(dbg, "pkcs: %p, op_ctx pool: shared hits: %lu, misses: %lu",
+		    pkcs, pool->hits, pool->misses);
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void op_ctx_pool_lock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->opool.tcache)
+		pthread_mutex_lock(&pkcs->opool.mutex);
+}
+
+void op_ctx_pool_unlock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->opool.tcache)
+		pthread_mutex_unlock(&pkcs->opool.mutex);
+}
+
+/* over fork, for the thread caches of all pools */
+void op_ctx_threads_lock(void)
+{
+	pthread_mutex_lock(&tcaches.mutex);
+}
+
+void op_ctx_threads_unlock(void)
+{
+	pthread_mutex_unlock(&tcaches.mutex);
+}
+
+/* atfork child (locked): the exiting threads are gone */
+void op_ctx_threads_forget(void)
+{
+	struct op_ctx_pool *pool;
+
+	for (pool = tcaches.pools; pool; pool = pool->tnext)
+		pool->texiting = 0;
+}
+
 struct op_ctx *op_ctx_new(struct provider_ctx *pctx, const char *prop, int type)
 {
 	struct op_ctx *opctx;
@@ -114,20 +716,31 @@ struct op_ctx *op_ctx_new(struct provider_ctx *pctx, const char *prop, int type)
 	if (!pctx)
 		return NULL;
 
+	opctx = op_ctx_pool_get(&pctx->pkcs11.opool);
+	if (opctx) {
+		ps_pctx_debug(pctx, "opctx: %p (pooled)", opctx);
+		goto init;
+	}
+
 	opctx = OPENSSL_zalloc(sizeof(struct op_ctx));
 	if (!opctx)
 		return NULL;
 
 	opctx->pctx = pctx;
-	opctx->type = type;
-	if (prop)
-		opctx->prop = OPENSSL_strdup(prop);
-
 	opctx->hsession = CK_INVALID_HANDLE;
-	atforkpool_register_sessionhandle(&opctx->hsession, &pctx->dbg);
-
 	opctx->hobject = CK_INVALID_HANDLE;
-	atforkpool_register_objecthandle(&opctx->hobject, &pctx->dbg);
+	opctx->fork_gen = atfork_generation();
+
+init:
+	opctx->type = type;
+
+	/* the property string of the pooled context is mostly the same */
+	if (opctx->prop && (!prop || strcmp(opctx->prop, prop))) {
+		OPENSSL_free(opctx->prop);
+		opctx->prop = NULL;
+	}
+	if (prop && !opctx->prop)
+		opctx->prop = OPENSSL_strdup(prop);
 
 	return opctx;
 }
@@ -147,6 +760,15 @@ struct op_ctx *op_ctx_dup(struct op_ctx * opctx)
 		goto err;
 
 	opctx_new->operation = opctx->operation;
+	opctx_new->rsa = opctx->rsa;
+
+	opctx_new->params = opctx->params;
+	if (opctx->params.label) {
+		opctx_new->params.label = OPENSSL_memdup(opctx->params.label,
+							 opctx->params.labellen);
+		if (!opctx_new->params.label)
+			goto err;
+	}
 
 	return opctx_new;
 
@@ -157,32 +779,50 @@ err:
 
 void op_ctx_teardown_pkcs11(struct op_ctx *opctx)
 {
-	pkcs11_session_close(&opctx->pctx->pkcs11, &opctx->hsession,
-			     &opctx->pctx->dbg);
+	op_ctx_fork_check(opctx);
+
+	/*
+	 * A session with a possibly unfinished token operation must not
+	 * be handed out to another operation context. Thread sessions stay
+	 * with their thread.
+	 */
+	if (opctx->tslot)
+		opctx->hsession = CK_INVALID_HANDLE;
+	else if (opctx->hsession_dirty)
+		pkcs11_session_close(&opctx->pctx->pkcs11, &opctx->hsession,
+				     &opctx->pctx->dbg);
+	else
+		session_pool_put(&opctx->pctx->pkcs11, opctx->hsession_slot,
+				 &opctx->hsession, &opctx->pctx->dbg);
 
 	opctx->hsession = CK_INVALID_HANDLE;
+	opctx->hsession_dirty = false;
+	opctx->tslot = NULL;
 	opctx->hobject = CK_INVALID_HANDLE;
 }
 
-static void op_ctx_free_fwd(struct op_ctx *opctx)
+void op_ctx_free(struct op_ctx *octx)
 {
-	if (!opctx || !opctx->fwd_op_ctx || !opctx->fwd_op_ctx_free)
+	if (!octx)
 		return;
 
-	opctx->fwd_op_ctx_free(opctx->fwd_op_ctx);
+	if (op_ctx_recycle(octx) &&
+	    op_ctx_pool_put(&octx->pctx->pkcs11.opool, octx))
+		return;
+
+	op_ctx_destroy(octx);
 }
 
-void op_ctx_free(struct op_ctx *octx)
+/* FNV-1a */
+unsigned long ps_hash(const void *p, size_t len)
 {
-	op_ctx_teardown_pkcs11(octx);
-
-	atforkpool_unregister_objecthandle(&octx->hobject, &octx->pctx->dbg);
-	atforkpool_unregister_sessionhandle(&octx->hsession, &octx->pctx->dbg);
+	const unsigned char *b = p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
 
-	op_ctx_free_fwd(octx);
-	EVP_MD_free(octx->md);
-	EVP_MD_CTX_free(octx->mdctx);
-	obj_free(octx->key);
-	OPENSSL_free(octx->prop);
-	OPENSSL_free(octx);
+	for (i = 0; i < len; i++) {
+		h ^= b[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (unsigned long)h;
 }
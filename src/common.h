@@ -7,6 +7,7 @@
 #define _PKCS11SIGN_COMMON_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <bits/types/FILE.h>
 #include <openssl/evp.h>
 #include <openssl/types.h>
@@ -23,13 +24,209 @@
 
 #define PS_PROV_NAME		"pkcs11sign"
 #define PS_PROV_RSA_DEFAULT_MD	"SHA-1"
+#define PS_DIGEST_NAME_MAX	32
 
 #define DECL_DISPATCH_FUNC(type, tname, name) \
 	static OSSL_FUNC_##type##_##tname##_fn name
 
 typedef void (*func_t)(void);
 
+struct session_slot {
+	CK_SLOT_ID slot_id;
+	CK_SESSION_HANDLE_PTR idle;
+	unsigned int nidle;
+};
+
+struct session_tslot {
+	CK_SLOT_ID slot_id;
+	CK_SESSION_HANDLE hsession;
+	bool dirty;
+	struct session_tslot *next;
+};
+
+struct session_thread {
+	struct pkcs11_module *pkcs;
+	struct dbg *dbg;
+	pthread_t thread;
+	struct session_tslot *tslots;
+	struct session_thread *next;
+};
+
+struct session_pool {
+	pthread_mutex_t mutex;
+	unsigned int size;
+	struct session_slot *slots;
+	unsigned int nslots;
+	unsigned long hits;
+	unsigned long misses;
+
+	/* thread affinity */
+	bool affinity;
+	pthread_key_t tkey;
+	struct session_thread *threads;
+	unsigned int tmax;
+	unsigned int tcount;
+	/* exit handlers closing sessions of the pool */
+	unsigned int texiting;
+	struct session_pool *tnext;
+};
+
+struct worker_req {
+	void (*fn)(void *arg);
+	void *arg;
+	struct op_ctx *opctx;
+	/* wait fd of the job, copy written and closed by the worker */
+	int fd;
+	int wake_fd;
+	/* synchronous callers (wake_fd < 0) */
+	pthread_cond_t cond;
+	bool done;
+	int rv;
+	uint64_t queued_ns;
+	struct worker_req *next;
+};
+
+struct worker_queue {
+	struct pkcs11_module *pkcs;
+	struct dbg *dbg;
+	CK_SLOT_ID slot_id;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct worker_req **ring;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	unsigned int nthreads;
+	unsigned int nstarted;
+	pthread_t *threads;
+	bool stop;
+
+	/* requests of ASYNC_JOBs, which wait for room in the ring */
+	struct worker_req *pending_head;
+	struct worker_req *pending_tail;
+
+	/* statistics */
+	unsigned long nreqs;
+	unsigned long npending;
+	unsigned int depth_max;
+	uint64_t wait_ns;
+	uint64_t service_ns;
+
+	struct worker_queue *next;
+};
+
+struct worker_pool {
+	bool initialized;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int nthreads;
+	unsigned int nstarted;
+	pthread_t *threads;
+	bool stop;
+	struct worker_req *head;
+	struct worker_req *tail;
+	struct worker_queue *queues;
+};
+
+struct op_ctx_tcache {
+	struct op_ctx_pool *pool;
+	pthread_t thread;
+	struct op_ctx *free;
+	unsigned int nfree;
+	struct op_ctx_tcache *next;
+};
+
+struct op_ctx_pool {
+	pthread_mutex_t mutex;
+	unsigned int size;
+	struct op_ctx *free;
+	unsigned int nfree;
+	unsigned long hits;
+	unsigned long misses;
+
+	/* per-thread caches in front of the shared list */
+	bool tcache;
+	pthread_key_t tkey;
+	struct op_ctx_tcache *threads;
+	/* exit handlers moving contexts of the pool */
+	unsigned int texiting;
+	struct op_ctx_pool *tnext;
+};
+
+struct store_cache_entry;
+
+struct store_cache {
+	pthread_mutex_t mutex;
+	/* seconds, 0: disabled */
+	unsigned int ttl;
+	struct store_cache_entry *entries;
+	unsigned int nentries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct pkey_cache_entry;
+
+struct pkey_cache {
+	pthread_mutex_t mutex;
+	/* PS_PKEY_CACHE_BUCKETS chains */
+	struct pkey_cache_entry **buckets;
+	unsigned int nentries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct key_index_slot;
+
+struct key_index {
+	bool enabled;
+	pthread_mutex_t mutex;
+	struct key_index_slot *slots;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long builds;
+};
+
+/* blank padded PKCS#11 string without the padding */
+#define PKCS11_STR_MAX		64
+struct pkcs11_str {
+	size_t len;
+	char s[PKCS11_STR_MAX + 1];
+};
+
+struct pkcs11_slot {
+	CK_SLOT_ID id;
+	bool has_slot_info;
+	CK_SLOT_INFO si;
+	struct pkcs11_str slt_manuf;
+	struct pkcs11_str slt_desc;
+	bool has_token_info;
+	CK_TOKEN_INFO ti;
+	struct pkcs11_str tok_label;
+	struct pkcs11_str tok_manuf;
+	struct pkcs11_str tok_serial;
+	struct pkcs11_str tok_model;
+};
+
+/* snapshot of the slot list, see pkcs11_slots_get() */
+struct pkcs11_slots {
+	unsigned int refcnt;
+	unsigned int fork_gen;
+	unsigned int token_gen;
+	CK_ULONG nslots;
+	struct pkcs11_slot slot[];
+};
+
+struct slot_cache {
+	pthread_mutex_t mutex;
+	struct pkcs11_slots *slots;
+};
+
+#define PS_CACHELINE_SIZE	64
+
 struct pkcs11_module {
+	/* read-mostly, used by each token call (see module_ensure()) */
 	char *soname;
 	void *dlhandle;
 	char *initargs;
@@ -38,15 +235,51 @@ struct pkcs11_module {
 		PKCS11_UNINITIALIZED = 0,
 		PKCS11_INITIALIZED,
 	} state;
-	pthread_mutex_t mutex;
 	bool do_finalize;
+	pthread_mutex_t mutex;
+	/*
+	 * keeps the members above off the cache lines of the pools, which
+	 * are written by each operation (the module is not aligned)
+	 */
+	char pad[PS_CACHELINE_SIZE];
+	struct session_pool spool;
+	struct worker_pool wpool;
+	struct op_ctx_pool opool;
+	struct store_cache scache;
+	struct slot_cache slots;
+	struct key_index kindex;
+	struct pkey_cache pkcache;
+	/* handles per C_FindObjects() call */
+	unsigned int find_batch;
+	/* incremented on token events, see pkcs11_token_event() */
+	unsigned int token_gen;
 };
 
+enum fwd_op {
+	FWD_OP_KEYMGMT = 0,
+	FWD_OP_KEYEXCH,
+	FWD_OP_ASYM_CIPHER,
+	FWD_OP_SIGNATURE,
+	FWD_OP_MAX,
+};
+
+enum fwd_key {
+	FWD_KEY_RSA = 0,
+	FWD_KEY_RSA_PSS,
+	FWD_KEY_EC,
+	FWD_KEY_MAX,
+};
+
+#define FWD_FUNC_ID_MAX		64
+
 struct ossl_provider {
 	const char *name;
 	OSSL_PROVIDER *provider;
 	void *ctx;
-	const OSSL_ALGORITHM *alg_cache[OSSL_OP__HIGHEST];
+	/* forward functions, resolved once at init (read-only afterwards) */
+	func_t funcs[FWD_OP_MAX][FWD_KEY_MAX][FWD_FUNC_ID_MAX];
+	/* see fwd_sign_gettable_merge() */
+	OSSL_PARAM *sign_gettable[FWD_KEY_MAX];
 };
 
 struct ossl_core {
@@ -63,6 +296,8 @@ struct ossl_core {
 struct dbg {
 	FILE *stream;
 	unsigned int level;
+	/* stream written by the logger thread (see debug.c) */
+	bool logger;
 };
 
 struct provider_ctx {
@@ -73,21 +308,47 @@ struct provider_ctx {
 };
 #define ps_pctx_debug(pctx, fmt...)	ps_dbg_debug(&(pctx->dbg), fmt)
 
+struct obj_ref_shard {
+	long count;
+} __attribute__((aligned(PS_CACHELINE_SIZE)));
+
+/* per-CPU counts of operation references, see obj_ref_get() */
+struct obj_refs {
+	void *mem;
+	unsigned int nshards;
+	struct obj_ref_shard shard[];
+};
+
 struct obj {
 	/* common */
 	unsigned int refcnt;
+	struct obj_refs *refs;
+	bool refs_dead;
 	struct provider_ctx *pctx;
 	int type;
 
 	/* fwd */
 	void *fwd_key;
+	/* fwd_key is shared, see keymgmt_fetch_pki() */
+	struct pkey_cache_entry *fwd_shared;
 
 	/* pkcs11 */
 	bool use_pkcs11;
 	CK_SLOT_ID slot_id;
 	char *pin;
+	/* attributes and values, see pkcs11_attrs_pack() */
 	CK_ATTRIBUTE_PTR attrs;
 	CK_ULONG nattrs;
+	CK_OBJECT_HANDLE hobject;
+	unsigned int hobject_gen;
+
+	/* rsa: modulus size, ec: order size (bytes) */
+	unsigned int keylen;
+
+	/* key parameters, cached at load (0: not cached) */
+	int bits;
+	int security_bits;
+	int max_size;
 };
 #define ps_obj_debug(obj, fmt...)	ps_dbg_debug(&(obj->pctx->dbg), fmt)
 
@@ -103,8 +364,41 @@ struct op_ctx {
 
 	/* pkcs11 */
 	struct obj *key;
+	/* see obj_ref_get() */
+	int key_ref;
 	CK_OBJECT_HANDLE hobject;
 	CK_SESSION_HANDLE hsession;
+	CK_SLOT_ID hsession_slot;
+	bool hsession_dirty;
+	struct session_tslot *tslot;
+	unsigned int fork_gen;
+
+	/* prepared mechanism, rebuilt after init or relevant param changes */
+	struct {
+		bool valid;
+		CK_MECHANISM mech;
+		union {
+			CK_RSA_PKCS_PSS_PARAMS pss;
+			CK_RSA_PKCS_OAEP_PARAMS oaep;
+		} params;
+	} mech;
+
+	/*
+	 * Parameters of sign and decrypt operations with token keys. These
+	 * don't use a forward context, unless a parameter, which is not
+	 * kept here, is accessed.
+	 */
+	struct {
+		int padmode;
+		int saltlen;
+		char digest[PS_DIGEST_NAME_MAX];
+		char mgf1[PS_DIGEST_NAME_MAX];
+		unsigned char *label;
+		size_t labellen;
+		bool padmode_set;
+		bool saltlen_set;
+		bool digest_fixed;
+	} params;
 
 	/* fwd */
 	void *fwd_op_ctx;
@@ -116,16 +410,41 @@ struct op_ctx {
 		unsigned int client_version;
 		unsigned int alt_version;
 	} rsa;
+
+	/* op_ctx pool */
+	struct op_ctx *next;
 };
 #define ps_opctx_debug(opctx, fmt...)	ps_dbg_debug(&(opctx->pctx->dbg), fmt)
 
+void op_ctx_fork_check(struct op_ctx *opctx);
 int op_ctx_session_ensure(struct op_ctx *opctx);
+void op_ctx_session_dirty(struct op_ctx *opctx, bool dirty);
 int op_ctx_object_ensure(struct op_ctx *opctx);
+int op_ctx_object_retry(struct op_ctx *opctx, CK_RV ck_rv);
+int op_ctx_run(struct op_ctx *opctx, void (*fn)(void *arg), void *arg);
 int op_ctx_init(struct op_ctx *octx, struct obj *key, int operation);
+bool op_ctx_params_native(struct op_ctx *opctx);
+bool op_ctx_params_fwd(const OSSL_PARAM params[], const char * const keys[]);
+void op_ctx_mech_params_check(struct op_ctx *opctx, const OSSL_PARAM params[],
+			      const char * const keys[]);
 struct op_ctx *op_ctx_new(struct provider_ctx *pctx, const char *prop, int type);
 struct op_ctx *op_ctx_dup(struct op_ctx * opctx);
 void op_ctx_teardown_pkcs11(struct op_ctx *opctx);
 void op_ctx_free(struct op_ctx *octx);
+void op_ctx_free_fwd(struct op_ctx *opctx);
+
+#define PS_OP_CTX_POOL_SIZE_DEFAULT	16
+
+int op_ctx_pool_init(struct pkcs11_module *pkcs, unsigned int size,
+		     struct dbg *dbg);
+void op_ctx_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void op_ctx_pool_lock(struct pkcs11_module *pkcs);
+void op_ctx_pool_unlock(struct pkcs11_module *pkcs);
+void op_ctx_threads_lock(void);
+void op_ctx_threads_unlock(void);
+void op_ctx_threads_forget(void);
+
+unsigned long ps_hash(const void *p, size_t len);
 
 extern struct dbg *hack_dbg;
 
@@ -3,17 +3,90 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <openssl/crypto.h>
 
 #include "debug.h"
 
 #define PKCS11SIGN_ENV_DBG	"PKCS11SIGN_DEBUG"
 #define PKCS11SIGN_ENV_DBG_LVL	"PKCS11SIGN_DEBUG_LEVEL"
 
+/*
+ * Asynchronous logger: each thread formats its messages into a ring of its
+ * own (single producer, single consumer). The logger thread writes the
+ * rings to the debug streams with writev(). A message, which does not fit
+ * into the ring, is dropped and counted: logging threads never wait for
+ * the stream or for each other.
+ */
+#define DBG_RING_SIZE		(64 * 1024)	/* power of 2 */
+#define DBG_LINE_MAX		1024
+#define DBG_FLUSH_MS		10
+#define DBG_IOV_MAX		64
+
+struct dbg_rec {
+	unsigned int len;
+	/* -1: padding up to the end of the ring */
+	int fd;
+	char text[];
+};
+
+struct dbg_ring {
+	void *mem;
+	pid_t tid;
+	/* logger lock */
+	bool orphan;
+	struct dbg_ring *next;
+
+	/* written by the thread */
+	unsigned long tail __attribute__((aligned(PS_CACHELINE_SIZE)));
+	unsigned long dropped;
+	int drop_fd;
+
+	/* written by the logger */
+	unsigned long head __attribute__((aligned(PS_CACHELINE_SIZE)));
+
+	char buf[DBG_RING_SIZE] __attribute__((aligned(PS_CACHELINE_SIZE)));
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	/* logger draining, no wake-up needed */
+	bool awake;
+
+	/* debug contexts with a stream */
+	unsigned int users;
+	struct dbg_ring *rings;
+	pthread_key_t key;
+	bool key_created;
+	bool exit_flush;
+
+	/* rings of an older generation are gone */
+	unsigned int generation;
+} logger = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct dbg_ring *tls_ring;
+static __thread unsigned int tls_generation;
+static __thread pid_t tls_tid;
+/* the ring of the thread is released, write directly */
+static __thread bool tls_exiting;
+
 static int get_level(void)
 {
 	const char *env;
@@ -46,40 +119,399 @@ static FILE *get_stream(void)
 	return stderr;
 }
 
-static void line_prefix(unsigned int level, struct dbg *dbg,
-			const char *file, int line, const char *func)
+static pid_t dbg_tid(void)
+{
+	if (!tls_tid)
+		tls_tid = syscall(SYS_gettid);
+	return tls_tid;
+}
+
+static inline size_t rec_size(size_t len)
+{
+	return (sizeof(struct dbg_rec) + len + 7) & ~(size_t)7;
+}
+
+static void write_iov(int fd, struct iovec *iov, int n)
+{
+	ssize_t rc;
+
+	while (n) {
+		rc = writev(fd, iov, n);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		/* partial write */
+		while (n && ((size_t)rc >= iov->iov_len)) {
+			rc -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+/* append to buf (len < size), truncated at the end of buf */
+static size_t buf_printf(char *buf, size_t size, size_t len,
+			 const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(buf + len, size - len, fmt, args);
+	va_end(args);
+
+	if (n < 0)
+		return len;
+	return ((size_t)n < size - len) ? len + n : size - 1;
+}
+
+static size_t line_prefix(char *buf, size_t size, unsigned int level,
+			  pid_t tid, const char *file, int line,
+			  const char *func)
 {
-	fprintf(dbg->stream, "[%d] ", level);
+	struct timespec ts;
+	size_t len;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = buf_printf(buf, size, 0, "[%d] %lld.%06ld tid: %d, ", level,
+			 (long long)ts.tv_sec, ts.tv_nsec / 1000, tid);
 	if (file)
-		fprintf(dbg->stream, "file: %s, line: %d, ", file, line);
+		len = buf_printf(buf, size, len, "file: %s, line: %d, ",
+				 file, line);
 	if (func)
-		fprintf(dbg->stream, "func: %s, ", func);
+		len = buf_printf(buf, size, len, "func: %s, ", func);
+	return len;
+}
+
+static bool ring_push(struct dbg_ring *ring, int fd, const char *text,
+		      size_t len)
+{
+	unsigned long head, tail, pos, room, used;
+	size_t need = rec_size(len);
+	struct dbg_rec *rec;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	pos = tail & (DBG_RING_SIZE - 1);
+	room = DBG_RING_SIZE - pos;
+
+	/* records are contiguous, pad the end of the ring */
+	if (room < need) {
+		if (DBG_RING_SIZE - (tail - head) < room + need)
+			goto drop;
+		rec = (struct dbg_rec *)&ring->buf[pos];
+		rec->fd = -1;
+		rec->len = room - sizeof(*rec);
+		tail += room;
+		pos = 0;
+	} else if (DBG_RING_SIZE - (tail - head) < need) {
+		goto drop;
+	}
+
+	rec = (struct dbg_rec *)&ring->buf[pos];
+	rec->fd = fd;
+	rec->len = len;
+	memcpy(rec->text, text, len);
+	__atomic_store_n(&ring->tail, tail + need, __ATOMIC_RELEASE);
+
+	/*
+	 * Wake the logger early, if the ring fills up. The signal is sent
+	 * without the mutex and is lost, if the logger is not waiting yet:
+	 * it is repeated with each message, until the logger is awake.
+	 */
+	used = tail + need - head;
+	if ((used > DBG_RING_SIZE / 2) &&
+	    !__atomic_load_n(&logger.awake, __ATOMIC_SEQ_CST))
+		pthread_cond_signal(&logger.cond);
+	return true;
+
+drop:
+	__atomic_store_n(&ring->drop_fd, fd, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/* write the records of a ring (logger locked), true if half full again */
+static bool ring_drain(struct dbg_ring *ring)
+{
+	struct iovec iov[DBG_IOV_MAX];
+	unsigned long head, tail, dropped;
+	char buf[DBG_LINE_MAX];
+	struct dbg_rec *rec;
+	int fd = -1, n = 0;
+	size_t len;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		rec = (struct dbg_rec *)&ring->buf[head & (DBG_RING_SIZE - 1)];
+		if (rec->fd >= 0) {
+			if ((n == DBG_IOV_MAX) || (n && (rec->fd != fd))) {
+				write_iov(fd, iov, n);
+				__atomic_store_n(&ring->head, head,
+						 __ATOMIC_RELEASE);
+				n = 0;
+			}
+			fd = rec->fd;
+			iov[n].iov_base = rec->text;
+			iov[n].iov_len = rec->len;
+			n++;
+		}
+		head += rec_size(rec->len);
+	}
+	if (n)
+		write_iov(fd, iov, n);
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		len = line_prefix(buf, sizeof(buf), DBG_WARN, ring->tid,
+				  NULL, 0, NULL);
+		len = buf_printf(buf, sizeof(buf), len,
+				 "%lu debug messages dropped\n", dropped);
+		iov[0].iov_base = buf;
+		iov[0].iov_len = len;
+		write_iov(__atomic_load_n(&ring->drop_fd, __ATOMIC_RELAXED),
+			  iov, 1);
+	}
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	return tail - head > DBG_RING_SIZE / 2;
+}
+
+static void ring_free(struct dbg_ring *ring)
+{
+	OPENSSL_free(ring->mem);
+}
+
+/*
+ * Write all rings, free the rings of exited threads (logger locked).
+ * Returns true, if a ring is half full again.
+ */
+static bool logger_drain(void)
+{
+	struct dbg_ring **pring = &logger.rings;
+	struct dbg_ring *ring;
+	bool orphan, full = false;
+
+	while ((ring = *pring)) {
+		/* no more records after the thread exit */
+		orphan = ring->orphan;
+		if (ring_drain(ring))
+			full = true;
+		if (orphan) {
+			*pring = ring->next;
+			ring_free(ring);
+			continue;
+		}
+		pring = &ring->next;
+	}
+	return full;
+}
+
+static void *logger_main(void *arg __unused)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&logger.mutex);
+	while (!logger.stop) {
+		__atomic_store_n(&logger.awake, true, __ATOMIC_SEQ_CST);
+		if (logger_drain())
+			continue;
+		__atomic_store_n(&logger.awake, false, __ATOMIC_SEQ_CST);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += DBG_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&logger.cond, &logger.mutex, &ts);
+	}
+	logger_drain();
+	pthread_mutex_unlock(&logger.mutex);
+
+	return NULL;
+}
+
+/*
+ * pthread key destructor: the thread exits. The logger frees the ring, so
+ * messages of other destructors of the thread are written directly, after
+ * the pending messages of the ring.
+ */
+static void ring_orphan(void *p)
+{
+	struct dbg_ring *ring;
+
+	tls_ring = NULL;
+	tls_generation = 0;
+	tls_exiting = true;
+
+	pthread_mutex_lock(&logger.mutex);
+	for (ring = logger.rings; ring; ring = ring->next) {
+		if (ring == p) {
+			/* before the direct writes of the thread */
+			ring_drain(ring);
+			ring->orphan = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&logger.mutex);
+}
+
+/* a process may exit without the provider teardown */
+static void logger_exit(void)
+{
+	ps_dbg_flush();
+}
+
+/* start the logger thread on first use (locked) */
+static int logger_start(void)
+{
+	pthread_condattr_t attr;
+
+	if (logger.running)
+		return OSSL_RV_OK;
+
+	if (!logger.exit_flush && !atexit(logger_exit))
+		logger.exit_flush = true;
+
+	if (!logger.key_created) {
+		if (pthread_key_create(&logger.key, ring_orphan))
+			return OSSL_RV_ERR;
+		logger.key_created = true;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&logger.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	logger.stop = false;
+	if (pthread_create(&logger.thread, NULL, logger_main, NULL)) {
+		pthread_cond_destroy(&logger.cond);
+		return OSSL_RV_ERR;
+	}
+	logger.running = true;
+
+	return OSSL_RV_OK;
+}
+
+static struct dbg_ring *ring_register(void)
+{
+	struct dbg_ring *ring = NULL;
+	void *mem;
+
+	if (pthread_mutex_lock(&logger.mutex))
+		return NULL;
+
+	/* ----- locked ----- */
+	if (!logger.users || (logger_start() != OSSL_RV_OK))
+		goto unlock;
+
+	mem = OPENSSL_zalloc(sizeof(*ring) + PS_CACHELINE_SIZE - 1);
+	if (!mem)
+		goto unlock;
+	ring = (struct dbg_ring *)(((uintptr_t)mem + PS_CACHELINE_SIZE - 1) &
+				   ~(uintptr_t)(PS_CACHELINE_SIZE - 1));
+	ring->mem = mem;
+	ring->tid = dbg_tid();
+
+	if (pthread_setspecific(logger.key, ring)) {
+		OPENSSL_free(mem);
+		ring = NULL;
+		goto unlock;
+	}
+	ring->next = logger.rings;
+	logger.rings = ring;
+
+	tls_ring = ring;
+	tls_generation = logger.generation;
+unlock:
+	pthread_mutex_unlock(&logger.mutex);
+	/* ----- unlocked ----- */
+
+	return ring;
+}
+
+static struct dbg_ring *ring_get(void)
+{
+	if (tls_ring &&
+	    (tls_generation == __atomic_load_n(&logger.generation,
+					       __ATOMIC_RELAXED)))
+		return tls_ring;
+
+	return ring_register();
+}
+
+static void dbg_write(struct dbg *dbg, const char *buf, size_t len)
+{
+	struct dbg_ring *ring;
+	struct iovec iov;
+	int fd;
+
+	fd = fileno(dbg->stream);
+	if (fd < 0)
+		return;
+
+	if (dbg->logger && !tls_exiting) {
+		ring = ring_get();
+		if (ring) {
+			ring_push(ring, fd, buf, len);
+			return;
+		}
+	}
+
+	/* no logger thread, or the thread exits */
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	write_iov(fd, &iov, 1);
 }
 
 void ps_dbg_println(unsigned int level, struct dbg *dbg,
 		    const char *file, int line, const char *func,
 		    const char *fmt, ...)
 {
+	char buf[DBG_LINE_MAX];
 	va_list args;
+	size_t len;
+	int n;
 
 	if ((!ps_dbg_enabled(dbg)) || (dbg->level < level))
 		return;
 
-	line_prefix(level, dbg, file, line, func);
+	/* keep one byte for the newline */
+	len = line_prefix(buf, sizeof(buf) - 1, level, dbg_tid(),
+			  file, line, func);
 
 	va_start(args, fmt);
-	vfprintf(dbg->stream, fmt, args);
+	n = vsnprintf(buf + len, sizeof(buf) - 1 - len, fmt, args);
 	va_end(args);
 
-	fwrite("\n", 1, 1, dbg->stream);
-	fflush(dbg->stream);
+	if (n > 0)
+		len = ((size_t)n < sizeof(buf) - 1 - len) ?
+			len + n : sizeof(buf) - 2;
+	buf[len++] = '\n';
+
+	dbg_write(dbg, buf, len);
 }
 
 void ps_dbg_dump(unsigned int level, struct dbg *dbg,
 		 const char *file, int line, const char *func,
 		 const unsigned char *p, size_t plen)
 {
-	size_t i;
+	static const char hex[] = "0123456789abcdef";
+	/* "  0x00" per byte, 8 bytes per line */
+	char buf[DBG_LINE_MAX + 8 * 6 + 1];
+	size_t i, j, len;
 
 	if ((!ps_dbg_enabled(dbg)) || (dbg->level < level))
 		return;
@@ -91,30 +523,91 @@ void ps_dbg_dump(unsigned int level, struct dbg *dbg,
 		return;
 	}
 
-	for (i = 0; i < plen; i++) {
-		if (!(i % 8)) {
-			if (i)
-				fwrite("\n", 1, 1, dbg->stream);
-			line_prefix(level, dbg, file, line, func);
-			fprintf(dbg->stream, "%p:", &p[i]);
+	for (i = 0; i < plen; i += 8) {
+		len = line_prefix(buf, DBG_LINE_MAX, level, dbg_tid(),
+				  file, line, func);
+		len = buf_printf(buf, DBG_LINE_MAX, len, "%p:", &p[i]);
+		for (j = i; (j < plen) && (j < i + 8); j++) {
+			memcpy(&buf[len], "  0x", 4);
+			buf[len + 4] = hex[p[j] >> 4];
+			buf[len + 5] = hex[p[j] & 0xf];
+			len += 6;
 		}
-		fprintf(dbg->stream, "  0x%02x", p[i]);
+		buf[len++] = '\n';
+
+		dbg_write(dbg, buf, len);
+	}
+}
+
+/* write the pending messages of all threads */
+void ps_dbg_flush(void)
+{
+	if (pthread_mutex_lock(&logger.mutex))
+		return;
+	logger_drain();
+	pthread_mutex_unlock(&logger.mutex);
+}
+
+/* last user: stop the logger thread, before the provider is unloaded */
+static void logger_put(void)
+{
+	struct dbg_ring *ring;
+	bool running;
+
+	if (pthread_mutex_lock(&logger.mutex))
+		return;
+
+	/* ----- locked ----- */
+	logger_drain();
+	if (--logger.users)
+		goto unlock;
+
+	running = logger.running;
+	if (running) {
+		logger.stop = true;
+		pthread_cond_signal(&logger.cond);
+		pthread_mutex_unlock(&logger.mutex);
+		pthread_join(logger.thread, NULL);
+		pthread_mutex_lock(&logger.mutex);
+		pthread_cond_destroy(&logger.cond);
+		logger.running = false;
+		logger.stop = false;
+	}
+	if (logger.users)
+		goto unlock;
+
+	if (logger.key_created) {
+		pthread_key_delete(logger.key);
+		logger.key_created = false;
+	}
+	while ((ring = logger.rings)) {
+		logger.rings = ring->next;
+		ring_free(ring);
 	}
-	fwrite("\n", 1, 1, dbg->stream);
-	fflush(dbg->stream);
+	__atomic_add_fetch(&logger.generation, 1, __ATOMIC_RELAXED);
+unlock:
+	pthread_mutex_unlock(&logger.mutex);
+	/* ----- unlocked ----- */
 }
 
 void ps_dbg_exit(struct dbg *dbg)
 {
 	FILE *stream;
+	bool logger;
 
 	if (!dbg)
 		return;
 
 	stream = dbg->stream;
+	logger = dbg->logger;
 
 	dbg->stream = NULL;
 	dbg->level = DBG_ERROR;
+	dbg->logger = false;
+
+	/* pending messages are written before the stream is closed */
+	if (logger)
+		logger_put();
 
 	if (stream && (stream != stderr))
 		fclose(stream);
@@ -127,4 +620,44 @@ void ps_dbg_init(struct dbg *dbg)
 
 	dbg->level = get_level();
 	dbg->stream = get_stream();
+	if (!dbg->stream)
+		return;
+
+	if (pthread_mutex_lock(&logger.mutex))
+		return;
+	logger.users++;
+	dbg->logger = true;
+	pthread_mutex_unlock(&logger.mutex);
+}
+
+void ps_dbg_logger_lock(void)
+{
+	pthread_mutex_lock(&logger.mutex);
+}
+
+void ps_dbg_logger_unlock(void)
+{
+	pthread_mutex_unlock(&logger.mutex);
+}
+
+/*
+ * Child after fork (locked): the logger thread and the other threads are
+ * gone, their messages are written by the parent. The calling thread
+ * registers a new ring, which starts the logger again.
+ */
+void ps_dbg_logger_forget(void)
+{
+	struct dbg_ring *ring;
+
+	tls_tid = 0;
+	tls_ring = NULL;
+
+	logger.running = false;
+	logger.stop = false;
+
+	for (ring = logger.rings; ring; ring = ring->next) {
+		ring->head = ring->tail;
+		ring->dropped = 0;
+		ring->orphan = true;
+	}
 }
@@ -16,29 +16,68 @@
 #define DBG_INFO	(2)
 #define DBG_DEBUG	(3)
 
-inline bool ps_dbg_enabled(struct dbg *dbg)
+/*
+ * Highest level compiled into the provider (configure --with-debug-level).
+ * Messages above it are removed at compile time, including the evaluation
+ * of their arguments.
+ */
+#ifndef PS_DBG_MAX_LEVEL
+#define PS_DBG_MAX_LEVEL	DBG_DEBUG
+#endif
+
+static inline bool ps_dbg_enabled(struct dbg *dbg)
 {
 	return (dbg) && (dbg->stream);
 }
 
+/*
+ * Level check of the logging macros: the message and its arguments are
+ * evaluated only if it is printed.
+ */
+static inline bool ps_dbg_level_enabled(unsigned int level, struct dbg *dbg)
+{
+	return ((int)level <= PS_DBG_MAX_LEVEL) &&
+	       __builtin_expect(ps_dbg_enabled(dbg) && (dbg->level >= level),
+				0);
+}
+
 void ps_dbg_println(unsigned int level, struct dbg *dbg,
 		    const char *file, int line, const char *func,
 		    const char *fmt, ...);
+#define ps_dbg_log(level, _dbg, file, line, func, fmt...)		\
+	do {								\
+		struct dbg *__dbg = (_dbg);				\
+									\
+		if (ps_dbg_level_enabled(level, __dbg))			\
+			ps_dbg_println(level, __dbg, file, line, func,	\
+				       fmt);				\
+	} while (0)
 #define ps_dbg_error(dbg, fmt...) \
-	ps_dbg_println(DBG_ERROR, dbg, NULL, 0, NULL, fmt)
+	ps_dbg_log(DBG_ERROR, dbg, NULL, 0, NULL, fmt)
 #define ps_dbg_warn(dbg, fmt...) \
-	ps_dbg_println(DBG_WARN, dbg, NULL, 0, NULL, fmt)
+	ps_dbg_log(DBG_WARN, dbg, NULL, 0, NULL, fmt)
 #define ps_dbg_info(dbg, fmt...) \
-	ps_dbg_println(DBG_INFO, dbg, NULL, 0, NULL, fmt)
+	ps_dbg_log(DBG_INFO, dbg, NULL, 0, NULL, fmt)
 #define ps_dbg_debug(dbg, fmt...) \
-	ps_dbg_println(DBG_DEBUG, dbg, __FILE__, __LINE__, __func__, fmt)
+	ps_dbg_log(DBG_DEBUG, dbg, __FILE__, __LINE__, __func__, fmt)
 void ps_dbg_dump(unsigned int level, struct dbg *dbg,
 		 const char *file, int line, const char *func,
 		 const unsigned char *p, size_t plen);
-#define ps_dbg_debug_dump(dbg, p, plen) \
-	ps_dbg_dump(DBG_DEBUG, dbg, __FILE__, __LINE__, __func__, p, plen)
+#define ps_dbg_debug_dump(_dbg, p, plen)				\
+	do {								\
+		struct dbg *__dbg = (_dbg);				\
+									\
+		if (ps_dbg_level_enabled(DBG_DEBUG, __dbg))		\
+			ps_dbg_dump(DBG_DEBUG, __dbg, __FILE__,		\
+				    __LINE__, __func__, p, plen);	\
+	} while (0)
 
 void ps_dbg_init(struct dbg *dbg);
 void ps_dbg_exit(struct dbg *dbg);
+void ps_dbg_flush(void);
+
+void ps_dbg_logger_lock(void);
+void ps_dbg_logger_unlock(void);
+void ps_dbg_logger_forget(void);
 
 #endif /* _PKCS11SIGN_DEBUG_H */
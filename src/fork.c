@@ -6,6 +6,11 @@
 #include "common.h"
 #include "debug.h"
 #include "fork.h"
+#include "keyindex.h"
+#include "keymgmt.h"
+#include "session.h"
+#include "store.h"
+#include "worker.h"
 
 static struct {
 	pthread_mutex_t mutex;
@@ -15,13 +20,8 @@ static struct {
 	unsigned int pkcs_num;
 	unsigned int pkcs_size;
 
-	CK_OBJECT_HANDLE_PTR *ohs;
-	unsigned int oh_num;
-	unsigned int oh_size;
-
-	CK_SESSION_HANDLE_PTR *shs;
-	unsigned int sh_num;
-	unsigned int sh_size;
+	/* incremented in each child process */
+	unsigned int generation;
 } atfork_pool = {
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.registered = false,
@@ -29,6 +29,8 @@ static struct {
 
 static void fork_prepare(void)
 {
+	unsigned int i;
+
 	if (pthread_mutex_lock(&atfork_pool.mutex)) {
 		fprintf(stderr, "pid %d: unable to lock atfork pool\n",
 			getpid());
@@ -36,10 +38,43 @@ static void fork_prepare(void)
 	}
 
 	/* ----- locked ----- */
+	for(i = 0; i < atfork_pool.pkcs_size; i++) {
+		if (!atfork_pool.pkcss[i])
+			continue;
+		op_ctx_pool_lock(atfork_pool.pkcss[i]);
+		store_cache_lock(atfork_pool.pkcss[i]);
+		key_index_lock(atfork_pool.pkcss[i]);
+		pkey_cache_lock(atfork_pool.pkcss[i]);
+		pkcs11_slots_lock(atfork_pool.pkcss[i]);
+		session_pool_lock(atfork_pool.pkcss[i]);
+		worker_pool_lock(atfork_pool.pkcss[i]);
+		pkcs11_module_lock(atfork_pool.pkcss[i]);
+	}
+	op_ctx_threads_lock();
+	session_threads_lock();
+	ps_dbg_logger_lock();
 }
 
 static void fork_parent(void)
 {
+	unsigned int i;
+
+	ps_dbg_logger_unlock();
+	session_threads_unlock();
+	op_ctx_threads_unlock();
+	for(i = 0; i < atfork_pool.pkcs_size; i++) {
+		if (!atfork_pool.pkcss[i])
+			continue;
+		pkcs11_module_unlock(atfork_pool.pkcss[i]);
+		worker_pool_unlock(atfork_pool.pkcss[i]);
+		session_pool_unlock(atfork_pool.pkcss[i]);
+		pkcs11_slots_unlock(atfork_pool.pkcss[i]);
+		pkey_cache_unlock(atfork_pool.pkcss[i]);
+		key_index_unlock(atfork_pool.pkcss[i]);
+		store_cache_unlock(atfork_pool.pkcss[i]);
+		op_ctx_pool_unlock(atfork_pool.pkcss[i]);
+	}
+
 	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
 		fprintf(stderr, "pid %d: unable to unlock pool (parent)\n",
 			getpid());
@@ -54,21 +89,32 @@ static void fork_child(void)
 	struct pkcs11_module *pkcs;
 	unsigned int i;
 
-	for(i = 0; i < atfork_pool.oh_size; i++) {
-		if (atfork_pool.ohs[i])
-			*atfork_pool.ohs[i] = CK_INVALID_HANDLE;
-	}
+	/* object and session handles of the parent are dropped lazily */
+	__atomic_add_fetch(&atfork_pool.generation, 1, __ATOMIC_RELEASE);
 
-	for(i = 0; i < atfork_pool.sh_size; i++) {
-		if (atfork_pool.shs[i])
-			*atfork_pool.shs[i] = CK_INVALID_HANDLE;
-	}
+	ps_dbg_logger_forget();
+	ps_dbg_logger_unlock();
 
 	for(i = 0; i < atfork_pool.pkcs_size; i++) {
 		pkcs = atfork_pool.pkcss[i];
-		if (pkcs)
-			pkcs->state = PKCS11_UNINITIALIZED;
-	}
+		if (!pkcs)
+			continue;
+
+		pkcs11_module_fork_reset(pkcs);
+		pkcs11_module_unlock(pkcs);
+		worker_pool_forget(pkcs);
+		worker_pool_unlock(pkcs);
+		session_pool_forget(pkcs);
+		session_pool_unlock(pkcs);
+		pkcs11_slots_unlock(pkcs);
+		pkey_cache_unlock(pkcs);
+		key_index_unlock(pkcs);
+		store_cache_unlock(pkcs);
+		op_ctx_pool_unlock(pkcs);
+	}
+	session_threads_unlock();
+	op_ctx_threads_forget();
+	op_ctx_threads_unlock();
 
 	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
 		fprintf(stderr, "pid %d: unable to unlock pool (child)\n",
@@ -97,26 +143,18 @@ static int _gen_alloc(void **pool, unsigned int *num, unsigned int *size,
 	size_t bytes = elem_size * elem_num;
 	void *tmp;
 
-	/* initial allocation */
-	if (!(*num)) {
-		tmp = OPENSSL_zalloc(bytes);
-		if (!tmp)
-			return OSSL_RV_ERR;
-
-		*pool = tmp;
-		*size += elem_num;
-	}
+	/* free entries left (entries are not compacted on unregister) */
+	if (*num < *size)
+		return OSSL_RV_OK;
 
-	/* grow (if required) */
-	if (*num && (*num % elem_num == 0)) {
-		tmp = OPENSSL_realloc(*pool, *num + (bytes));
-		if (!tmp)
-			return OSSL_RV_ERR;
+	/* initial allocation or grow */
+	tmp = OPENSSL_realloc(*pool, (elem_size * *size) + bytes);
+	if (!tmp)
+		return OSSL_RV_ERR;
 
-		memset(tmp + (elem_size * *num), 0, bytes);
-		*pool = tmp;
-		*size += elem_num;
-	}
+	memset(tmp + (elem_size * *size), 0, bytes);
+	*pool = tmp;
+	*size += elem_num;
 
 	return OSSL_RV_OK;
 }
@@ -231,203 +269,11 @@ unlock_out:
 	return rc;
 }
 
-#define AFP_OH_POOL	16
-int atforkpool_register_objecthandle(CK_OBJECT_HANDLE_PTR poh, struct dbg *dbg)
-{
-	int rc = OSSL_RV_ERR;
-	bool found = false;
-	unsigned int i;
-
-	if (!poh)
-		return OSSL_RV_OK;
-	if (!dbg)
-		return OSSL_RV_ERR;
-
-	if (pthread_mutex_lock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "poh: %p, lock atfork pool failed", poh);
-		return OSSL_RV_ERR;
-	}
-
-	/* ----- locked ----- */
-	if (_gen_alloc((void **)&atfork_pool.ohs,
-		       &atfork_pool.oh_num, &atfork_pool.oh_size,
-		       sizeof(CK_OBJECT_HANDLE_PTR), AFP_OH_POOL) != OSSL_RV_OK) {
-		ps_dbg_error(dbg, "poh: %p, poh pool allocation failed", poh);
-		goto unlock_out;
-	}
-
-	for (i = 0; i < atfork_pool.oh_size; i++) {
-		if (atfork_pool.ohs[i] == NULL) {
-			found = true;
-			break;
-		}
-	}
-
-	if (!found) {
-		ps_dbg_error(dbg, "poh: %p, unable to register", poh);
-		goto unlock_out;
-	}
-
-	atfork_pool.ohs[i] = poh;
-	atfork_pool.oh_num++;
-
-	if (_pthread_atfork_once() != OSSL_RV_OK) {
-		ps_dbg_warn(dbg, "unable to register fork handler");
-		goto unlock_out;
-	}
-
-	rc = OSSL_RV_OK;
-unlock_out:
-	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "poh: %p, unlock atfork pool failed", poh);
-		return OSSL_RV_ERR;
-	}
-	/* ----- unlocked ----- */
-	ps_dbg_debug(dbg, "poh: %p, registered in atfork pool", poh);
-	return rc;
-}
-
-int atforkpool_unregister_objecthandle(CK_OBJECT_HANDLE_PTR poh, struct dbg *dbg)
-{
-	int rc = OSSL_RV_ERR;
-	bool found = false;
-	unsigned int i;
-
-	if (!poh)
-		return OSSL_RV_OK;
-	if (!dbg)
-		return OSSL_RV_ERR;
-
-	if (pthread_mutex_lock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "poh: %p, lock atfork pool failed", poh);
-		return OSSL_RV_ERR;
-	}
-
-	/* ----- locked ----- */
-	for (i = 0; i < atfork_pool.oh_size; i++) {
-		if (atfork_pool.ohs[i] == poh) {
-			found = true;
-			break;
-		}
-	}
-
-	if (!found) {
-		ps_dbg_error(dbg, "poh: %p, unable to unregister", poh);
-		goto unlock_out;
-	}
-
-	atfork_pool.ohs[i] = NULL;
-	atfork_pool.oh_num--;
-
-	_gen_free((void **)&atfork_pool.ohs, &atfork_pool.oh_num,
-		  &atfork_pool.oh_size);
-	rc = OSSL_RV_OK;
-unlock_out:
-	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "poh: %p, unlock atfork pool failed", poh);
-		return OSSL_RV_ERR;
-	}
-	/* ----- unlocked ----- */
-	ps_dbg_debug(dbg, "poh: %p, unregistered in atfork pool", poh);
-	return rc;
-}
-
-#define AFP_SH_POOL	16
-int atforkpool_register_sessionhandle(CK_SESSION_HANDLE_PTR psh, struct dbg *dbg)
+/*
+ * Fork generation of the process. Handles, which have been obtained in
+ * another generation, belong to a parent process and must not be used.
+ */
+unsigned int atfork_generation(void)
 {
-	int rc = OSSL_RV_ERR;
-	bool found = false;
-	unsigned int i;
-
-	if (!psh)
-		return OSSL_RV_OK;
-	if (!dbg)
-		return OSSL_RV_ERR;
-
-	if (pthread_mutex_lock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "psh: %p, lock atfork pool failed", psh);
-		return OSSL_RV_ERR;
-	}
-
-	/* ----- locked ----- */
-	if (_gen_alloc((void **)&atfork_pool.shs, &atfork_pool.sh_num, &atfork_pool.sh_size,
-		       sizeof(CK_SESSION_HANDLE_PTR), AFP_SH_POOL) != OSSL_RV_OK) {
-		ps_dbg_error(dbg, "psh: %p, sh pool allocation failed", psh);
-		goto unlock_out;
-	}
-
-	for (i = 0; i < atfork_pool.sh_size; i++) {
-		if (atfork_pool.shs[i] == NULL) {
-			found = true;
-			break;
-		}
-	}
-
-	if (!found) {
-		ps_dbg_error(dbg, "psh: %p, unable to register", psh);
-		goto unlock_out;
-	}
-
-	atfork_pool.shs[i] = psh;
-	atfork_pool.sh_num++;
-
-	if (_pthread_atfork_once() != OSSL_RV_OK) {
-		ps_dbg_warn(dbg, "unable to register fork handler");
-		goto unlock_out;
-	}
-
-	rc = OSSL_RV_OK;
-unlock_out:
-	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "psh: %p, unlock atfork pool failed", psh);
-		return OSSL_RV_ERR;
-	}
-	/* ----- unlocked ----- */
-	ps_dbg_debug(dbg, "psh: %p, registered in atfork pool", psh);
-	return rc;
-}
-
-int atforkpool_unregister_sessionhandle(CK_SESSION_HANDLE_PTR psh, struct dbg *dbg)
-{
-	int rc = OSSL_RV_ERR;
-	bool found = false;
-	unsigned int i;
-
-	if (!psh)
-		return OSSL_RV_OK;
-	if (!dbg)
-		return OSSL_RV_ERR;
-
-	if (pthread_mutex_lock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "psh: %p, lock atfork pool failed", psh);
-		return OSSL_RV_ERR;
-	}
-
-	/* ----- locked ----- */
-	for (i = 0; i < atfork_pool.sh_size; i++) {
-		if (atfork_pool.shs[i] == psh) {
-			found = true;
-			break;
-		}
-	}
-
-	if (!found) {
-		ps_dbg_error(dbg, "psh: %p, unable to unregister", psh);
-		goto unlock_out;
-	}
-
-	atfork_pool.shs[i] = NULL;
-	atfork_pool.sh_num--;
-
-	_gen_free((void **)&atfork_pool.shs, &atfork_pool.sh_num,
-		  &atfork_pool.sh_size);
-	rc = OSSL_RV_OK;
-unlock_out:
-	if (pthread_mutex_unlock(&atfork_pool.mutex)) {
-		ps_dbg_error(dbg, "psh: %p, unlock atfork pool failed", psh);
-		return OSSL_RV_ERR;
-	}
-	/* ----- unlocked ----- */
-	ps_dbg_debug(dbg, "psh: %p, unregistered in atfork pool", psh);
-	return rc;
+	return __atomic_load_n(&atfork_pool.generation, __ATOMIC_ACQUIRE);
 }
@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#include "common.h"
+#include "debug.h"
+#include "fork.h"
+#include "keyindex.h"
+#include "object.h"
+#include "pkcs11.h"
+
+/*
+ * Key index
+ *
+ * Label, ID, class and key type of all private and public keys of a
+ * slot, built by a single object search. Store lookups by label and/or
+ * ID resolve the object handles from the index, an object search is only
+ * needed on a miss. Keys found by such a search are added to the index.
+ * The index of a slot is rebuilt after fork and after token events.
+ */
+
+#define KEY_INDEX_VALUE_MAX	256
+#define KEY_INDEX_BUCKETS_MIN	64
+
+struct key_index_entry {
+	/* insertion order, results keep the order of the token */
+	unsigned long seq;
+	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_CLASS class;
+	CK_KEY_TYPE key_type;
+	const unsigned char *label;
+	CK_ULONG label_len;
+	const unsigned char *id;
+	CK_ULONG id_len;
+	/* all entries, label bucket, id bucket */
+	struct key_index_entry *next;
+	struct key_index_entry *next_label;
+	struct key_index_entry *next_id;
+};
+
+struct key_index_slot {
+	CK_SLOT_ID slot_id;
+	unsigned int fork_gen;
+	unsigned int token_gen;
+	struct key_index_entry *entries;
+	unsigned long nentries;
+	/* power of two */
+	unsigned long nbuckets;
+	struct key_index_entry **by_label;
+	struct key_index_entry **by_id;
+	struct key_index_slot *next;
+};
+
+static struct key_index_entry *entry_new(CK_OBJECT_HANDLE handle,
+					 CK_OBJECT_CLASS class,
+					 CK_KEY_TYPE key_type,
+					 const unsigned char *label,
+					 CK_ULONG label_len,
+					 const unsigned char *id,
+					 CK_ULONG id_len)
+{
+	struct key_index_entry *e;
+	unsigned char *p;
+
+	/* label and id follow the entry */
+	e = OPENSSL_zalloc(sizeof(*e) + label_len + id_len);
+	if (!e)
+		return NULL;
+
+	e->handle = handle;
+	e->class = class;
+	e->key_type = key_type;
+
+	p = (unsigned char *)(e + 1);
+	memcpy(p, label, label_len);
+	e->label = p;
+	e->label_len = label_len;
+
+	p += label_len;
+	memcpy(p, id, id_len);
+	e->id = p;
+	e->id_len = id_len;
+
+	return e;
+}
+
+static void slot_free(struct key_index_slot *ks)
+{
+	struct key_index_entry *e;
+
+	if (!ks)
+		return;
+
+	while ((e = ks->entries)) {
+		ks->entries = e->next;
+		OPENSSL_free(e);
+	}
+	OPENSSL_free(ks->by_label);
+	OPENSSL_free(ks->by_id);
+	OPENSSL_free(ks);
+}
+
+static int slot_rehash(struct key_index_slot *ks, unsigned long nbuckets)
+{
+	struct key_index_entry **by_label, **by_id, *e;
+	unsigned long b;
+
+	by_label = OPENSSL_zalloc(nbuckets * sizeof(*by_label));
+	by_id = OPENSSL_zalloc(nbuckets * sizeof(*by_id));
+	if (!by_label || !by_id) {
+		OPENSSL_free(by_label);
+		OPENSSL_free(by_id);
+		return OSSL_RV_ERR;
+	}
+
+	for (e = ks->entries; e; e = e->next) {
+		b = ps_hash(e->label, e->label_len) & (nbuckets - 1);
+		e->next_label = by_label[b];
+		by_label[b] = e;
+
+		b = ps_hash(e->id, e->id_len) & (nbuckets - 1);
+		e->next_id = by_id[b];
+		by_id[b] = e;
+	}
+
+	OPENSSL_free(ks->by_label);
+	OPENSSL_free(ks->by_id);
+	ks->by_label = by_label;
+	ks->by_id = by_id;
+	ks->nbuckets = nbuckets;
+
+	return OSSL_RV_OK;
+}
+
+static void slot_insert(struct key_index_slot *ks, struct key_index_entry *e)
+{
+	unsigned long b;
+
+	e->seq = ks->nentries++;
+	e->next = ks->entries;
+	ks->entries = e;
+
+	/* keep the load factor below 1 (on error, the chains just grow) */
+	if ((ks->nentries > ks->nbuckets) &&
+	    (slot_rehash(ks, ks->nbuckets * 2) == OSSL_RV_OK))
+		return;
+
+	b = ps_hash(e->label, e->label_len) & (ks->nbuckets - 1);
+	e->next_label = ks->by_label[b];
+	ks->by_label[b] = e;
+
+	b = ps_hash(e->id, e->id_len) & (ks->nbuckets - 1);
+	e->next_id = ks->by_id[b];
+	ks->by_id[b] = e;
+}
+
+static bool slot_valid(struct pkcs11_module *pkcs,
+		       const struct key_index_slot *ks)
+{
+	return (ks->fork_gen == atfork_generation()) &&
+	       (ks->token_gen == pkcs11_token_generation(pkcs));
+}
+
+/*
+ * Label and id of a key with values beyond KEY_INDEX_VALUE_MAX. An
+ * unavailable value is empty (the default of both attributes).
+ */
+static struct key_index_entry *entry_fetch(struct pkcs11_module *pkcs,
+					   CK_SESSION_HANDLE session,
+					   CK_OBJECT_HANDLE handle,
+					   CK_OBJECT_CLASS class,
+					   CK_KEY_TYPE key_type,
+					   struct dbg *dbg)
+{
+	CK_ATTRIBUTE template[] = {
+		{ CKA_LABEL, NULL, 0 },
+		{ CKA_ID, NULL, 0 },
+	};
+	struct key_index_entry *e = NULL;
+	unsigned char *buf;
+	CK_RV rv;
+
+	rv = pkcs11_get_attribute_values(pkcs, session, handle, template, 2,
+					 dbg);
+	if ((rv != CKR_OK) && (rv != CKR_ATTRIBUTE_TYPE_INVALID) &&
+	    (rv != CKR_ATTRIBUTE_SENSITIVE))
+		return NULL;
+	if (template[0].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+		template[0].ulValueLen = 0;
+	if (template[1].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+		template[1].ulValueLen = 0;
+
+	buf = OPENSSL_malloc(template[0].ulValueLen +
+			     template[1].ulValueLen + 1);
+	if (!buf)
+		return NULL;
+	template[0].pValue = template[0].ulValueLen ? buf : NULL;
+	template[1].pValue = template[1].ulValueLen ?
+				buf + template[0].ulValueLen : NULL;
+
+	/* only the available values */
+	rv = CKR_OK;
+	if (template[0].pValue && template[1].pValue)
+		rv = pkcs11_get_attribute_values(pkcs, session, handle,
+						 template, 2, dbg);
+	else if (template[0].pValue || template[1].pValue)
+		rv = pkcs11_get_attribute_values(pkcs, session, handle,
+						 template[0].pValue ?
+							&template[0] :
+							&template[1],
+						 1, dbg);
+	if (rv == CKR_OK)
+		e = entry_new(handle, class, key_type,
+			      buf, template[0].ulValueLen,
+			      buf + template[0].ulValueLen,
+			      template[1].ulValueLen);
+
+	OPENSSL_free(buf);
+	return e;
+}
+
+static struct key_index_slot *slot_build(struct pkcs11_module *pkcs,
+					 CK_SLOT_ID slot_id,
+					 CK_SESSION_HANDLE session,
+					 struct dbg *dbg)
+{
+	unsigned char label[KEY_INDEX_VALUE_MAX], id[KEY_INDEX_VALUE_MAX];
+	CK_OBJECT_CLASS class;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+		{ CKA_LABEL, label, sizeof(label) },
+		{ CKA_ID, id, sizeof(id) },
+	};
+	CK_ULONG ntemplate = sizeof(template) / sizeof(template[0]);
+	CK_OBJECT_HANDLE_PTR handles = NULL;
+	struct key_index_entry *e;
+	struct key_index_slot *ks;
+	unsigned long nbuckets;
+	CK_ULONG nhandles, nskipped = 0, i;
+	CK_RV rv;
+
+	ks = OPENSSL_zalloc(sizeof(*ks));
+	if (!ks)
+		return NULL;
+
+	/* token events during the build make it stale */
+	ks->slot_id = slot_id;
+	ks->fork_gen = atfork_generation();
+	ks->token_gen = pkcs11_token_generation(pkcs);
+
+	if (pkcs11_find_all_objects(pkcs, session, &handles, &nhandles,
+				    dbg) != CKR_OK)
+		goto err;
+
+	for (nbuckets = KEY_INDEX_BUCKETS_MIN; nbuckets < nhandles; )
+		nbuckets *= 2;
+	if (slot_rehash(ks, nbuckets) != OSSL_RV_OK)
+		goto err;
+
+	for (i = 0; i < nhandles; i++) {
+		template[0].ulValueLen = sizeof(class);
+		template[1].ulValueLen = sizeof(key_type);
+		template[2].ulValueLen = sizeof(label);
+		template[3].ulValueLen = sizeof(id);
+
+		rv = pkcs11_get_attribute_values(pkcs, session, handles[i],
+						 template, ntemplate, dbg);
+		switch (rv) {
+		case CKR_OK:
+		case CKR_ATTRIBUTE_TYPE_INVALID:
+		case CKR_ATTRIBUTE_SENSITIVE:
+		case CKR_BUFFER_TOO_SMALL:
+			break;
+		case CKR_OBJECT_HANDLE_INVALID:
+			/* removed since the search */
+			continue;
+		default:
+			ps_dbg_error(dbg, "%s: slot %lu: key index build failed (handle: %lu): %lu",
+				     pkcs->soname, slot_id, handles[i], rv);
+			goto err;
+		}
+
+		/* only keys are indexed (no key type: not a key) */
+		if ((template[0].ulValueLen == CK_UNAVAILABLE_INFORMATION) ||
+		    (template[1].ulValueLen == CK_UNAVAILABLE_INFORMATION) ||
+		    ((class != CKO_PRIVATE_KEY) && (class != CKO_PUBLIC_KEY)))
+			continue;
+
+		if ((template[2].ulValueLen == CK_UNAVAILABLE_INFORMATION) ||
+		    (template[3].ulValueLen == CK_UNAVAILABLE_INFORMATION))
+			e = entry_fetch(pkcs, session, handles[i], class,
+					key_type, dbg);
+		else
+			e = entry_new(handles[i], class, key_type,
+				      label, template[2].ulValueLen,
+				      id, template[3].ulValueLen);
+		if (!e) {
+			/* found by an object search after a miss */
+			ps_dbg_warn(dbg, "%s: slot %lu: key not indexed (handle: %lu)",
+				    pkcs->soname, slot_id, handles[i]);
+			nskipped++;
+			continue;
+		}
+
+		slot_insert(ks, e);
+	}
+
+	OPENSSL_free(handles);
+	ps_dbg_debug(dbg, "%s: slot %lu: %lu keys indexed, %lu skipped (%lu objects)",
+		     pkcs->soname, slot_id, ks->nentries, nskipped, nhandles);
+	return ks;
+err:
+	OPENSSL_free(handles);
+	slot_free(ks);
+	return NULL;
+}
+
+/* returns the valid index of the slot, NULL if there is none */
+static struct key_index_slot *slot_get(struct pkcs11_module *pkcs,
+				       CK_SLOT_ID slot_id)
+{
+	struct key_index_slot *ks;
+
+	for (ks = pkcs->kindex.slots; ks; ks = ks->next) {
+		if (ks->slot_id == slot_id)
+			return slot_valid(pkcs, ks) ? ks : NULL;
+	}
+	return NULL;
+}
+
+/* replaces the index of the slot */
+static void slot_set(struct pkcs11_module *pkcs, struct key_index_slot *ks)
+{
+	struct key_index_slot **pks, *old;
+
+	for (pks = &pkcs->kindex.slots; *pks; pks = &(*pks)->next) {
+		if ((*pks)->slot_id == ks->slot_id) {
+			old = *pks;
+			*pks = old->next;
+			slot_free(old);
+			break;
+		}
+	}
+
+	ks->next = pkcs->kindex.slots;
+	pkcs->kindex.slots = ks;
+}
+
+static bool entry_match(const struct key_index_entry *e,
+			CK_OBJECT_CLASS class,
+			const char *label, size_t label_len,
+			const char *id, size_t id_len)
+{
+	if (e->class != class)
+		return false;
+	if (label && ((e->label_len != label_len) ||
+		      memcmp(e->label, label, label_len)))
+		return false;
+	if (id && ((e->id_len != id_len) ||
+		   memcmp(e->id, id, id_len)))
+		return false;
+	return true;
+}
+
+static int entries_add(const struct key_index_entry ***es, CK_ULONG *nes,
+		       CK_ULONG *size, const struct key_index_entry *e)
+{
+	const struct key_index_entry **tmp;
+
+	if (*nes == *size) {
+		*size = *size ? *size * 2 : 4;
+		tmp = OPENSSL_realloc(*es, *size * sizeof(*tmp));
+		if (!tmp)
+			return OSSL_RV_ERR;
+		*es = tmp;
+	}
+
+	(*es)[(*nes)++] = e;
+	return OSSL_RV_OK;
+}
+
+static int entry_seq_cmp(const void *a, const void *b)
+{
+	const struct key_index_entry *ea = *(const struct key_index_entry **)a;
+	const struct key_index_entry *eb = *(const struct key_index_entry **)b;
+
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/*
+ * Returns the handles of the keys with the label, id and type (as
+ * pkcs11_find_objects()). The index of the slot is built with session
+ * if needed. Returns OSSL_RV_ERR if no key is found in the index.
+ */
+int key_index_lookup(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		     CK_SESSION_HANDLE session,
+		     const char *label, const char *id, size_t id_len,
+		     const char *type, CK_OBJECT_HANDLE_PTR *handles,
+		     CK_ULONG *nhandles, struct dbg *dbg)
+{
+	struct key_index *kindex = &pkcs->kindex;
+	const struct key_index_entry **es = NULL;
+	CK_OBJECT_HANDLE_PTR hs = NULL;
+	CK_ULONG nes = 0, size = 0, i;
+	struct key_index_entry *e;
+	struct key_index_slot *ks;
+	CK_OBJECT_CLASS class;
+	size_t label_len = 0;
+	unsigned long b;
+	int rv = OSSL_RV_ERR;
+
+	if (!kindex->enabled)
+		return OSSL_RV_ERR;
+
+	class = type ? pkcs11_type_class(type) : CKO_PRIVATE_KEY;
+	if ((class != CKO_PRIVATE_KEY) && (class != CKO_PUBLIC_KEY))
+		return OSSL_RV_ERR;
+	if (label)
+		label_len = strlen(label);
+
+	pthread_mutex_lock(&kindex->mutex);
+
+	ks = slot_get(pkcs, slot_id);
+	if (!ks) {
+		ks = slot_build(pkcs, slot_id, session, dbg);
+		if (!ks)
+			goto out;
+		slot_set(pkcs, ks);
+		kindex->builds++;
+	}
+
+	if (label) {
+		b = ps_hash(label, label_len) & (ks->nbuckets - 1);
+		for (e = ks->by_label[b]; e; e = e->next_label) {
+			if (entry_match(e, class, label, label_len, id, id_len) &&
+			    (entries_add(&es, &nes, &size, e) != OSSL_RV_OK))
+				goto out;
+		}
+	} else if (id) {
+		b = ps_hash(id, id_len) & (ks->nbuckets - 1);
+		for (e = ks->by_id[b]; e; e = e->next_id) {
+			if (entry_match(e, class, NULL, 0, id, id_len) &&
+			    (entries_add(&es, &nes, &size, e) != OSSL_RV_OK))
+				goto out;
+		}
+	} else {
+		for (e = ks->entries; e; e = e->next) {
+			if (entry_match(e, class, NULL, 0, NULL, 0) &&
+			    (entries_add(&es, &nes, &size, e) != OSSL_RV_OK))
+				goto out;
+		}
+	}
+
+	if (!nes)
+		goto out;
+
+	qsort(es, nes, sizeof(*es), entry_seq_cmp);
+	hs = OPENSSL_malloc(nes * sizeof(CK_OBJECT_HANDLE));
+	if (!hs)
+		goto out;
+	for (i = 0; i < nes; i++)
+		hs[i] = es[i]->handle;
+
+	*handles = hs;
+	*nhandles = nes;
+	rv = OSSL_RV_OK;
+out:
+	if (rv == OSSL_RV_OK)
+		kindex->hits++;
+	else
+		kindex->misses++;
+	pthread_mutex_unlock(&kindex->mutex);
+
+	OPENSSL_free(es);
+	ps_dbg_debug(dbg, "%s: slot %lu: key index %s", pkcs->soname,
+		     slot_id, (rv == OSSL_RV_OK) ? "hit" : "miss");
+	return rv;
+}
+
+/* adds a key, which was found by an object search after a miss */
+void key_index_add(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		   struct obj *obj)
+{
+	struct key_index *kindex = &pkcs->kindex;
+	CK_BYTE_PTR label, id;
+	CK_ULONG label_len, id_len;
+	CK_OBJECT_HANDLE handle;
+	struct key_index_entry *e;
+	struct key_index_slot *ks;
+	CK_OBJECT_CLASS class;
+	unsigned long b;
+
+	if (!kindex->enabled)
+		return;
+
+	class = obj_get_class(obj);
+	if (((class != CKO_PRIVATE_KEY) && (class != CKO_PUBLIC_KEY)) ||
+	    (obj_get_label(obj, &label, &label_len) != OSSL_RV_OK) ||
+	    (obj_get_id(obj, &id, &id_len) != OSSL_RV_OK))
+		return;
+
+	handle = obj_get_handle(obj);
+	if (handle == CK_INVALID_HANDLE)
+		return;
+
+	pthread_mutex_lock(&kindex->mutex);
+
+	ks = slot_get(pkcs, slot_id);
+	if (!ks)
+		goto out;
+
+	b = ps_hash(label, label_len) & (ks->nbuckets - 1);
+	for (e = ks->by_label[b]; e; e = e->next_label) {
+		if (e->handle == handle)
+			goto out;
+	}
+
+	e = entry_new(handle, class, obj_get_key_type(obj),
+		      label, label_len, id, id_len);
+	if (e)
+		slot_insert(ks, e);
+out:
+	pthread_mutex_unlock(&kindex->mutex);
+}
+
+int key_index_init(struct pkcs11_module *pkcs, bool enabled,
+		   struct dbg *dbg)
+{
+	struct key_index *kindex = &pkcs->kindex;
+	int rc;
+
+	kindex->slots = NULL;
+	kindex->hits = 0;
+	kindex->misses = 0;
+	kindex->builds = 0;
+	kindex->enabled = false;
+
+	if (!enabled)
+		return OSSL_RV_OK;
+
+	rc = pthread_mutex_init(&kindex->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	kindex->enabled = true;
+	ps_dbg_debug(dbg, "pkcs: %p, key index enabled", pkcs);
+	return OSSL_RV_OK;
+}
+
+void key_index_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct key_index *kindex = &pkcs->kindex;
+	struct key_index_slot *ks;
+
+	if (!kindex->enabled)
+		return;
+
+	pthread_mutex_lock(&kindex->mutex);
+	while ((ks = kindex->slots)) {
+		kindex->slots = ks->next;
+		slot_free(ks);
+	}
+	pthread_mutex_unlock(&kindex->mutex);
+
+	ps_dbg_info(dbg, "pkcs: %p, key index: builds: %lu, hits: %lu, misses: %lu",
+		    pkcs, kindex->builds, kindex->hits, kindex->misses);
+
+	kindex->enabled = false;
+	pthread_mutex_destroy(&kindex->mutex);
+}
+
+void key_index_lock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->kindex.enabled)
+		pthread_mutex_lock(&pkcs->kindex.mutex);
+}
+
+void key_index_unlock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->kindex.enabled)
+		pthread_mutex_unlock(&pkcs->kindex.mutex);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PKCS11SIGN_KEYINDEX_H
+#define _PKCS11SIGN_KEYINDEX_H
+
+#include "common.h"
+#include "debug.h"
+
+#define PS_KEY_INDEX_DEFAULT	0
+
+int key_index_init(struct pkcs11_module *pkcs, bool enabled,
+		   struct dbg *dbg);
+void key_index_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void key_index_lock(struct pkcs11_module *pkcs);
+void key_index_unlock(struct pkcs11_module *pkcs);
+
+int key_index_lookup(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		     CK_SESSION_HANDLE session,
+		     const char *label, const char *id, size_t id_len,
+		     const char *type, CK_OBJECT_HANDLE_PTR *handles,
+		     CK_ULONG *nhandles, struct dbg *dbg);
+void key_index_add(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		   struct obj *obj);
+
+#endif /* _PKCS11SIGN_KEYINDEX_H */
@@ -9,12 +9,14 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 #include <openssl/core_names.h>
+#include <openssl/params.h>
 
 #include "common.h"
 #include "pkcs11.h"
 #include "ossl.h"
 #include "debug.h"
 #include "object.h"
+#include "keymgmt.h"
 
 static int op_ctx_init_fwd(struct op_ctx *octx, int selection, const OSSL_PARAM params[], int type)
 {
@@ -72,28 +74,43 @@ static void *keymgmt_fwd_new(struct provider_ctx *pctx, int type)
 	return fwd_new_fn(&pctx->fwd.ctx);
 }
 
-static int keymgmt_fetch_pki(struct obj *key)
+static void keymgmt_set_sizes(struct obj *key, int bits, int security_bits,
+			      int max_size)
+{
+	key->bits = bits;
+	key->security_bits = security_bits;
+	key->max_size = max_size;
+
+	switch (key->type) {
+	case EVP_PKEY_EC:
+		key->keylen = (key->bits + 7) / 8;
+		break;
+	default:
+		key->keylen = key->max_size;
+		break;
+	}
+}
+
+/* parses the public_key_info and imports it into fwd_key */
+static int keymgmt_import_pki(struct obj *key, void *fwd_key,
+			      const unsigned char *pki, CK_ULONG pkilen)
 {
 	OSSL_FUNC_keymgmt_import_fn *fwd_import_fn;
 	int selection, rv = OSSL_RV_OK;
 	OSSL_PARAM *params = NULL;
 	EVP_PKEY *pkey = NULL;
-	CK_BYTE_PTR pki;
-	CK_ULONG pkilen;
-
-	if (obj_get_pub_key_info(key, &pki, &pkilen) != OSSL_RV_OK) {
-		ps_obj_debug(key, "key: %p, no public_key_info available",
-			     key);
-		return OSSL_RV_ERR;
-	}
 
-	pkey = d2i_PUBKEY(NULL, (const unsigned char **)&pki, pkilen);
+	pkey = d2i_PUBKEY(NULL, &pki, pkilen);
 	if (!pkey) {
 		ps_obj_debug(key, "key: %p, unable to parse public_key_info",
 			     key);
 		return OSSL_RV_ERR;
 	}
 
+	keymgmt_set_sizes(key, EVP_PKEY_get_bits(pkey),
+			  EVP_PKEY_get_security_bits(pkey),
+			  EVP_PKEY_get_size(pkey));
+
 	selection = OSSL_KEYMGMT_SELECT_PUBLIC_KEY |
 		    OSSL_KEYMGMT_SELECT_DOMAIN_PARAMETERS |
 		    OSSL_KEYMGMT_SELECT_OTHER_PARAMETERS;
@@ -115,7 +132,7 @@ static int keymgmt_fetch_pki(struct obj *key)
 		goto out;
 	}
 
-	if (fwd_import_fn(key->fwd_key, selection, params) != OSSL_RV_OK) {
+	if (fwd_import_fn(fwd_key, selection, params) != OSSL_RV_OK) {
 		put_error_key(key, PS_ERR_DEFAULT_PROV_FUNC_FAILED,
 			      "fwd_import_fn failed");
 		rv = OSSL_RV_ERR;
@@ -128,6 +145,271 @@ out:
 	return rv;
 }
 
+/*
+ * Public key cache
+ *
+ * The imported forward keys of token keys, by public_key_info. Keys
+ * loaded with the same public_key_info share the forward key (refcount).
+ * The cache holds a reference to each entry, unreferenced entries are
+ * dropped beyond PS_PKEY_CACHE_MAX entries. Shared forward keys are not
+ * modified, see keymgmt_fwd_unshare().
+ */
+struct pkey_cache_entry {
+	unsigned int refcnt;
+	int type;
+	void *fwd_key;
+	OSSL_FUNC_keymgmt_free_fn *fwd_free_fn;
+	int bits;
+	int security_bits;
+	int max_size;
+	unsigned long hash;
+	CK_ULONG pkilen;
+	struct pkey_cache_entry *next;
+	/* public_key_info */
+	unsigned char pki[];
+};
+
+static void pkey_entry_put(struct pkey_cache_entry *e)
+{
+	if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (e->fwd_free_fn)
+		e->fwd_free_fn(e->fwd_key);
+	OPENSSL_free(e);
+}
+
+/* drops unreferenced entries beyond max */
+static void pkey_cache_expire(struct pkey_cache *cache, unsigned int max)
+{
+	struct pkey_cache_entry **pe, *e;
+	unsigned int b;
+
+	for (b = 0; (b < PS_PKEY_CACHE_BUCKETS) && (cache->nentries > max);
+	     b++) {
+		pe = &cache->buckets[b];
+		while ((e = *pe) && (cache->nentries > max)) {
+			/* only referenced by the cache (no new references) */
+			if (__atomic_load_n(&e->refcnt, __ATOMIC_ACQUIRE) != 1) {
+				pe = &e->next;
+				continue;
+			}
+			*pe = e->next;
+			pkey_entry_put(e);
+			cache->nentries--;
+		}
+	}
+}
+
+/* shares the cached forward key of the public_key_info with key */
+static int pkey_cache_get(struct obj *key, const unsigned char *pki,
+			  CK_ULONG pkilen, unsigned long hash)
+{
+	struct pkey_cache *cache = &key->pctx->pkcs11.pkcache;
+	struct pkey_cache_entry *e;
+
+	if (!cache->buckets)
+		return OSSL_RV_ERR;
+
+	pthread_mutex_lock(&cache->mutex);
+	for (e = cache->buckets[hash % PS_PKEY_CACHE_BUCKETS]; e; e = e->next) {
+		if ((e->hash == hash) && (e->type == key->type) &&
+		    (e->pkilen == pkilen) && !memcmp(e->pki, pki, pkilen))
+			break;
+	}
+	if (e) {
+		__atomic_add_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL);
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (!e)
+		return OSSL_RV_ERR;
+
+	key->fwd_key = e->fwd_key;
+	key->fwd_shared = e;
+	keymgmt_set_sizes(key, e->bits, e->security_bits, e->max_size);
+	return OSSL_RV_OK;
+}
+
+/* moves the forward key of key into the cache and shares it */
+static void pkey_cache_add(struct obj *key, const unsigned char *pki,
+			   CK_ULONG pkilen, unsigned long hash)
+{
+	struct pkey_cache *cache = &key->pctx->pkcs11.pkcache;
+	struct pkey_cache_entry *e, *c;
+	unsigned int b;
+
+	if (!cache->buckets)
+		return;
+
+	e = OPENSSL_zalloc(sizeof(*e) + pkilen);
+	if (!e)
+		return;
+
+	e->fwd_free_fn = (OSSL_FUNC_keymgmt_free_fn *)
+		fwd_keymgmt_get_func(&key->pctx->fwd,
+				     key->type, OSSL_FUNC_KEYMGMT_FREE,
+				     &key->pctx->dbg);
+	e->refcnt = 2;
+	e->type = key->type;
+	e->fwd_key = key->fwd_key;
+	e->bits = key->bits;
+	e->security_bits = key->security_bits;
+	e->max_size = key->max_size;
+	e->hash = hash;
+	e->pkilen = pkilen;
+	memcpy(e->pki, pki, pkilen);
+
+	b = hash % PS_PKEY_CACHE_BUCKETS;
+
+	pthread_mutex_lock(&cache->mutex);
+	/* concurrent load of the same key: keep the first one */
+	for (c = cache->buckets[b]; c; c = c->next) {
+		if ((c->hash == hash) && (c->type == e->type) &&
+		    (c->pkilen == pkilen) && !memcmp(c->pki, pki, pkilen))
+			break;
+	}
+	if (!c) {
+		e->next = cache->buckets[b];
+		cache->buckets[b] = e;
+		cache->nentries++;
+		pkey_cache_expire(cache, PS_PKEY_CACHE_MAX);
+		key->fwd_shared = e;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (c)
+		OPENSSL_free(e);
+}
+
+int pkey_cache_init(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct pkey_cache *cache = &pkcs->pkcache;
+	int rc;
+
+	cache->nentries = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+
+	rc = pthread_mutex_init(&cache->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	cache->buckets = OPENSSL_zalloc(PS_PKEY_CACHE_BUCKETS *
+					sizeof(*cache->buckets));
+	if (!cache->buckets) {
+		pthread_mutex_destroy(&cache->mutex);
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
+void pkey_cache_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct pkey_cache *cache = &pkcs->pkcache;
+	struct pkey_cache_entry *e;
+	unsigned int b;
+
+	if (!cache->buckets)
+		return;
+
+	pthread_mutex_lock(&cache->mutex);
+	for (b = 0; b < PS_PKEY_CACHE_BUCKETS; b++) {
+		while ((e = cache->buckets[b])) {
+			cache->buckets[b] = e->next;
+			pkey_entry_put(e);
+		}
+	}
+	OPENSSL_free(cache->buckets);
+	cache->buckets = NULL;
+	cache->nentries = 0;
+	pthread_mutex_unlock(&cache->mutex);
+
+	ps_dbg_info(dbg, "pkcs: %p, pkey cache: hits: %lu, misses: %lu",
+		    pkcs, cache->hits, cache->misses);
+
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+void pkey_cache_lock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->pkcache.buckets)
+		pthread_mutex_lock(&pkcs->pkcache.mutex);
+}
+
+void pkey_cache_unlock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->pkcache.buckets)
+		pthread_mutex_unlock(&pkcs->pkcache.mutex);
+}
+
+/*
+ * Sets up the forward key of a token key from its public_key_info. The
+ * forward key is shared with other keys of the same public_key_info.
+ */
+static int keymgmt_fetch_pki(struct obj *key)
+{
+	unsigned long hash;
+	CK_BYTE_PTR pki;
+	CK_ULONG pkilen;
+
+	if (obj_get_pub_key_info(key, &pki, &pkilen) != OSSL_RV_OK) {
+		ps_obj_debug(key, "key: %p, no public_key_info available",
+			     key);
+		return OSSL_RV_ERR;
+	}
+
+	hash = ps_hash(pki, pkilen);
+	if (pkey_cache_get(key, pki, pkilen, hash) == OSSL_RV_OK)
+		return OSSL_RV_OK;
+
+	key->fwd_key = keymgmt_fwd_new(key->pctx, key->type);
+	if (!key->fwd_key)
+		return OSSL_RV_ERR;
+
+	if (keymgmt_import_pki(key, key->fwd_key, pki, pkilen) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	pkey_cache_add(key, pki, pkilen, hash);
+	return OSSL_RV_OK;
+}
+
+/* replaces a shared forward key by a private copy before modifications */
+static int keymgmt_fwd_unshare(struct obj *key)
+{
+	void *fwd_key;
+	CK_BYTE_PTR pki;
+	CK_ULONG pkilen;
+
+	if (!key->fwd_shared)
+		return OSSL_RV_OK;
+
+	if (obj_get_pub_key_info(key, &pki, &pkilen) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	fwd_key = keymgmt_fwd_new(key->pctx, key->type);
+	if (!fwd_key)
+		return OSSL_RV_ERR;
+
+	if (keymgmt_import_pki(key, fwd_key, pki, pkilen) != OSSL_RV_OK) {
+		if (key->fwd_shared->fwd_free_fn)
+			key->fwd_shared->fwd_free_fn(fwd_key);
+		return OSSL_RV_ERR;
+	}
+
+	pkey_entry_put(key->fwd_shared);
+	key->fwd_shared = NULL;
+	key->fwd_key = fwd_key;
+	return OSSL_RV_OK;
+}
+
 static struct obj *keymgmt_new(struct provider_ctx *pctx,
 			       int type)
 {
@@ -307,6 +589,12 @@ static void ps_keymgmt_free(void *vkey)
 
 	ps_obj_debug(key, "key: %p", key);
 
+	if (key->fwd_shared) {
+		pkey_entry_put(key->fwd_shared);
+		key->fwd_shared = NULL;
+		key->fwd_key = NULL;
+	}
+
 	fwd_free_fn = (OSSL_FUNC_keymgmt_free_fn *)
 		fwd_keymgmt_get_func(&key->pctx->fwd,
 				     key->type, OSSL_FUNC_KEYMGMT_FREE,
@@ -410,6 +698,39 @@ static int ps_keymgmt_validate(const void *vkey,
 	return OSSL_RV_OK;
 }
 
+/*
+ * Returns OSSL_RV_OK, if all params are served from the cached key
+ * parameters. Otherwise, the params are left for the fwd key.
+ */
+static int keymgmt_get_cached_params(struct obj *key, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+
+	if (!key->max_size || !params)
+		return OSSL_RV_ERR;
+
+	for (p = params; p->key; p++) {
+		if (strcmp(p->key, OSSL_PKEY_PARAM_MAX_SIZE) &&
+		    strcmp(p->key, OSSL_PKEY_PARAM_BITS) &&
+		    strcmp(p->key, OSSL_PKEY_PARAM_SECURITY_BITS))
+			return OSSL_RV_ERR;
+	}
+
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_MAX_SIZE);
+	if (p && !OSSL_PARAM_set_int(p, key->max_size))
+		return OSSL_RV_ERR;
+
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_BITS);
+	if (p && !OSSL_PARAM_set_int(p, key->bits))
+		return OSSL_RV_ERR;
+
+	p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_SECURITY_BITS);
+	if (p && !OSSL_PARAM_set_int(p, key->security_bits))
+		return OSSL_RV_ERR;
+
+	return OSSL_RV_OK;
+}
+
 static int ps_keymgmt_get_params(void *vkey, OSSL_PARAM params[])
 {
 	OSSL_FUNC_keymgmt_get_params_fn *fwd_get_params_fn;
@@ -423,6 +744,10 @@ static int ps_keymgmt_get_params(void *vkey, OSSL_PARAM params[])
 	for (p = params; (p && p->key); p++)
 		ps_obj_debug(key, "param: %s (0x%x)", p->key, p->data_type);
 
+	/* size parameters of loaded keys are served from the cache */
+	if (keymgmt_get_cached_params(key, params) == OSSL_RV_OK)
+		return OSSL_RV_OK;
+
 	/* get params of fwd key first */
 	fwd_get_params_fn = (OSSL_FUNC_keymgmt_get_params_fn *)
 		fwd_keymgmt_get_func(&key->pctx->fwd,
@@ -461,6 +786,12 @@ static int ps_keymgmt_set_params(void *vkey, const OSSL_PARAM params[])
 	if (!fwd_set_params_fn)
 		return OSSL_RV_OK;
 
+	if (keymgmt_fwd_unshare(key) != OSSL_RV_OK) {
+		put_error_key(key, PS_ERR_INTERNAL_ERROR,
+			      "keymgmt_fwd_unshare failed");
+		return OSSL_RV_ERR;
+	}
+
 	if (fwd_set_params_fn(key->fwd_key, params) != OSSL_RV_OK) {
 		put_error_key(key, PS_ERR_DEFAULT_PROV_FUNC_FAILED,
 			      "fwd_set_params_fn failed");
@@ -600,6 +931,12 @@ static int ps_keymgmt_import_fwd(struct obj *key, int selection,
 		return OSSL_RV_ERR;
 	}
 
+	if (keymgmt_fwd_unshare(key) != OSSL_RV_OK) {
+		put_error_key(key, PS_ERR_INTERNAL_ERROR,
+			      "keymgmt_fwd_unshare failed");
+		return OSSL_RV_ERR;
+	}
+
 	if (fwd_import_fn(key->fwd_key, selection, params) != OSSL_RV_OK) {
 		put_error_key(key, PS_ERR_DEFAULT_PROV_FUNC_FAILED,
 			      "fwd_import_fn failed");
@@ -759,10 +1096,6 @@ static void *ps_keymgmt_load(const void *reference, size_t reference_sz)
 	key = obj_get((struct obj *)reference);
 	key->use_pkcs11 = (obj_get_class(key) == CKO_PRIVATE_KEY);
 
-	key->fwd_key = keymgmt_fwd_new(key->pctx, key->type);
-	if (!key->fwd_key)
-		goto err;
-
 	if (keymgmt_fetch_pki(key) != OSSL_RV_OK)
 		goto err;
 
@@ -1148,6 +1481,9 @@ int keymgmt_get_size(struct obj *key)
 
 	ps_obj_debug(key, "key: %p", key);
 
+	if (key->max_size > 0)
+		return key->max_size;
+
 	if (ps_keymgmt_get_params(key, key_params) != OSSL_RV_OK ||
 	    !OSSL_PARAM_modified(&key_params[0]) ||
 	    size <= 0) {
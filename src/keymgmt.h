@@ -10,4 +10,12 @@ extern const OSSL_ALGORITHM ps_keymgmt[];
 
 int keymgmt_get_size(struct obj *key);
 
+#define PS_PKEY_CACHE_BUCKETS	64
+#define PS_PKEY_CACHE_MAX	256
+
+int pkey_cache_init(struct pkcs11_module *pkcs, struct dbg *dbg);
+void pkey_cache_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void pkey_cache_lock(struct pkcs11_module *pkcs);
+void pkey_cache_unlock(struct pkcs11_module *pkcs);
+
 #endif /* _PKCS11SIGN_KEYMGMT_H */
@@ -3,12 +3,17 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <limits.h>
+#include <sched.h>
 #include <string.h>
+#include <unistd.h>
 #include <openssl/crypto.h>
 
 #include "common.h"
 #include "debug.h"
 #include "pkcs11.h"
+#include "fork.h"
+#include "object.h"
 
 static CK_ATTRIBUTE *get_attribute(const struct obj *obj,
 				   CK_ATTRIBUTE_TYPE type)
@@ -60,6 +65,23 @@ int obj_get_id(const struct obj *obj, CK_BYTE_PTR *id, CK_ULONG_PTR idlen)
 	return OSSL_RV_OK;
 }
 
+int obj_get_label(const struct obj *obj, CK_BYTE_PTR *label, CK_ULONG_PTR labellen)
+{
+	CK_ATTRIBUTE_PTR attr;
+
+	if (!obj)
+		return OSSL_RV_ERR;
+
+	attr = get_attribute(obj, CKA_LABEL);
+	if (!attr)
+		return OSSL_RV_ERR;
+
+	*label = (CK_BYTE_PTR)attr->pValue;
+	*labellen = attr->ulValueLen;
+
+	return OSSL_RV_OK;
+}
+
 CK_KEY_TYPE obj_get_key_type(const struct obj *obj)
 {
 	CK_ATTRIBUTE_PTR attr;
@@ -88,24 +110,101 @@ CK_OBJECT_CLASS obj_get_class(const struct obj *obj)
 	return *(CK_OBJECT_CLASS_PTR)attr->pValue;
 }
 
+/*
+ * The object handle of a token key is cached in the key object and shared
+ * by all operation contexts using the key. It is ignored after a fork
+ * (fork generation) and invalidated, if the token rejects the handle.
+ */
+CK_OBJECT_HANDLE obj_get_handle(struct obj *obj)
+{
+	/* the generation is stored after the handle */
+	if (__atomic_load_n(&obj->hobject_gen, __ATOMIC_ACQUIRE) !=
+	    atfork_generation())
+		return CK_INVALID_HANDLE;
+
+	return __atomic_load_n(&obj->hobject, __ATOMIC_ACQUIRE);
+}
+
+void obj_set_handle(struct obj *obj, CK_OBJECT_HANDLE hobject)
+{
+	__atomic_store_n(&obj->hobject, hobject, __ATOMIC_RELEASE);
+	__atomic_store_n(&obj->hobject_gen, atfork_generation(),
+			 __ATOMIC_RELEASE);
+}
+
+void obj_invalidate_handle(struct obj *obj, CK_OBJECT_HANDLE hobject)
+{
+	__atomic_compare_exchange_n(&obj->hobject, &hobject, CK_INVALID_HANDLE,
+				    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Reference counting
+ *
+ * Operation contexts (sign, decrypt, derive) take and drop a key
+ * reference per operation init. With many threads on one key, a single
+ * refcount would bounce its cache line between the CPUs. Operation
+ * references are therefore counted in per-CPU shards, one cache line
+ * each, see obj_ref_get(). All other references are counted in refcnt.
+ *
+ * If refcnt drops to zero while shards exist, the shards are folded into
+ * refcnt: refcnt is biased, each shard is exchanged with OBJ_REF_DEAD
+ * and the shard counts replace the bias. Operation references on a dead
+ * shard are counted in refcnt, the last put frees the object.
+ */
+#define OBJ_REF_DEAD		(LONG_MIN / 2)
+#define OBJ_REF_IS_DEAD(v)	((v) < (LONG_MIN / 4))
+#define OBJ_REF_BIAS		(1U << 30)
+
+static unsigned int obj_ref_nshards;
+
 static void _obj_free(struct obj *obj)
 {
+	if (obj->refs)
+		OPENSSL_free(obj->refs->mem);
 	if (obj->pin)
 		OPENSSL_clear_free(obj->pin, strlen(obj->pin));
-	pkcs11_attrs_deepfree(obj->attrs, obj->nattrs);
+	/* attributes and values are a single allocation */
 	OPENSSL_free(obj->attrs);
 	OPENSSL_free(obj);
 }
 
+/* refcnt dropped to zero */
+static void obj_release(struct obj *obj)
+{
+	struct obj_refs *refs;
+	unsigned int i;
+	long count = 0;
+
+	refs = __atomic_load_n(&obj->refs, __ATOMIC_ACQUIRE);
+	if (!refs || obj->refs_dead) {
+		_obj_free(obj);
+		return;
+	}
+
+	/* no other references than operation references are left */
+	__atomic_store_n(&obj->refcnt, OBJ_REF_BIAS, __ATOMIC_RELAXED);
+	obj->refs_dead = true;
+
+	for (i = 0; i < refs->nshards; i++)
+		count += __atomic_exchange_n(&refs->shard[i].count,
+					     OBJ_REF_DEAD, __ATOMIC_ACQ_REL);
+
+	if (!__atomic_add_fetch(&obj->refcnt,
+				(unsigned int)count - OBJ_REF_BIAS,
+				__ATOMIC_ACQ_REL))
+		_obj_free(obj);
+}
+
 void obj_free(struct obj *obj)
 {
 	if (!obj)
 		return;
 
-	if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_SEQ_CST))
+	if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL))
 		return;
 
-	_obj_free(obj);
+	obj_release(obj);
 }
 
 struct obj *obj_get(struct obj *obj)
@@ -113,10 +212,98 @@ struct obj *obj_get(struct obj *obj)
 	if (!obj)
 		return NULL;
 
-	__atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_ACQ_REL);
 	return obj;
 }
 
+static struct obj_refs *obj_refs_new(struct obj *obj)
+{
+	struct obj_refs *refs, *cur = NULL;
+	unsigned int n;
+	long ncpus;
+	void *mem;
+
+	n = __atomic_load_n(&obj_ref_nshards, __ATOMIC_RELAXED);
+	if (!n) {
+		ncpus = sysconf(_SC_NPROCESSORS_CONF);
+		n = (ncpus < 1) ? 1 :
+		    (ncpus > PS_OBJ_REF_SHARDS_MAX) ? PS_OBJ_REF_SHARDS_MAX :
+		    (unsigned int)ncpus;
+		__atomic_store_n(&obj_ref_nshards, n, __ATOMIC_RELAXED);
+	}
+
+	/* cache line aligned */
+	mem = OPENSSL_zalloc(sizeof(struct obj_refs) +
+			     n * sizeof(struct obj_ref_shard) +
+			     PS_CACHELINE_SIZE - 1);
+	if (!mem)
+		return NULL;
+
+	refs = (struct obj_refs *)(((uintptr_t)mem + PS_CACHELINE_SIZE - 1) &
+				   ~(uintptr_t)(PS_CACHELINE_SIZE - 1));
+	refs->mem = mem;
+	refs->nshards = n;
+
+	/* concurrent first operations */
+	if (!__atomic_compare_exchange_n(&obj->refs, &cur, refs, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		OPENSSL_free(mem);
+		return cur;
+	}
+
+	return refs;
+}
+
+/*
+ * Takes an operation reference on obj, the caller must hold a reference.
+ * Returns the shard of the reference, which is passed to obj_ref_put(),
+ * or -1 for a plain reference.
+ */
+int obj_ref_get(struct obj *obj)
+{
+	struct obj_refs *refs;
+	int cpu;
+	long v;
+
+	refs = __atomic_load_n(&obj->refs, __ATOMIC_ACQUIRE);
+	if (!refs)
+		refs = obj_refs_new(obj);
+	if (!refs) {
+		obj_get(obj);
+		return -1;
+	}
+
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	cpu %= refs->nshards;
+
+	v = __atomic_fetch_add(&refs->shard[cpu].count, 1, __ATOMIC_ACQ_REL);
+	if (OBJ_REF_IS_DEAD(v))
+		__atomic_fetch_add(&obj->refcnt, 1, __ATOMIC_ACQ_REL);
+
+	return cpu;
+}
+
+void obj_ref_put(struct obj *obj, int ref)
+{
+	struct obj_refs *refs;
+	long v;
+
+	if (!obj)
+		return;
+
+	if (ref < 0) {
+		obj_free(obj);
+		return;
+	}
+
+	refs = __atomic_load_n(&obj->refs, __ATOMIC_ACQUIRE);
+	v = __atomic_fetch_sub(&refs->shard[ref].count, 1, __ATOMIC_ACQ_REL);
+	if (OBJ_REF_IS_DEAD(v))
+		obj_free(obj);
+}
+
 struct obj *obj_new_init(struct provider_ctx *pctx, CK_SLOT_ID slot_id, const char *pin)
 {
 	struct obj *obj;
@@ -130,5 +317,41 @@ struct obj *obj_new_init(struct provider_ctx *pctx, CK_SLOT_ID slot_id, const ch
 	if (pin)
 		obj->pin = OPENSSL_strdup(pin);
 
+	obj->hobject = CK_INVALID_HANDLE;
+
 	return obj_get(obj);
 }
+
+/*
+ * Returns a new object with the token attributes, the key type and the
+ * cached handle of obj. Key management state (e.g. the forward key) is
+ * not copied.
+ */
+struct obj *obj_dup(struct obj *obj)
+{
+	struct obj *dup;
+
+	if (!obj)
+		return NULL;
+
+	dup = obj_new_init(obj->pctx, obj->slot_id, obj->pin);
+	if (!dup)
+		return NULL;
+
+	if (obj->pin && !dup->pin)
+		goto err;
+
+	dup->attrs = pkcs11_attrs_pack(obj->attrs, obj->nattrs);
+	if (obj->attrs && !dup->attrs)
+		goto err;
+	dup->nattrs = obj->nattrs;
+	dup->type = obj->type;
+
+	dup->hobject = __atomic_load_n(&obj->hobject, __ATOMIC_ACQUIRE);
+	dup->hobject_gen = __atomic_load_n(&obj->hobject_gen, __ATOMIC_ACQUIRE);
+
+	return dup;
+err:
+	obj_free(dup);
+	return NULL;
+}
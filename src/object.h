@@ -6,17 +6,27 @@
 #ifndef _PKCS11SIGN_OBJECT_H
 #define _PKCS11SIGN_OBJECT_H
 
+#define PS_OBJ_REF_SHARDS_MAX	64
+
 #include "common.h"
 #include "debug.h"
 #include "pkcs11.h"
 
 int obj_get_pub_key_info(const struct obj *obj, CK_BYTE_PTR *info, CK_ULONG_PTR infolen);
 int obj_get_id(const struct obj *obj, CK_BYTE_PTR *id, CK_ULONG_PTR idlen);
+int obj_get_label(const struct obj *obj, CK_BYTE_PTR *label, CK_ULONG_PTR labellen);
 CK_KEY_TYPE obj_get_key_type(const struct obj *obj);
 CK_OBJECT_CLASS obj_get_class(const struct obj *obj);
 
+CK_OBJECT_HANDLE obj_get_handle(struct obj *obj);
+void obj_set_handle(struct obj *obj, CK_OBJECT_HANDLE hobject);
+void obj_invalidate_handle(struct obj *obj, CK_OBJECT_HANDLE hobject);
+
 void obj_free(struct obj *obj);
 struct obj *obj_get(struct obj *obj);
+int obj_ref_get(struct obj *obj);
+void obj_ref_put(struct obj *obj, int ref);
 struct obj *obj_new_init(struct provider_ctx *pctx, CK_SLOT_ID slot_id, const char *pin);
+struct obj *obj_dup(struct obj *obj);
 
 #endif /* _PKCS11SIGN_OBJECT_H */
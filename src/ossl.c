@@ -3,17 +3,18 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <limits.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
-#include <openssl/bn.h>
 #include <openssl/crypto.h>
-#include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/provider.h>
 #include <openssl/rsa.h>
 #include <openssl/core.h>
 #include <openssl/core_dispatch.h>
 #include <openssl/core_names.h>
+#include <openssl/params.h>
 
 #include "ossl.h"
 #include "debug.h"
@@ -113,6 +114,110 @@ int size_by_name(const char *name, int *size)
 	return OSSL_RV_ERR;
 }
 
+static const struct {
+	const char *name;
+	int id;
+} name_padmode_map[] = {
+	{ OSSL_PKEY_RSA_PAD_MODE_NONE,		RSA_NO_PADDING },
+	{ OSSL_PKEY_RSA_PAD_MODE_PKCSV15,	RSA_PKCS1_PADDING },
+	{ OSSL_PKEY_RSA_PAD_MODE_OAEP,		RSA_PKCS1_OAEP_PADDING },
+	{ OSSL_PKEY_RSA_PAD_MODE_X931,		RSA_X931_PADDING },
+	{ OSSL_PKEY_RSA_PAD_MODE_PSS,		RSA_PKCS1_PSS_PADDING },
+};
+
+static const struct {
+	const char *name;
+	int saltlen;
+} name_saltlen_map[] = {
+	{ OSSL_PKEY_RSA_PSS_SALT_LEN_DIGEST,	RSA_PSS_SALTLEN_DIGEST },
+	{ OSSL_PKEY_RSA_PSS_SALT_LEN_MAX,	RSA_PSS_SALTLEN_MAX },
+	{ OSSL_PKEY_RSA_PSS_SALT_LEN_AUTO,	RSA_PSS_SALTLEN_AUTO },
+#ifdef RSA_PSS_SALTLEN_AUTO_DIGEST_MAX
+	{ OSSL_PKEY_RSA_PSS_SALT_LEN_AUTO_DIGEST_MAX,
+						RSA_PSS_SALTLEN_AUTO_DIGEST_MAX },
+#endif
+};
+
+/* pad mode param, either an int or its name (utf8 string) */
+int ossl_param_get_padmode(const OSSL_PARAM *p, int *padmode)
+{
+	size_t i, nelem = sizeof(name_padmode_map) / sizeof(*name_padmode_map);
+
+	if (p->data_type != OSSL_PARAM_UTF8_STRING)
+		return OSSL_PARAM_get_int(p, padmode);
+
+	for (i = 0; i < nelem; i++) {
+		if (OPENSSL_strcasecmp(p->data, name_padmode_map[i].name) != 0)
+			continue;
+
+		*padmode = name_padmode_map[i].id;
+		return OSSL_RV_OK;
+	}
+
+	return OSSL_RV_ERR;
+}
+
+int ossl_param_set_padmode(OSSL_PARAM *p, int padmode)
+{
+	size_t i, nelem = sizeof(name_padmode_map) / sizeof(*name_padmode_map);
+
+	if (p->data_type != OSSL_PARAM_UTF8_STRING)
+		return OSSL_PARAM_set_int(p, padmode);
+
+	for (i = 0; i < nelem; i++) {
+		if (padmode == name_padmode_map[i].id)
+			return OSSL_PARAM_set_utf8_string(p,
+					name_padmode_map[i].name);
+	}
+
+	return OSSL_RV_ERR;
+}
+
+/* pss salt length param, either an int or a name or number (utf8 string) */
+int ossl_param_get_saltlen(const OSSL_PARAM *p, int *saltlen)
+{
+	size_t i, nelem = sizeof(name_saltlen_map) / sizeof(*name_saltlen_map);
+	const char *s = p->data;
+	char *end;
+	long val;
+
+	if (p->data_type != OSSL_PARAM_UTF8_STRING)
+		return OSSL_PARAM_get_int(p, saltlen);
+
+	for (i = 0; i < nelem; i++) {
+		if (strcmp(s, name_saltlen_map[i].name) != 0)
+			continue;
+
+		*saltlen = name_saltlen_map[i].saltlen;
+		return OSSL_RV_OK;
+	}
+
+	val = strtol(s, &end, 10);
+	if ((end == s) || *end || (val < 0) || (val > INT_MAX))
+		return OSSL_RV_ERR;
+
+	*saltlen = (int)val;
+	return OSSL_RV_OK;
+}
+
+int ossl_param_set_saltlen(OSSL_PARAM *p, int saltlen)
+{
+	size_t i, nelem = sizeof(name_saltlen_map) / sizeof(*name_saltlen_map);
+	char buf[16];
+
+	if (p->data_type != OSSL_PARAM_UTF8_STRING)
+		return OSSL_PARAM_set_int(p, saltlen);
+
+	for (i = 0; i < nelem; i++) {
+		if (saltlen == name_saltlen_map[i].saltlen)
+			return OSSL_PARAM_set_utf8_string(p,
+					name_saltlen_map[i].name);
+	}
+
+	snprintf(buf, sizeof(buf), "%d", saltlen);
+	return OSSL_PARAM_set_utf8_string(p, buf);
+}
+
 int ossl_hash_prefix(EVP_MD_CTX *mdctx, unsigned char *p, unsigned int *size)
 {
 	const unsigned char *der;
@@ -165,9 +270,73 @@ int ossl_hash_prefix(EVP_MD_CTX *mdctx, unsigned char *p, unsigned int *size)
 	return OSSL_RV_OK;
 }
 
+static size_t der_length_size(size_t len)
+{
+	size_t n = 1;
+
+	/* short form */
+	if (len < 0x80)
+		return n;
+
+	/* long form */
+	while (len) {
+		len >>= 8;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Returns the maximum size of a DER encoded ECDSA signature.
+ *
+ * @param order_len          the size of the curve order in bytes
+ *
+ * @returns the maximum signature size.
+ */
+size_t ossl_ecdsa_signature_size(size_t order_len)
+{
+	size_t int_len, seq_len;
+
+	/* INTEGER r and s, with a leading zero byte at most */
+	int_len = 1 + der_length_size(order_len + 1) + order_len + 1;
+	seq_len = 2 * int_len;
+
+	return 1 + der_length_size(seq_len) + seq_len;
+}
+
+static size_t der_length_put(unsigned char *p, size_t len)
+{
+	size_t n = der_length_size(len), i;
+
+	if (n == 1) {
+		p[0] = len;
+		return n;
+	}
+
+	p[0] = 0x80 | (n - 1);
+	for (i = n - 1; i > 0; i--) {
+		p[i] = len & 0xff;
+		len >>= 8;
+	}
+	return n;
+}
+
+/* number of leading zero bytes of an unsigned integer, keeping one byte */
+static size_t der_integer_skip(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len - 1 && !p[i]; i++)
+		;
+	return i;
+}
+
 /**
  * Builds an DER encoded signature from a raw signature.
  *
+ * The signature is encoded without allocations. The encoded signature
+ * may be written in place, i.e. sig may be the same buffer as raw_sig.
+ *
  * @param raw_sig            the raw signature to encode
  * @param raw_sig_len        the size of the raw signature (2 times prime len)
  * @param sig                a buffer for storing the encoded signature. If
@@ -180,52 +349,70 @@ int ossl_hash_prefix(EVP_MD_CTX *mdctx, unsigned char *p, unsigned int *size)
 int ossl_ecdsa_signature(const unsigned char *raw_sig, size_t raw_siglen,
 			 unsigned char *sig, size_t *siglen)
 {
-	int rc = OSSL_RV_OK;
-	unsigned char *der;
-	ECDSA_SIG *ec_sig;
-	int derlen;
+	size_t n, rskip, sskip, rlen, slen, rint, sint;
+	size_t seqlen, derlen, roff, soff;
+	unsigned int rpad, spad;
+	unsigned char *p;
 
-	if (!raw_sig || !raw_siglen)
+	if (!raw_sig || !raw_siglen || (raw_siglen % 2) || !siglen)
 		return OSSL_RV_ERR;
 
-	ec_sig = ECDSA_SIG_new();
-	if (!ec_sig) {
-		return OSSL_RV_ERR;
-	}
-
-	rc = ECDSA_SIG_set0(ec_sig,
-			    BN_bin2bn(raw_sig, raw_siglen / 2, NULL),
-			    BN_bin2bn(raw_sig + raw_siglen / 2, raw_siglen / 2, NULL));
-	if (rc != OSSL_RV_OK)
-		goto out;
-
-	derlen = i2d_ECDSA_SIG(ec_sig, NULL);
-	if (derlen <= 0) {
-		rc = OSSL_RV_ERR;
-		goto out;
-	}
+	/* r and s without leading zeros, plus a zero byte if negative */
+	n = raw_siglen / 2;
+	rskip = der_integer_skip(raw_sig, n);
+	sskip = der_integer_skip(raw_sig + n, n);
+	rlen = n - rskip;
+	slen = n - sskip;
+	rpad = !!(raw_sig[rskip] & 0x80);
+	spad = !!(raw_sig[n + sskip] & 0x80);
+	rint = rpad + rlen;
+	sint = spad + slen;
+
+	seqlen = 1 + der_length_size(rint) + rint +
+		 1 + der_length_size(sint) + sint;
+	derlen = 1 + der_length_size(seqlen) + seqlen;
 
 	if (!sig) {
 		*siglen = derlen;
-		goto out;
+		return OSSL_RV_OK;
 	}
 
-	if (*siglen < (size_t)derlen) {
-		rc = OSSL_RV_ERR;
-		goto out;
-	}
+	if (*siglen < derlen)
+		return OSSL_RV_ERR;
 
-	der = sig;
-	derlen = i2d_ECDSA_SIG(ec_sig, &der);
-	if (derlen <= 0) {
-		rc = OSSL_RV_ERR;
-		goto out;
+	/* offsets of the r and s values in the encoded signature */
+	roff = 1 + der_length_size(seqlen) + 1 + der_length_size(rint) + rpad;
+	soff = roff + rlen + 1 + der_length_size(sint) + spad;
+
+	/*
+	 * Move the values before writing the headers. If r would overwrite
+	 * the raw s (in place), then s is moved first. In that case, the
+	 * encoded s starts behind the raw r, so it can not overwrite it.
+	 */
+	if (roff + rlen <= n + sskip) {
+		memmove(sig + roff, raw_sig + rskip, rlen);
+		memmove(sig + soff, raw_sig + n + sskip, slen);
+	} else {
+		memmove(sig + soff, raw_sig + n + sskip, slen);
+		memmove(sig + roff, raw_sig + rskip, rlen);
 	}
 
+	p = sig;
+	*p++ = 0x30;
+	p += der_length_put(p, seqlen);
+	*p++ = 0x02;
+	p += der_length_put(p, rint);
+	if (rpad)
+		*p = 0x00;
+
+	p = sig + roff + rlen;
+	*p++ = 0x02;
+	p += der_length_put(p, sint);
+	if (spad)
+		*p = 0x00;
+
 	*siglen = derlen;
-out:
-	ECDSA_SIG_free(ec_sig);
-	return rc;
+	return OSSL_RV_OK;
 }
 
 void ossl_put_error(struct ossl_core *core, int err,
@@ -249,31 +436,51 @@ void ossl_put_error(struct ossl_core *core, int err,
 	va_end(ap);
 }
 
-static func_t fwd_get_func(struct ossl_provider *fwd, int operation_id,
-		    const char *algorithm, int function_id,
-		    struct dbg *dbg)
+static const int fwd_op_ids[FWD_OP_MAX] = {
+	[FWD_OP_KEYMGMT] = OSSL_OP_KEYMGMT,
+	[FWD_OP_KEYEXCH] = OSSL_OP_KEYEXCH,
+	[FWD_OP_ASYM_CIPHER] = OSSL_OP_ASYM_CIPHER,
+	[FWD_OP_SIGNATURE] = OSSL_OP_SIGNATURE,
+};
+
+static int fwd_get_key(int pkey_type)
 {
-	const OSSL_ALGORITHM *fwd_algos, *algs;
-	const OSSL_DISPATCH *fwd_impl, *impl;
-	int algolen = strlen(algorithm);
-	int no_cache = 0, query = 0;
-	func_t func = NULL;
-	const char *found;
+	switch (pkey_type) {
+	case EVP_PKEY_RSA:
+		return FWD_KEY_RSA;
+	case EVP_PKEY_RSA_PSS:
+		return FWD_KEY_RSA_PSS;
+	case EVP_PKEY_EC:
+		return FWD_KEY_EC;
+	default:
+		return -1;
+	}
+}
 
-	if (fwd == NULL || fwd->provider == NULL ||
-	    operation_id <= 0 || operation_id > OSSL_OP__HIGHEST)
+static const char *fwd_get_algo(enum fwd_op op, enum fwd_key key)
+{
+	switch (key) {
+	case FWD_KEY_RSA:
+		return "RSA";
+	case FWD_KEY_RSA_PSS:
+		return "RSA-PSS";
+	case FWD_KEY_EC:
+		if (op == FWD_OP_SIGNATURE)
+			return "ECDSA";
+		if (op == FWD_OP_KEYEXCH)
+			return "ECDH";
+		return "EC";
+	default:
 		return NULL;
-
-	ps_dbg_debug(dbg, "operation_id: %d, algo: %s, func: %d",
-		     operation_id, algorithm, function_id);
-
-	fwd_algos = fwd->alg_cache[operation_id];
-	if (fwd_algos == NULL) {
-		fwd_algos = OSSL_PROVIDER_query_operation(
-				fwd->provider,
-				operation_id, &no_cache);
-		query = 1;
 	}
+}
+
+static const OSSL_ALGORITHM *fwd_find_algo(const OSSL_ALGORITHM *fwd_algos,
+					   const char *algorithm)
+{
+	const OSSL_ALGORITHM *algs;
+	int algolen = strlen(algorithm);
+	const char *found;
 
 	for (algs = fwd_algos; algs != NULL &&
 				   algs->algorithm_names != NULL; algs++) {
@@ -284,93 +491,156 @@ static func_t fwd_get_func(struct ossl_provider *fwd, int operation_id,
 			continue;
 		if (found != algs->algorithm_names && found[-1] != ':')
 			continue;
+		return algs;
+	}
 
-		fwd_impl = algs->implementation;
-		for (impl = fwd_impl; impl->function_id != 0; impl++) {
-			if (impl->function_id == function_id) {
-				func = impl->function;
-				break;
+	return NULL;
+}
+
+static void fwd_resolve_funcs(struct ossl_provider *fwd, enum fwd_op op,
+			      struct dbg *dbg)
+{
+	const OSSL_ALGORITHM *fwd_algos, *algs;
+	const OSSL_DISPATCH *impl;
+	const char *algorithm;
+	int no_cache = 0;
+	int key;
+
+	fwd_algos = OSSL_PROVIDER_query_operation(fwd->provider,
+						  fwd_op_ids[op], &no_cache);
+	if (!fwd_algos)
+		return;
+
+	for (key = 0; key < FWD_KEY_MAX; key++) {
+		algorithm = fwd_get_algo(op, key);
+		algs = fwd_find_algo(fwd_algos, algorithm);
+		if (!algs)
+			continue;
+
+		for (impl = algs->implementation; impl->function_id != 0; impl++) {
+			if (impl->function_id >= FWD_FUNC_ID_MAX) {
+				ps_dbg_debug(dbg, "operation_id: %d, algo: %s, func: %d ignored",
+					     fwd_op_ids[op], algorithm,
+					     impl->function_id);
+				continue;
 			}
+			fwd->funcs[op][key][impl->function_id] = impl->function;
 		}
-		break;
 	}
 
-	if (query == 1 && fwd_algos != NULL)
-		OSSL_PROVIDER_unquery_operation(fwd->provider,
-						operation_id,
-						fwd_algos);
-
-	if (no_cache == 0 &&
-	    fwd->alg_cache[operation_id] == NULL)
-		fwd->alg_cache[operation_id] = fwd_algos;
-
-	ps_dbg_debug(dbg, "func: %p", func);
-	return func;
+	OSSL_PROVIDER_unquery_operation(fwd->provider, fwd_op_ids[op],
+					fwd_algos);
 }
 
-static const char *fwd_get_algo(int pkey_type, bool sign)
+static func_t fwd_get_func(struct ossl_provider *fwd, enum fwd_op op,
+			   int key, int function_id, struct dbg *dbg)
 {
-	switch (pkey_type) {
-	case EVP_PKEY_RSA:
-		return "RSA";
-	case EVP_PKEY_RSA_PSS:
-		return "RSA-PSS";
-	case EVP_PKEY_EC:
-		if (sign)
-			return "ECDSA";
-		else
-			return "EC";
-	default:
+	func_t func;
+
+	if (fwd == NULL || fwd->provider == NULL ||
+	    key < 0 || key >= FWD_KEY_MAX ||
+	    function_id <= 0 || function_id >= FWD_FUNC_ID_MAX)
 		return NULL;
-	}
+
+	func = fwd->funcs[op][key][function_id];
+
+	ps_dbg_debug(dbg, "operation_id: %d, algo: %s, func: %d: %p",
+		     fwd_op_ids[op], fwd_get_algo(op, key),
+		     function_id, func);
+	return func;
 }
 
 func_t fwd_keymgmt_get_func(struct ossl_provider *fwd, int pkey_type,
 			    int function_id, struct dbg *dbg)
 {
-	return fwd_get_func(fwd, OSSL_OP_KEYMGMT,
-			    fwd_get_algo(pkey_type, false),
+	return fwd_get_func(fwd, FWD_OP_KEYMGMT, fwd_get_key(pkey_type),
 			    function_id, dbg);
 }
 
 func_t fwd_keyexch_get_func(struct ossl_provider *fwd,
 			    int function_id, struct dbg *dbg)
 {
-	return fwd_get_func(fwd, OSSL_OP_KEYEXCH, "ECDH",
+	return fwd_get_func(fwd, FWD_OP_KEYEXCH, FWD_KEY_EC,
 			    function_id, dbg);
 }
 
 func_t fwd_asym_get_func(struct ossl_provider *fwd, int pkey_type,
 			 int function_id, struct dbg *dbg)
 {
-	return fwd_get_func(fwd, OSSL_OP_ASYM_CIPHER,
-			    fwd_get_algo(pkey_type, false),
+	return fwd_get_func(fwd, FWD_OP_ASYM_CIPHER, fwd_get_key(pkey_type),
 			    function_id, dbg);
 }
 
 func_t fwd_sign_get_func(struct ossl_provider *fwd, int pkey_type,
 			 int function_id, struct dbg *dbg)
 {
-	return fwd_get_func(fwd, OSSL_OP_SIGNATURE,
-			    fwd_get_algo(pkey_type, true),
+	return fwd_get_func(fwd, FWD_OP_SIGNATURE, fwd_get_key(pkey_type),
 			    function_id, dbg);
 }
 
+/*
+ * Returns the gettable signature ctx params of the forward provider
+ * (fwd_params) with params of the provider added. The list is merged once
+ * per key type and kept until fwd_teardown().
+ */
+const OSSL_PARAM *fwd_sign_gettable_merge(struct ossl_provider *fwd,
+					  int pkey_type,
+					  const OSSL_PARAM *fwd_params,
+					  const OSSL_PARAM *params)
+{
+	OSSL_PARAM *merged, *expected = NULL;
+	int key;
+
+	key = fwd_get_key(pkey_type);
+	if (!fwd || (key < 0))
+		return fwd_params;
+	if (!fwd_params)
+		return params;
+
+	merged = __atomic_load_n(&fwd->sign_gettable[key], __ATOMIC_ACQUIRE);
+	if (merged)
+		return merged;
+
+	merged = OSSL_PARAM_merge(fwd_params, params);
+	if (!merged)
+		return fwd_params;
+
+	/* merged by another thread */
+	if (!__atomic_compare_exchange_n(&fwd->sign_gettable[key], &expected,
+					 merged, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		OSSL_PARAM_free(merged);
+		return expected;
+	}
+	return merged;
+}
+
 void fwd_teardown(struct ossl_provider *fwd)
 {
+	int key;
+
 	if (!fwd)
 		return;
 
+	for (key = 0; key < FWD_KEY_MAX; key++) {
+		OSSL_PARAM_free(fwd->sign_gettable[key]);
+		fwd->sign_gettable[key] = NULL;
+	}
+
 	if (fwd->provider)
 		OSSL_PROVIDER_unload(fwd->provider);
 	fwd->provider = NULL;
 
+	memset(fwd->funcs, 0, sizeof(fwd->funcs));
+
 	fwd->ctx = NULL;
 }
 
 int fwd_init(struct ossl_provider *fwd, const char *fwd_name,
 	     OSSL_LIB_CTX *libctx, struct dbg *dbg)
 {
+	int op;
+
 	if (!fwd || !fwd_name || !libctx || !dbg)
 		return OSSL_RV_ERR;
 
@@ -385,6 +655,9 @@ int fwd_init(struct ossl_provider *fwd, const char *fwd_name,
 		goto err;
 	fwd->name = fwd_name;
 
+	for (op = 0; op < FWD_OP_MAX; op++)
+		fwd_resolve_funcs(fwd, op, dbg);
+
 	return OSSL_RV_OK;
 
 err:
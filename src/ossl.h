@@ -43,7 +43,12 @@ extern const OSSL_ITEM ps_prov_reason_strings[];
 #define DER_DIGESTINFO_MAX			19 /* see der_DigestInfo_* */
 
 int size_by_name(const char *name, int *size);
+int ossl_param_get_padmode(const OSSL_PARAM *p, int *padmode);
+int ossl_param_set_padmode(OSSL_PARAM *p, int padmode);
+int ossl_param_get_saltlen(const OSSL_PARAM *p, int *saltlen);
+int ossl_param_set_saltlen(OSSL_PARAM *p, int saltlen);
 int ossl_hash_prefix(EVP_MD_CTX *mdctx, unsigned char *p, unsigned int *size);
+size_t ossl_ecdsa_signature_size(size_t order_len);
 int ossl_ecdsa_signature(const unsigned char *raw_sig, size_t raw_siglen,
 			 unsigned char *sig, size_t *siglen);
 void ossl_put_error(struct ossl_core *core, int err,
@@ -59,6 +64,11 @@ func_t fwd_asym_get_func(struct ossl_provider *fwd, int pkey_type,
 func_t fwd_sign_get_func(struct ossl_provider *fwd, int pkey_type,
 			 int function_id, struct dbg *dbg);
 
+const OSSL_PARAM *fwd_sign_gettable_merge(struct ossl_provider *fwd,
+					  int pkey_type,
+					  const OSSL_PARAM *fwd_params,
+					  const OSSL_PARAM *params);
+
 void fwd_teardown(struct ossl_provider *fwd);
 int fwd_init(struct ossl_provider *fwd, const char *fwd_name,
 	     OSSL_LIB_CTX *libctx, struct dbg *dbg);
@@ -10,10 +10,9 @@
 #include <openssl/rsa.h>
 
 #include "debug.h"
+#include "fork.h"
 #include "pkcs11.h"
 
-#define OBJ_PER_SEARCH			8
-
 static const CK_OBJECT_CLASS oc_private = CKO_PRIVATE_KEY;
 static const CK_OBJECT_CLASS oc_public = CKO_PUBLIC_KEY;
 static const CK_OBJECT_CLASS oc_certificate = CKO_CERTIFICATE;
@@ -134,6 +133,11 @@ static void _module_info(struct pkcs11_module *pkcs, struct dbg *dbg)
 		    (int)ck_info.libraryVersion.minor);
 }
 
+/*
+ * Initializes the module once per process. The state is reset in a forked
+ * child (with the mutex held, see fork_child()), the child initializes
+ * the module again. Initialized modules only read the state.
+ */
 static CK_RV module_ensure(struct pkcs11_module *pkcs, struct dbg *dbg)
 {
 	CK_C_INITIALIZE_ARGS args = {
@@ -145,8 +149,9 @@ static CK_RV module_ensure(struct pkcs11_module *pkcs, struct dbg *dbg)
 	if (!pkcs || !dbg)
 		return CKR_ARGUMENTS_BAD;
 
-	/* check state unlocked */
-	if (pkcs->state == PKCS11_INITIALIZED)
+	/* pairs with the release store below */
+	if (__atomic_load_n(&pkcs->state, __ATOMIC_ACQUIRE) ==
+	    PKCS11_INITIALIZED)
 		return CKR_OK;
 
 	rv = pthread_mutex_lock(&pkcs->mutex);
@@ -156,7 +161,8 @@ static CK_RV module_ensure(struct pkcs11_module *pkcs, struct dbg *dbg)
 	}
 
 	/* check state again under lock */
-	if (pkcs->state == PKCS11_INITIALIZED) {
+	if (__atomic_load_n(&pkcs->state, __ATOMIC_RELAXED) ==
+	    PKCS11_INITIALIZED) {
 		ck_rv = CKR_OK;
 		goto out;
 	}
@@ -170,7 +176,7 @@ static CK_RV module_ensure(struct pkcs11_module *pkcs, struct dbg *dbg)
 	}
 
 	pkcs->do_finalize = (ck_rv == CKR_OK);
-	pkcs->state = PKCS11_INITIALIZED;
+	__atomic_store_n(&pkcs->state, PKCS11_INITIALIZED, __ATOMIC_RELEASE);
 	ck_rv = CKR_OK;
 	_module_info(pkcs, dbg);
 out:
@@ -181,6 +187,23 @@ out:
 	return ck_rv;
 }
 
+/* serializes module_ensure() with fork */
+void pkcs11_module_lock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_lock(&pkcs->mutex);
+}
+
+void pkcs11_module_unlock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_unlock(&pkcs->mutex);
+}
+
+/* reset in a forked child, with the module locked */
+void pkcs11_module_fork_reset(struct pkcs11_module *pkcs)
+{
+	__atomic_store_n(&pkcs->state, PKCS11_UNINITIALIZED, __ATOMIC_RELEASE);
+}
+
 static inline void attr_string(CK_ATTRIBUTE_PTR attr, CK_ATTRIBUTE_TYPE type,
 			       const char *s)
 {
@@ -270,6 +293,21 @@ void pkcs11_attr_type(CK_ATTRIBUTE_PTR attr, const char *type)
 	attr->type = CKA_CLASS;
 }
 
+/* object class of a type uri attribute, CK_UNAVAILABLE_INFORMATION if not supported */
+CK_OBJECT_CLASS pkcs11_type_class(const char *type)
+{
+	if (!type)
+		return CK_UNAVAILABLE_INFORMATION;
+	if (strncmp(type, str_priv, strlen(str_priv)) == 0)
+		return CKO_PRIVATE_KEY;
+	if (strncmp(type, str_pub, strlen(str_pub)) == 0)
+		return CKO_PUBLIC_KEY;
+	if (strncmp(type, str_cert, strlen(str_cert)) == 0)
+		return CKO_CERTIFICATE;
+
+	return CK_UNAVAILABLE_INFORMATION;
+}
+
 void pkcs11_attr_id(CK_ATTRIBUTE_PTR attr, const char *id, size_t id_len)
 {
 	attr_bin(attr, CKA_ID, id, id_len);
@@ -292,14 +330,36 @@ size_t pkcs11_strlen(const CK_CHAR_PTR c, CK_ULONG csize)
 
 int pkcs11_strcmp(const char *s, const CK_CHAR_PTR c, CK_ULONG csize)
 {
+	size_t len;
+
 	if (!s)
 		return -1;
 	if (!c || !csize)
 		return 1;
-	if (strlen(s) > csize)
+
+	len = pkcs11_strlen(c, csize);
+	if (strlen(s) != len)
 		return 1;
 
-	return strncmp(s, (const char *)c, pkcs11_strlen(c, csize));
+	return memcmp(s, c, len);
+}
+
+int pkcs11_str_cmp(const char *s, const struct pkcs11_str *str)
+{
+	if (!s)
+		return -1;
+	if (!str || strlen(s) != str->len)
+		return 1;
+
+	return memcmp(s, str->s, str->len);
+}
+
+static void pkcs11_str_set(struct pkcs11_str *str, const CK_CHAR_PTR c,
+			   CK_ULONG csize)
+{
+	str->len = pkcs11_strlen(c, min(csize, PKCS11_STR_MAX));
+	memcpy(str->s, c, str->len);
+	str->s[str->len] = '\0';
 }
 
 void pkcs11_attr_deepfree(CK_ATTRIBUTE_PTR attribute)
@@ -320,44 +380,41 @@ void pkcs11_attrs_deepfree(CK_ATTRIBUTE_PTR attributes, CK_ULONG nattributes)
 		pkcs11_attr_deepfree(&attributes[i]);
 }
 
-CK_RV pkcs11_attr_dup(const CK_ATTRIBUTE_PTR src, CK_ATTRIBUTE_PTR dst)
-{
-	if (!src || !dst)
-		return CKR_ARGUMENTS_BAD;
-
-	if (src->ulValueLen > 0) {
-		if (!src->pValue)
-			return CKR_ARGUMENTS_BAD;
-		dst->pValue = OPENSSL_memdup(src->pValue, src->ulValueLen);
-		if (!dst->pValue)
-			return CKR_HOST_MEMORY;
-	} else {
-		dst->pValue = NULL;
-	}
-
-	dst->type = src->type;
-	dst->ulValueLen = src->ulValueLen;
-	return CKR_OK;
-}
+#define ATTR_ALIGN(len)		(((len) + sizeof(void *) - 1) & \
+				 ~(sizeof(void *) - 1))
 
-CK_ATTRIBUTE_PTR pkcs11_attrs_dup(CK_ATTRIBUTE_PTR src, CK_ULONG n)
+/*
+ * Returns a copy of the attributes and their values in a single
+ * allocation (free it with OPENSSL_free()).
+ */
+CK_ATTRIBUTE_PTR pkcs11_attrs_pack(const CK_ATTRIBUTE *src, CK_ULONG n)
 {
 	CK_ATTRIBUTE_PTR dst;
+	size_t size;
 	CK_ULONG i;
+	char *p;
 
 	if (!src)
 		return NULL;
 
-	dst = OPENSSL_zalloc(sizeof(CK_ATTRIBUTE) * n);
+	size = sizeof(CK_ATTRIBUTE) * n;
+	for (i = 0; i < n; i++)
+		size += ATTR_ALIGN(src[i].ulValueLen);
+
+	dst = OPENSSL_zalloc(size);
 	if (!dst)
 		return NULL;
 
+	p = (char *)&dst[n];
 	for (i = 0; i < n; i++) {
-		if (pkcs11_attr_dup(&src[i], &dst[i]) != CKR_OK) {
-			pkcs11_attrs_deepfree(dst, n);
-			OPENSSL_free(dst);
-			return NULL;
-		}
+		dst[i].type = src[i].type;
+		dst[i].ulValueLen = src[i].ulValueLen;
+		if (!src[i].ulValueLen)
+			continue;
+
+		dst[i].pValue = p;
+		memcpy(p, src[i].pValue, src[i].ulValueLen);
+		p += ATTR_ALIGN(src[i].ulValueLen);
 	}
 
 	return dst;
@@ -473,6 +530,11 @@ CK_RV pkcs11_decrypt(struct pkcs11_module *pkcs11,
 	return ck_rv;
 }
 
+/* initial buffer sizes of the variable-length attributes */
+#define ATTR_LABEL_SIZE		64
+#define ATTR_ID_SIZE		64
+#define ATTR_SPKI_SIZE		640
+
 CK_RV pkcs11_fetch_attributes(struct pkcs11_module *pkcs11,
 			      CK_SESSION_HANDLE session,
 			      CK_OBJECT_HANDLE ohandle,
@@ -480,16 +542,21 @@ CK_RV pkcs11_fetch_attributes(struct pkcs11_module *pkcs11,
 			      CK_ULONG *nattributes,
 			      struct dbg *dbg)
 {
+	CK_BYTE label[ATTR_LABEL_SIZE], id[ATTR_ID_SIZE], spki[ATTR_SPKI_SIZE];
+	CK_OBJECT_CLASS class;
+	CK_KEY_TYPE key_type;
+	CK_BBOOL private;
 	CK_ATTRIBUTE template[] = {
-		{ .type = CKA_LABEL },
-		{ .type = CKA_ID },
-		{ .type = CKA_CLASS },
-		{ .type = CKA_KEY_TYPE },
-		{ .type = CKA_PRIVATE },
-		{ .type = CKA_PUBLIC_KEY_INFO },
+		{ CKA_LABEL, label, sizeof(label) },
+		{ CKA_ID, id, sizeof(id) },
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+		{ CKA_PRIVATE, &private, sizeof(private) },
+		{ CKA_PUBLIC_KEY_INFO, spki, sizeof(spki) },
 	};
 	CK_ULONG nattrs = sizeof(template) / sizeof(template[0]);
-	CK_ULONG i;
+	CK_ATTRIBUTE probe[sizeof(template) / sizeof(template[0])];
+	CK_ULONG nprobe = 0, i;
 	CK_ATTRIBUTE_PTR attrs;
 	CK_RV rv;
 
@@ -503,28 +570,48 @@ CK_RV pkcs11_fetch_attributes(struct pkcs11_module *pkcs11,
 
 	rv = pkcs11->fns->C_GetAttributeValue(session, ohandle,
 					      template, nattrs);
-	if (rv != CKR_OK) {
-		return rv;
-	}
+	if (rv == CKR_BUFFER_TOO_SMALL) {
+		/* probe the lengths of the values that did not fit */
+		for (i = 0; i < nattrs; i++) {
+			if (template[i].ulValueLen != CK_UNAVAILABLE_INFORMATION)
+				continue;
+			probe[nprobe].type = template[i].type;
+			probe[nprobe].pValue = NULL;
+			probe[nprobe].ulValueLen = 0;
+			nprobe++;
+		}
 
-	for (i = 0; i < nattrs; i++) {
-		if (!template[i].ulValueLen)
-			continue;
+		rv = pkcs11->fns->C_GetAttributeValue(session, ohandle,
+						      probe, nprobe);
+		if (rv != CKR_OK)
+			return rv;
+
+		for (i = 0; i < nprobe; i++) {
+			probe[i].pValue = OPENSSL_zalloc(probe[i].ulValueLen);
+			if (!probe[i].pValue) {
+				rv = CKR_HOST_MEMORY;
+				goto err;
+			}
+		}
 
-		template[i].pValue = OPENSSL_zalloc(template[i].ulValueLen);
-		if (!template[i].pValue) {
-			rv = CKR_HOST_MEMORY;
+		rv = pkcs11->fns->C_GetAttributeValue(session, ohandle,
+						      probe, nprobe);
+		if (rv != CKR_OK)
 			goto err;
-		}
-	}
 
-	rv = pkcs11->fns->C_GetAttributeValue(session, ohandle,
-					      template, nattrs);
-	if (rv != CKR_OK) {
-		goto err;
+		for (i = 0; i < nattrs; i++) {
+			CK_ULONG j;
+
+			for (j = 0; j < nprobe; j++) {
+				if (probe[j].type == template[i].type)
+					template[i] = probe[j];
+			}
+		}
 	}
+	if (rv != CKR_OK)
+		return rv;
 
-	attrs = pkcs11_attrs_dup(template, nattrs);
+	attrs = pkcs11_attrs_pack(template, nattrs);
 	if (!attrs) {
 		rv = CKR_HOST_MEMORY;
 		goto err;
@@ -532,12 +619,9 @@ CK_RV pkcs11_fetch_attributes(struct pkcs11_module *pkcs11,
 
 	*attributes = attrs;
 	*nattributes = nattrs;
-
-	pkcs11_attrs_deepfree(template, nattrs);
-	return CKR_OK;
-
+	rv = CKR_OK;
 err:
-	pkcs11_attrs_deepfree(template, nattrs);
+	pkcs11_attrs_deepfree(probe, nprobe);
 	return rv;
 }
 
@@ -582,28 +666,36 @@ CK_RV pkcs11_object_handle(struct pkcs11_module *pkcs11,
 	return rv;
 }
 
-CK_RV pkcs11_find_objects(struct pkcs11_module *pkcs11,
-			  CK_SESSION_HANDLE session,
-			  const char *label, const char *id, size_t id_len,
-			  const char *type, CK_OBJECT_HANDLE_PTR *objects,
-			  CK_ULONG_PTR nobjects, struct dbg *dbg)
+static CK_RV find_objects_init(struct pkcs11_module *pkcs11,
+				CK_SESSION_HANDLE session,
+				CK_ATTRIBUTE_PTR template, CK_ULONG ntemplate,
+				struct dbg *dbg)
 {
 	CK_RV rv;
-	CK_ATTRIBUTE template[3];
-	CK_ULONG tidx = 0;
-	CK_OBJECT_HANDLE tmp[OBJ_PER_SEARCH];
-	CK_ULONG ntmp;
-	CK_OBJECT_HANDLE_PTR objs = NULL;
-	CK_ULONG nobjs = 0;
 
-	if (!pkcs11 || !objects || !nobjects || !dbg ||
-	    (session == CK_INVALID_HANDLE))
+	if (!pkcs11 || !dbg || (session == CK_INVALID_HANDLE))
 		return CKR_ARGUMENTS_BAD;
 
 	rv = module_ensure(pkcs11, dbg);
 	if (rv != CKR_OK)
 		return rv;
 
+	rv = pkcs11->fns->C_FindObjectsInit(session, template, ntemplate);
+	if (rv != CKR_OK)
+		ps_dbg_error(dbg, "%s: unable to initialize search: %d",
+			     pkcs11->soname, rv);
+
+	return rv;
+}
+
+CK_RV pkcs11_find_objects_init(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session,
+			       const char *label, const char *id, size_t id_len,
+			       const char *type, struct dbg *dbg)
+{
+	CK_ATTRIBUTE template[3];
+	CK_ULONG tidx = 0;
+
 	memset(template, 0, sizeof(template));
 	tidx = 0;
 	if (label)
@@ -615,50 +707,156 @@ CK_RV pkcs11_find_objects(struct pkcs11_module *pkcs11,
 	else
 		pkcs11_attr_type(&template[tidx++], str_priv);
 
-	rv = pkcs11->fns->C_FindObjectsInit(session, template, tidx);
+	return find_objects_init(pkcs11, session, template, tidx, dbg);
+}
+
+/*
+ * Returns up to max handles of an active search in objects, zero
+ * handles at its end.
+ */
+CK_RV pkcs11_find_objects_next(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session,
+			       CK_OBJECT_HANDLE_PTR objects, CK_ULONG max,
+			       CK_ULONG_PTR nobjects, struct dbg *dbg)
+{
+	CK_RV rv;
+
+	rv = pkcs11->fns->C_FindObjects(session, objects, max, nobjects);
 	if (rv != CKR_OK) {
-		ps_dbg_error(dbg, "%s: unable to initialize search: %d",
+		ps_dbg_error(dbg, "%s: unable to process search: %d",
 			     pkcs11->soname, rv);
-		return rv;
+		*nobjects = 0;
 	}
 
+	return rv;
+}
+
+void pkcs11_find_objects_final(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session,
+			       struct dbg *dbg __unused)
+{
+	pkcs11->fns->C_FindObjectsFinal(session);
+}
+
+unsigned int pkcs11_find_batch(struct pkcs11_module *pkcs11)
+{
+	return pkcs11->find_batch ?: PS_FIND_BATCH_DEFAULT;
+}
+
+/* collects all handles of an active search and finalizes it */
+static CK_RV find_objects_collect(struct pkcs11_module *pkcs11,
+				  CK_SESSION_HANDLE session,
+				  CK_OBJECT_HANDLE_PTR *objects,
+				  CK_ULONG_PTR nobjects, struct dbg *dbg)
+{
+	CK_RV rv;
+	CK_ULONG batch, ntmp;
+	CK_OBJECT_HANDLE_PTR objs = NULL;
+	CK_ULONG nobjs = 0, size = 0;
+
+	batch = pkcs11_find_batch(pkcs11);
 	while (1) {
 		CK_OBJECT_HANDLE_PTR new_objs;
 
-		rv = pkcs11->fns->C_FindObjects(session, tmp, OBJ_PER_SEARCH,
-						&ntmp);
-		if (rv != CKR_OK) {
-			ps_dbg_error(dbg, "%s: unable to process search: %d",
-				     pkcs11->soname, rv);
-			OPENSSL_free(objs);
-			nobjs = 0;
-			goto out;
+		/* room for a full batch, grow geometrically */
+		if (size - nobjs < batch) {
+			size = (size < batch) ? 2 * batch : 2 * size;
+			new_objs = OPENSSL_realloc(objs,
+						   size * sizeof(CK_OBJECT_HANDLE));
+			if (!new_objs) {
+				rv = CKR_HOST_MEMORY;
+				goto err;
+			}
+			objs = new_objs;
 		}
 
+		rv = pkcs11_find_objects_next(pkcs11, session, &objs[nobjs],
+					      batch, &ntmp, dbg);
+		if (rv != CKR_OK)
+			goto err;
+
 		if (!ntmp)
 			break;
-
-		new_objs = OPENSSL_realloc(objs, ntmp * sizeof(CK_OBJECT_HANDLE));
-		if (!new_objs) {
-			nobjs = 0;
-			rv = CKR_HOST_MEMORY;
-			goto out;
-		}
-		objs = new_objs;
-
-		/* append found objects */
-		memcpy(&objs[nobjs], tmp, ntmp * sizeof(CK_OBJECT_HANDLE));
 		nobjs += ntmp;
 	}
 
-out:
 	*objects = objs;
 	*nobjects = nobjs;
 
-	pkcs11->fns->C_FindObjectsFinal(session);
+	pkcs11_find_objects_final(pkcs11, session, dbg);
+	return CKR_OK;
+err:
+	OPENSSL_free(objs);
+	*objects = NULL;
+	*nobjects = 0;
+
+	pkcs11_find_objects_final(pkcs11, session, dbg);
 	return rv;
 }
 
+CK_RV pkcs11_find_objects(struct pkcs11_module *pkcs11,
+			  CK_SESSION_HANDLE session,
+			  const char *label, const char *id, size_t id_len,
+			  const char *type, CK_OBJECT_HANDLE_PTR *objects,
+			  CK_ULONG_PTR nobjects, struct dbg *dbg)
+{
+	CK_RV rv;
+
+	if (!pkcs11 || !objects || !nobjects || !dbg ||
+	    (session == CK_INVALID_HANDLE))
+		return CKR_ARGUMENTS_BAD;
+
+	rv = pkcs11_find_objects_init(pkcs11, session, label, id, id_len,
+				      type, dbg);
+	if (rv != CKR_OK)
+		return rv;
+
+	return find_objects_collect(pkcs11, session, objects, nobjects, dbg);
+}
+
+/* returns the handles of all objects visible in the session */
+CK_RV pkcs11_find_all_objects(struct pkcs11_module *pkcs11,
+			      CK_SESSION_HANDLE session,
+			      CK_OBJECT_HANDLE_PTR *objects,
+			      CK_ULONG_PTR nobjects, struct dbg *dbg)
+{
+	CK_RV rv;
+
+	if (!pkcs11 || !objects || !nobjects || !dbg ||
+	    (session == CK_INVALID_HANDLE))
+		return CKR_ARGUMENTS_BAD;
+
+	rv = find_objects_init(pkcs11, session, NULL, 0, dbg);
+	if (rv != CKR_OK)
+		return rv;
+
+	return find_objects_collect(pkcs11, session, objects, nobjects, dbg);
+}
+
+/*
+ * Fetches the values of template (buffers provided by the caller) in a
+ * single call. As by C_GetAttributeValue(), the length of values which
+ * are unavailable or do not fit is CK_UNAVAILABLE_INFORMATION.
+ */
+CK_RV pkcs11_get_attribute_values(struct pkcs11_module *pkcs11,
+				  CK_SESSION_HANDLE session,
+				  CK_OBJECT_HANDLE ohandle,
+				  CK_ATTRIBUTE_PTR template, CK_ULONG ntemplate,
+				  struct dbg *dbg)
+{
+	CK_RV rv;
+
+	if (!pkcs11 || !dbg || (session == CK_INVALID_HANDLE))
+		return CKR_ARGUMENTS_BAD;
+
+	rv = module_ensure(pkcs11, dbg);
+	if (rv != CKR_OK)
+		return rv;
+
+	return pkcs11->fns->C_GetAttributeValue(session, ohandle,
+						template, ntemplate);
+}
+
 void pkcs11_session_close(struct pkcs11_module *pkcs11,
 			   CK_SESSION_HANDLE_PTR session,
 			   struct dbg *dbg)
@@ -821,6 +1019,185 @@ CK_RV pkcs11_get_slots(struct pkcs11_module *pkcs11,
 	return CKR_OK;
 }
 
+/*
+ * Slot cache
+ *
+ * Slot list, slot and token info of the module, fetched once and shared
+ * as a reference counted snapshot. A snapshot is replaced after fork and
+ * on token events (see pkcs11_token_event()).
+ */
+static struct pkcs11_slots *slots_fetch(struct pkcs11_module *pkcs,
+					struct dbg *dbg)
+{
+	struct pkcs11_slots *slots;
+	struct pkcs11_slot *slot;
+	CK_SLOT_ID_PTR ids;
+	CK_ULONG nids, i;
+
+	if (pkcs11_get_slots(pkcs, &ids, &nids, dbg) != CKR_OK)
+		return NULL;
+
+	slots = OPENSSL_zalloc(sizeof(*slots) + nids * sizeof(*slot));
+	if (!slots) {
+		OPENSSL_free(ids);
+		return NULL;
+	}
+	slots->refcnt = 1;
+	slots->nslots = nids;
+
+	for (i = 0; i < nids; i++) {
+		slot = &slots->slot[i];
+		slot->id = ids[i];
+
+		if (pkcs11_get_slot_info(pkcs, slot->id, &slot->si,
+					 dbg) == CKR_OK) {
+			slot->has_slot_info = true;
+			pkcs11_str_set(&slot->slt_manuf,
+				       slot->si.manufacturerID,
+				       sizeof(slot->si.manufacturerID));
+			pkcs11_str_set(&slot->slt_desc,
+				       slot->si.slotDescription,
+				       sizeof(slot->si.slotDescription));
+		}
+
+		if (pkcs11_get_token_info(pkcs, slot->id, &slot->ti,
+					  dbg) == CKR_OK) {
+			slot->has_token_info = true;
+			pkcs11_str_set(&slot->tok_label, slot->ti.label,
+				       sizeof(slot->ti.label));
+			pkcs11_str_set(&slot->tok_manuf,
+				       slot->ti.manufacturerID,
+				       sizeof(slot->ti.manufacturerID));
+			pkcs11_str_set(&slot->tok_serial,
+				       slot->ti.serialNumber,
+				       sizeof(slot->ti.serialNumber));
+			pkcs11_str_set(&slot->tok_model, slot->ti.model,
+				       sizeof(slot->ti.model));
+		}
+	}
+
+	OPENSSL_free(ids);
+	ps_dbg_debug(dbg, "%s: slot cache: %lu slots fetched",
+		     pkcs->soname, slots->nslots);
+	return slots;
+}
+
+static bool slots_valid(struct pkcs11_module *pkcs,
+			const struct pkcs11_slots *slots)
+{
+	return slots &&
+	       (slots->fork_gen == atfork_generation()) &&
+	       (slots->token_gen == pkcs11_token_generation(pkcs));
+}
+
+/*
+ * Returns a reference to the current snapshot, fetches a new one if
+ * needed (or if refresh is set). Release it with pkcs11_slots_put().
+ */
+struct pkcs11_slots *pkcs11_slots_get(struct pkcs11_module *pkcs,
+				      bool refresh, struct dbg *dbg)
+{
+	struct slot_cache *cache = &pkcs->slots;
+	struct pkcs11_slots *slots, *old = NULL;
+	unsigned int fork_gen, token_gen;
+
+	if (pthread_mutex_lock(&cache->mutex)) {
+		ps_dbg_error(dbg, "%s: unable to lock slot cache",
+			     pkcs->soname);
+		return NULL;
+	}
+
+	/* ----- locked ----- */
+	if (!refresh && slots_valid(pkcs, cache->slots))
+		goto out;
+
+	/* token events during the fetch make it stale */
+	fork_gen = atfork_generation();
+	token_gen = pkcs11_token_generation(pkcs);
+
+	slots = slots_fetch(pkcs, dbg);
+	if (!slots) {
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+	slots->fork_gen = fork_gen;
+	slots->token_gen = token_gen;
+
+	old = cache->slots;
+	cache->slots = slots;
+out:
+	slots = cache->slots;
+	__atomic_add_fetch(&slots->refcnt, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->mutex);
+	/* ----- unlocked ----- */
+
+	pkcs11_slots_put(old);
+	return slots;
+}
+
+void pkcs11_slots_put(struct pkcs11_slots *slots)
+{
+	if (!slots)
+		return;
+
+	if (__atomic_sub_fetch(&slots->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		OPENSSL_free(slots);
+}
+
+const struct pkcs11_slot *pkcs11_slots_find(const struct pkcs11_slots *slots,
+					    CK_SLOT_ID slot_id)
+{
+	CK_ULONG i;
+
+	if (!slots)
+		return NULL;
+
+	for (i = 0; i < slots->nslots; i++) {
+		if (slots->slot[i].id == slot_id)
+			return &slots->slot[i];
+	}
+	return NULL;
+}
+
+void pkcs11_slots_lock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_lock(&pkcs->slots.mutex);
+}
+
+void pkcs11_slots_unlock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_unlock(&pkcs->slots.mutex);
+}
+
+/*
+ * Return values indicating that a token or one of its objects was
+ * removed or replaced. Results of earlier object lookups (store cache)
+ * are stale afterwards.
+ */
+void pkcs11_token_event(struct pkcs11_module *pkcs, CK_RV ck_rv)
+{
+	switch (ck_rv) {
+	case CKR_DEVICE_REMOVED:
+	case CKR_TOKEN_NOT_PRESENT:
+	case CKR_TOKEN_NOT_RECOGNIZED:
+	case CKR_SLOT_ID_INVALID:
+	case CKR_KEY_HANDLE_INVALID:
+	case CKR_OBJECT_HANDLE_INVALID:
+	case CKR_PIN_INCORRECT:
+	case CKR_PIN_EXPIRED:
+	case CKR_PIN_LOCKED:
+		__atomic_add_fetch(&pkcs->token_gen, 1, __ATOMIC_RELEASE);
+		break;
+	default:
+		break;
+	}
+}
+
+unsigned int pkcs11_token_generation(struct pkcs11_module *pkcs)
+{
+	return __atomic_load_n(&pkcs->token_gen, __ATOMIC_ACQUIRE);
+}
+
 void pkcs11_module_teardown(struct pkcs11_module *pkcs)
 {
 	if (!pkcs)
@@ -837,6 +1214,10 @@ void pkcs11_module_teardown(struct pkcs11_module *pkcs)
 		pkcs->dlhandle = NULL;
 	}
 
+	pkcs11_slots_put(pkcs->slots.slots);
+	pkcs->slots.slots = NULL;
+	pthread_mutex_destroy(&pkcs->slots.mutex);
+
 	OPENSSL_free(pkcs->soname);
 	pkcs->soname = NULL;
 
@@ -867,6 +1248,13 @@ int pkcs11_module_load(struct pkcs11_module *pkcs,
 		return OSSL_RV_ERR;
 	}
 
+	rc = pthread_mutex_init(&pkcs->slots.mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
 	pkcs->soname = OPENSSL_strdup(module);
 	if (module_initargs)
 		pkcs->initargs = OPENSSL_strdup(module_initargs);
@@ -10,17 +10,22 @@
 
 #include "common.h"
 
+#define PS_FIND_BATCH_DEFAULT		64
+#define PS_FIND_BATCH_MAX		4096
+
 int mechtype_by_id(int id, CK_MECHANISM_TYPE_PTR mech);
 int mechtype_by_name(const char *name, CK_MECHANISM_TYPE_PTR mech);
 int mgftype_by_name(const char *name, CK_RSA_PKCS_MGF_TYPE_PTR mgf);
 
+CK_OBJECT_CLASS pkcs11_type_class(const char *type);
+
 size_t pkcs11_strlen(const CK_CHAR_PTR c, CK_ULONG csize);
 int pkcs11_strcmp(const char *s, const CK_CHAR_PTR c, CK_ULONG csize);
+int pkcs11_str_cmp(const char *s, const struct pkcs11_str *str);
 
 void pkcs11_attr_deepfree(CK_ATTRIBUTE_PTR attribute);
 void pkcs11_attrs_deepfree(CK_ATTRIBUTE_PTR attributes, CK_ULONG nattributes);
-CK_RV pkcs11_attr_dup(const CK_ATTRIBUTE_PTR src, CK_ATTRIBUTE_PTR dst);
-CK_ATTRIBUTE_PTR pkcs11_attrs_dup(CK_ATTRIBUTE_PTR src, CK_ULONG n);
+CK_ATTRIBUTE_PTR pkcs11_attrs_pack(const CK_ATTRIBUTE *src, CK_ULONG n);
 
 CK_RV pkcs11_sign_init(struct pkcs11_module *pkcs11,
 		       CK_SESSION_HANDLE hsession, CK_MECHANISM_PTR mech,
@@ -49,6 +54,26 @@ CK_RV pkcs11_object_handle(struct pkcs11_module *pkcs11,
 			   CK_ATTRIBUTE_PTR attrs, CK_ULONG nattrs,
 			   CK_OBJECT_HANDLE_PTR phobject,
 			   struct dbg *dbg);
+CK_RV pkcs11_find_objects_init(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session,
+			       const char *label, const char *id, size_t id_len,
+			       const char *type, struct dbg *dbg);
+CK_RV pkcs11_find_objects_next(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session,
+			       CK_OBJECT_HANDLE_PTR objects, CK_ULONG max,
+			       CK_ULONG_PTR nobjects, struct dbg *dbg);
+void pkcs11_find_objects_final(struct pkcs11_module *pkcs11,
+			       CK_SESSION_HANDLE session, struct dbg *dbg);
+unsigned int pkcs11_find_batch(struct pkcs11_module *pkcs11);
+CK_RV pkcs11_find_all_objects(struct pkcs11_module *pkcs11,
+			      CK_SESSION_HANDLE session,
+			      CK_OBJECT_HANDLE_PTR *objects,
+			      CK_ULONG_PTR nobjects, struct dbg *dbg);
+CK_RV pkcs11_get_attribute_values(struct pkcs11_module *pkcs11,
+				  CK_SESSION_HANDLE session,
+				  CK_OBJECT_HANDLE ohandle,
+				  CK_ATTRIBUTE_PTR template, CK_ULONG ntemplate,
+				  struct dbg *dbg);
 CK_RV pkcs11_find_objects(struct pkcs11_module *pkcs11,
 			  CK_SESSION_HANDLE session,
 			  const char *label, const char *id, size_t id_len,
@@ -70,7 +95,21 @@ CK_RV pkcs11_get_slots(struct pkcs11_module *pkcs,
 		       CK_SLOT_ID_PTR *slots, CK_ULONG *nslots,
 		       struct dbg *dbg);
 
+struct pkcs11_slots *pkcs11_slots_get(struct pkcs11_module *pkcs,
+				      bool refresh, struct dbg *dbg);
+void pkcs11_slots_put(struct pkcs11_slots *slots);
+const struct pkcs11_slot *pkcs11_slots_find(const struct pkcs11_slots *slots,
+					    CK_SLOT_ID slot_id);
+void pkcs11_slots_lock(struct pkcs11_module *pkcs);
+void pkcs11_slots_unlock(struct pkcs11_module *pkcs);
+
+void pkcs11_token_event(struct pkcs11_module *pkcs, CK_RV ck_rv);
+unsigned int pkcs11_token_generation(struct pkcs11_module *pkcs);
+
 void pkcs11_module_teardown(struct pkcs11_module *pkcs);
+void pkcs11_module_lock(struct pkcs11_module *pkcs);
+void pkcs11_module_unlock(struct pkcs11_module *pkcs);
+void pkcs11_module_fork_reset(struct pkcs11_module *pkcs);
 int pkcs11_module_load(struct pkcs11_module *pkcs,
 		       const char *module, const char *module_initargs,
 		       struct dbg *dbg);
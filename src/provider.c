@@ -5,6 +5,8 @@
  *          Ingo Franzki <ifranzki@linux.ibm.com>
  */
 
+#include <limits.h>
+#include <stdlib.h>
 #include <openssl/core.h>
 #include <openssl/core_dispatch.h>
 #include <openssl/core_names.h>
@@ -22,6 +24,7 @@
 #include "common.h"
 #include "debug.h"
 #include "keyexch.h"
+#include "keyindex.h"
 #include "keymgmt.h"
 #include "object.h"
 #include "ossl.h"
@@ -30,6 +33,8 @@
 #include "signature.h"
 #include "store.h"
 #include "fork.h"
+#include "session.h"
+#include "worker.h"
 
 #define PS_PROV_DESCRIPTION	"PKCS11 signing key provider"
 #ifdef HAVE_CONFIG_H
@@ -42,6 +47,15 @@
 #define PS_PKCS11_MODULE_PATH			"pkcs11sign-module-path"
 #define PS_PKCS11_MODULE_INIT_ARGS		"pkcs11sign-module-init-args"
 #define PS_PKCS11_FWD				"pkcs11sign-forward"
+#define PS_SESSION_POOL_SIZE			"pkcs11sign-session-pool-size"
+#define PS_SESSION_AFFINITY			"pkcs11sign-session-affinity"
+#define PS_SESSION_MAX				"pkcs11sign-session-max"
+#define PS_ASYNC_WORKERS			"pkcs11sign-async-workers"
+#define PS_SLOT_WORKERS				"pkcs11sign-slot-workers"
+#define PS_OP_CTX_POOL_SIZE			"pkcs11sign-opctx-pool-size"
+#define PS_STORE_CACHE_TTL			"pkcs11sign-store-cache-ttl"
+#define PS_FIND_BATCH				"pkcs11sign-find-batch"
+#define PS_KEY_INDEX				"pkcs11sign-key-index"
 
 #define DISPATCH_PROVIDER_FN(tname, name) DECL_DISPATCH_FUNC(provider, tname, name)
 DISPATCH_PROVIDER_FN(teardown, 			ps_prov_teardown);
@@ -181,6 +195,12 @@ static void ps_prov_teardown(void *vpctx)
 		return;
 
 	atforkpool_unregister_pkcs11(&pctx->pkcs11, &pctx->dbg);
+	worker_pool_teardown(&pctx->pkcs11, &pctx->dbg);
+	op_ctx_pool_teardown(&pctx->pkcs11, &pctx->dbg);
+	store_cache_teardown(&pctx->pkcs11, &pctx->dbg);
+	key_index_teardown(&pctx->pkcs11, &pctx->dbg);
+	pkey_cache_teardown(&pctx->pkcs11, &pctx->dbg);
+	session_pool_teardown(&pctx->pkcs11, &pctx->dbg);
 	pkcs11_module_teardown(&pctx->pkcs11);
 
 	fwd_teardown(&pctx->fwd);
@@ -229,16 +249,49 @@ static const OSSL_DISPATCH ps_dispatch_table[] = {
 	{ 0, NULL }
 };
 
+static int ps_prov_param_uint(struct provider_ctx *pctx, const char *name,
+			      const char *value, unsigned int *uval)
+{
+	unsigned long val;
+	char *end;
+
+	val = strtoul(value, &end, 0);
+	if ((*value == '\0') || (*end != '\0') || (val > UINT_MAX)) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Invalid %s: %s", name, value);
+		return OSSL_RV_ERR;
+	}
+
+	*uval = val;
+	return OSSL_RV_OK;
+}
+
 static int ps_prov_init(const OSSL_CORE_HANDLE *handle,
 			const OSSL_DISPATCH *in,
 			const OSSL_DISPATCH **out,
 			void **vctx)
 {
 	struct provider_ctx *pctx = NULL;
-	OSSL_PARAM core_params[4] = { 0 };
+	OSSL_PARAM core_params[13] = { 0 };
+	unsigned int spool_size = PS_SESSION_POOL_SIZE_DEFAULT;
+	unsigned int smax = 0;
+	unsigned int nworkers = PS_WORKER_THREADS_DEFAULT;
+	unsigned int opool_size = PS_OP_CTX_POOL_SIZE_DEFAULT;
+	unsigned int scache_ttl = PS_STORE_CACHE_TTL_DEFAULT;
+	unsigned int find_batch = PS_FIND_BATCH_DEFAULT;
+	unsigned int kindex = PS_KEY_INDEX_DEFAULT;
 	const char *module = NULL;
 	const char *module_args = NULL;
 	const char *fwd = NULL;
+	const char *spool = NULL;
+	const char *saffinity = NULL;
+	const char *smax_str = NULL;
+	const char *nworkers_str = NULL;
+	const char *slot_workers = NULL;
+	const char *opool = NULL;
+	const char *scache = NULL;
+	const char *fbatch = NULL;
+	const char *kindex_str = NULL;
 
 	if (!handle || !in || !out || !vctx)
 		return OSSL_RV_ERR;
@@ -269,7 +322,34 @@ static int ps_prov_init(const OSSL_CORE_HANDLE *handle,
 	core_params[2] = OSSL_PARAM_construct_utf8_ptr(
 				PS_PKCS11_FWD,
 				(char **)&fwd, sizeof(fwd));
-	core_params[3] = OSSL_PARAM_construct_end();
+	core_params[3] = OSSL_PARAM_construct_utf8_ptr(
+				PS_SESSION_POOL_SIZE,
+				(char **)&spool, sizeof(spool));
+	core_params[4] = OSSL_PARAM_construct_utf8_ptr(
+				PS_SESSION_AFFINITY,
+				(char **)&saffinity, sizeof(saffinity));
+	core_params[5] = OSSL_PARAM_construct_utf8_ptr(
+				PS_SESSION_MAX,
+				(char **)&smax_str, sizeof(smax_str));
+	core_params[6] = OSSL_PARAM_construct_utf8_ptr(
+				PS_ASYNC_WORKERS,
+				(char **)&nworkers_str, sizeof(nworkers_str));
+	core_params[7] = OSSL_PARAM_construct_utf8_ptr(
+				PS_SLOT_WORKERS,
+				(char **)&slot_workers, sizeof(slot_workers));
+	core_params[8] = OSSL_PARAM_construct_utf8_ptr(
+				PS_OP_CTX_POOL_SIZE,
+				(char **)&opool, sizeof(opool));
+	core_params[9] = OSSL_PARAM_construct_utf8_ptr(
+				PS_STORE_CACHE_TTL,
+				(char **)&scache, sizeof(scache));
+	core_params[10] = OSSL_PARAM_construct_utf8_ptr(
+				PS_FIND_BATCH,
+				(char **)&fbatch, sizeof(fbatch));
+	core_params[11] = OSSL_PARAM_construct_utf8_ptr(
+				PS_KEY_INDEX,
+				(char **)&kindex_str, sizeof(kindex_str));
+	core_params[12] = OSSL_PARAM_construct_end();
 
 	if (pctx->core.fns.get_params(handle, core_params) != OSSL_RV_OK) {
 		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
@@ -286,6 +366,89 @@ static int ps_prov_init(const OSSL_CORE_HANDLE *handle,
 	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
 		     PS_PKCS11_FWD, fwd,
 		     OSSL_PARAM_modified(&core_params[2]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_SESSION_POOL_SIZE, spool,
+		     OSSL_PARAM_modified(&core_params[3]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_SESSION_AFFINITY, saffinity,
+		     OSSL_PARAM_modified(&core_params[4]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_SESSION_MAX, smax_str,
+		     OSSL_PARAM_modified(&core_params[5]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_ASYNC_WORKERS, nworkers_str,
+		     OSSL_PARAM_modified(&core_params[6]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_SLOT_WORKERS, slot_workers,
+		     OSSL_PARAM_modified(&core_params[7]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_OP_CTX_POOL_SIZE, opool,
+		     OSSL_PARAM_modified(&core_params[8]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_STORE_CACHE_TTL, scache,
+		     OSSL_PARAM_modified(&core_params[9]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_FIND_BATCH, fbatch,
+		     OSSL_PARAM_modified(&core_params[10]));
+	ps_pctx_debug(pctx, "pctx: %p, %s: %s, modified: %d", pctx,
+		     PS_KEY_INDEX, kindex_str,
+		     OSSL_PARAM_modified(&core_params[11]));
+
+	if (OSSL_PARAM_modified(&core_params[3]) &&
+	    (ps_prov_param_uint(pctx, PS_SESSION_POOL_SIZE, spool,
+				&spool_size) != OSSL_RV_OK))
+		goto err;
+
+	if (OSSL_PARAM_modified(&core_params[5]) &&
+	    (ps_prov_param_uint(pctx, PS_SESSION_MAX, smax_str,
+				&smax) != OSSL_RV_OK))
+		goto err;
+
+	if (OSSL_PARAM_modified(&core_params[6]) &&
+	    (ps_prov_param_uint(pctx, PS_ASYNC_WORKERS, nworkers_str,
+				&nworkers) != OSSL_RV_OK))
+		goto err;
+
+	if (OSSL_PARAM_modified(&core_params[8]) &&
+	    (ps_prov_param_uint(pctx, PS_OP_CTX_POOL_SIZE, opool,
+				&opool_size) != OSSL_RV_OK))
+		goto err;
+
+	if (OSSL_PARAM_modified(&core_params[9]) &&
+	    (ps_prov_param_uint(pctx, PS_STORE_CACHE_TTL, scache,
+				&scache_ttl) != OSSL_RV_OK))
+		goto err;
+
+	if (OSSL_PARAM_modified(&core_params[10]) &&
+	    (ps_prov_param_uint(pctx, PS_FIND_BATCH, fbatch,
+				&find_batch) != OSSL_RV_OK))
+		goto err;
+
+	if (!find_batch || (find_batch > PS_FIND_BATCH_MAX)) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Invalid %s: %u", PS_FIND_BATCH, find_batch);
+		goto err;
+	}
+
+	if (OSSL_PARAM_modified(&core_params[11]) &&
+	    (ps_prov_param_uint(pctx, PS_KEY_INDEX, kindex_str,
+				&kindex) != OSSL_RV_OK))
+		goto err;
+
+	if (kindex > 1) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Invalid %s: %u", PS_KEY_INDEX, kindex);
+		goto err;
+	}
+
+	if (!OSSL_PARAM_modified(&core_params[4]))
+		saffinity = "none";
+
+	if (strcmp(saffinity, "none") && strcmp(saffinity, "thread")) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Invalid %s: %s", PS_SESSION_AFFINITY, saffinity);
+		goto err;
+	}
 
 	if (!OSSL_PARAM_modified(&core_params[2]))
 		fwd = "default";
@@ -308,6 +471,59 @@ static int ps_prov_init(const OSSL_CORE_HANDLE *handle,
 		goto err;
 	}
 	ps_pctx_debug(pctx, "pctx: %p, pkcs11: %s", pctx, pctx->pkcs11.soname);
+	pctx->pkcs11.find_batch = find_batch;
+
+	if (session_pool_init(&pctx->pkcs11, spool_size,
+			      &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize session pool");
+		goto err;
+	}
+
+	if ((strcmp(saffinity, "thread") == 0) &&
+	    (session_thread_init(&pctx->pkcs11, smax,
+				 &pctx->dbg) != OSSL_RV_OK)) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize session affinity");
+		goto err;
+	}
+
+	if (!OSSL_PARAM_modified(&core_params[7]))
+		slot_workers = NULL;
+
+	if (worker_pool_init(&pctx->pkcs11, nworkers, slot_workers,
+			     &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize worker pool");
+		goto err;
+	}
+
+	if (op_ctx_pool_init(&pctx->pkcs11, opool_size,
+			     &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize op_ctx pool");
+		goto err;
+	}
+
+	if (store_cache_init(&pctx->pkcs11, scache_ttl,
+			     &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize store cache");
+		goto err;
+	}
+
+	if (pkey_cache_init(&pctx->pkcs11, &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize public key cache");
+		goto err;
+	}
+
+	if (key_index_init(&pctx->pkcs11, kindex,
+			   &pctx->dbg) != OSSL_RV_OK) {
+		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
+			       "Failed to initialize key index");
+		goto err;
+	}
 
 	if (atforkpool_register_pkcs11(&pctx->pkcs11, &pctx->dbg) != OSSL_RV_OK) {
 		put_error_pctx(pctx, PS_ERR_INTERNAL_ERROR,
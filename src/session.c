@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <openssl/crypto.h>
+
+#include "session.h"
+
+/*
+ * The session pool keeps logged-in sessions of a pkcs11 module per slot.
+ * Operation contexts borrow a session from the pool and give it back on
+ * release, instead of opening and logging in a new session for each
+ * operation.
+ */
+
+static struct session_slot *_pool_slot(struct session_pool *pool,
+				       CK_SLOT_ID slot_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nslots; i++) {
+		if (pool->slots[i].slot_id == slot_id)
+			return &pool->slots[i];
+	}
+
+	return NULL;
+}
+
+static struct session_slot *_pool_slot_add(struct session_pool *pool,
+					   CK_SLOT_ID slot_id)
+{
+	struct session_slot *slots, *slot;
+	CK_SESSION_HANDLE_PTR idle;
+
+	idle = OPENSSL_zalloc(pool->size * sizeof(CK_SESSION_HANDLE));
+	if (!idle)
+		return NULL;
+
+	slots = OPENSSL_realloc(pool->slots,
+				(pool->nslots + 1) * sizeof(struct session_slot));
+	if (!slots) {
+		OPENSSL_free(idle);
+		return NULL;
+	}
+	pool->slots = slots;
+
+	slot = &pool->slots[pool->nslots++];
+	slot->slot_id = slot_id;
+	slot->idle = idle;
+	slot->nidle = 0;
+
+	return slot;
+}
+
+int session_pool_init(struct pkcs11_module *pkcs, unsigned int size,
+		      struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	int rc;
+
+	rc = pthread_mutex_init(&pool->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	pool->size = size;
+	pool->slots = NULL;
+	pool->nslots = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+
+	ps_dbg_debug(dbg, "pkcs: %p, session pool size: %u", pkcs, size);
+	return OSSL_RV_OK;
+}
+
+static void _thread_close(struct session_thread *st)
+{
+	struct session_pool *pool = &st->pkcs->spool;
+	struct session_tslot *ts;
+
+	while ((ts = st->tslots)) {
+		st->tslots = ts->next;
+		if (ts->hsession != CK_INVALID_HANDLE) {
+			pkcs11_session_close(st->pkcs, &ts->hsession, st->dbg);
+			__atomic_sub_fetch(&pool->tcount, 1, __ATOMIC_RELAXED);
+		}
+		OPENSSL_free(ts);
+	}
+	OPENSSL_free(st);
+}
+
+/*
+ * Pools with thread sessions. The exit handler of a thread may still run,
+ * while the pool is torn down: a thread entry is owned by whoever unlinks
+ * it from its pool under tpools.mutex, the exit handler of its thread or
+ * the teardown. The handler looks the entry up by address and thread
+ * (the entry may be freed already) and the teardown waits for handlers
+ * closing sessions of the pool. The mutex is never destroyed.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct session_pool *pools;
+} tpools = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* thread exit: close the sessions of the thread */
+static void _thread_exit(void *arg)
+{
+	struct session_thread **pst, *st = NULL;
+	struct session_pool *pool;
+
+	if (pthread_mutex_lock(&tpools.mutex))
+		return;
+
+	/* ----- locked ----- */
+	for (pool = tpools.pools; pool && !st; pool = pool->tnext) {
+		for (pst = &pool->threads; *pst; pst = &(*pst)->next) {
+			if ((*pst == arg) &&
+			    pthread_equal((*pst)->thread, pthread_self())) {
+				st = *pst;
+				*pst = st->next;
+				pool->texiting++;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&tpools.mutex);
+	/* ----- unlocked ----- */
+
+	/* taken by the teardown */
+	if (!st)
+		return;
+
+	pool = &st->pkcs->spool;
+	_thread_close(st);
+
+	pthread_mutex_lock(&tpools.mutex);
+	if (!--pool->texiting)
+		pthread_cond_broadcast(&tpools.cond);
+	pthread_mutex_unlock(&tpools.mutex);
+}
+
+static void _thread_teardown(struct session_pool *pool)
+{
+	struct session_thread *st, *threads;
+	struct session_pool **ppool;
+
+	if (!pool->affinity)
+		return;
+
+	/* no more thread exit handlers from here on */
+	pthread_key_delete(pool->tkey);
+	pool->affinity = false;
+
+	pthread_mutex_lock(&tpools.mutex);
+	for (ppool = &tpools.pools; *ppool; ppool = &(*ppool)->tnext) {
+		if (*ppool == pool) {
+			*ppool = pool->tnext;
+			break;
+		}
+	}
+	threads = pool->threads;
+	pool->threads = NULL;
+	while (pool->texiting)
+		pthread_cond_wait(&tpools.cond, &tpools.mutex);
+	pthread_mutex_unlock(&tpools.mutex);
+
+	while ((st = threads)) {
+		threads = st->next;
+		_thread_close(st);
+	}
+}
+
+void session_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_slot *slot;
+	unsigned int i;
+
+	if (pool->affinity)
+		ps_dbg_info(dbg, "pkcs: %p, thread sessions: %u, max: %u",
+			    pkcs, pool->tcount, pool->tmax);
+	_thread_teardown(pool);
+
+	for (i = 0; i < pool->nslots; i++) {
+		slot = &pool->slots[i];
+		while (slot->nidle)
+			pkcs11_session_close(pkcs, &slot->idle[--slot->nidle],
+					     dbg);
+		OPENSSL_free(slot->idle);
+	}
+
+	if (pool->size)
+		ps_dbg_info(dbg, "pkcs: %p, session pool: size: %u, hits: %lu, misses: %lu",
+			    pkcs, pool->size, pool->hits, pool->misses);
+
+	OPENSSL_free(pool->slots);
+	pool->slots = NULL;
+	pool->nslots = 0;
+	pool->size = 0;
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void session_pool_lock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_lock(&pkcs->spool.mutex);
+}
+
+void session_pool_unlock(struct pkcs11_module *pkcs)
+{
+	pthread_mutex_unlock(&pkcs->spool.mutex);
+}
+
+/* over fork, for the thread lists of all pools */
+void session_threads_lock(void)
+{
+	pthread_mutex_lock(&tpools.mutex);
+}
+
+void session_threads_unlock(void)
+{
+	pthread_mutex_unlock(&tpools.mutex);
+}
+
+/* drop all idle and thread sessions without closing them (atfork child) */
+void session_pool_forget(struct pkcs11_module *pkcs)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_thread *st;
+	struct session_tslot *ts;
+	unsigned int i;
+
+	for (i = 0; i < pool->nslots; i++)
+		pool->slots[i].nidle = 0;
+
+	for (st = pool->threads; st; st = st->next) {
+		for (ts = st->tslots; ts; ts = ts->next) {
+			ts->hsession = CK_INVALID_HANDLE;
+			ts->dirty = false;
+		}
+	}
+	pool->tcount = 0;
+	/* the exiting threads are gone */
+	pool->texiting = 0;
+}
+
+CK_RV session_pool_get(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		       const char *pin, CK_SESSION_HANDLE_PTR session,
+		       struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_slot *slot;
+
+	if (!session || (*session != CK_INVALID_HANDLE))
+		return CKR_ARGUMENTS_BAD;
+
+	if (!pool->size)
+		goto open;
+
+	if (pthread_mutex_lock(&pool->mutex)) {
+		ps_dbg_error(dbg, "pkcs: %p, unable to lock session pool", pkcs);
+		goto open;
+	}
+
+	/* ----- locked ----- */
+	slot = _pool_slot(pool, slot_id);
+	if (slot && slot->nidle) {
+		*session = slot->idle[--slot->nidle];
+		pool->hits++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		ps_dbg_debug(dbg, "pkcs: %p, slot: %lu, session: %lu (pooled)",
+			     pkcs, slot_id, *session);
+		return CKR_OK;
+	}
+	pool->misses++;
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+open:
+	return pkcs11_session_open_login(pkcs, slot_id, session, pin, dbg);
+}
+
+void session_pool_put(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		      CK_SESSION_HANDLE_PTR session, struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_slot *slot;
+
+	if (!session || (*session == CK_INVALID_HANDLE))
+		return;
+
+	if (!pool->size)
+		goto close;
+
+	if (pthread_mutex_lock(&pool->mutex)) {
+		ps_dbg_error(dbg, "pkcs: %p, unable to lock session pool", pkcs);
+		goto close;
+	}
+
+	/* ----- locked ----- */
+	slot = _pool_slot(pool, slot_id);
+	if (!slot)
+		slot = _pool_slot_add(pool, slot_id);
+
+	if (slot && (slot->nidle < pool->size)) {
+		slot->idle[slot->nidle++] = *session;
+		pthread_mutex_unlock(&pool->mutex);
+
+		ps_dbg_debug(dbg, "pkcs: %p, slot: %lu, session: %lu (returned)",
+			     pkcs, slot_id, *session);
+		*session = CK_INVALID_HANDLE;
+		return;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+close:
+	pkcs11_session_close(pkcs, session, dbg);
+}
+
+/*
+ * With session affinity, each thread keeps its own logged-in session per
+ * slot and uses it without locking. The list of threads is only changed,
+ * when a thread opens its first session and when it exits. Sessions are closed on thread exit or provider teardown.
+ */
+int session_thread_init(struct pkcs11_module *pkcs, unsigned int max,
+			struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	int rc;
+
+	rc = pthread_key_create(&pool->tkey, _thread_exit);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_key_create() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	pool->affinity = true;
+	pool->threads = NULL;
+	pool->tmax = max;
+	pool->tcount = 0;
+	pool->texiting = 0;
+
+	pthread_mutex_lock(&tpools.mutex);
+	pool->tnext = tpools.pools;
+	tpools.pools = pool;
+	pthread_mutex_unlock(&tpools.mutex);
+
+	ps_dbg_debug(dbg, "pkcs: %p, session affinity: thread, max: %u",
+		     pkcs, max);
+	return OSSL_RV_OK;
+}
+
+static struct session_tslot *_thread_slot(struct pkcs11_module *pkcs,
+					  CK_SLOT_ID slot_id,
+					  struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_thread *st;
+	struct session_tslot *ts;
+
+	st = pthread_getspecific(pool->tkey);
+	if (!st) {
+		st = OPENSSL_zalloc(sizeof(*st));
+		if (!st)
+			return NULL;
+		st->pkcs = pkcs;
+		st->dbg = dbg;
+		st->thread = pthread_self();
+
+		if (pthread_mutex_lock(&tpools.mutex)) {
+			OPENSSL_free(st);
+			return NULL;
+		}
+		st->next = pool->threads;
+		pool->threads = st;
+		pthread_mutex_unlock(&tpools.mutex);
+
+		pthread_setspecific(pool->tkey, st);
+	}
+
+	for (ts = st->tslots; ts; ts = ts->next) {
+		if (ts->slot_id == slot_id)
+			return ts;
+	}
+
+	ts = OPENSSL_zalloc(sizeof(*ts));
+	if (!ts)
+		return NULL;
+	ts->slot_id = slot_id;
+	ts->hsession = CK_INVALID_HANDLE;
+	ts->next = st->tslots;
+	st->tslots = ts;
+
+	return ts;
+}
+
+/*
+ * Get the session of the calling thread for a slot. Returns
+ * CKR_SESSION_COUNT, if the thread has no session yet and the
+ * configured maximum of thread sessions is reached.
+ */
+CK_RV session_thread_get(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+			 const char *pin, CK_SESSION_HANDLE_PTR session,
+			 struct session_tslot **tslot, struct dbg *dbg)
+{
+	struct session_pool *pool = &pkcs->spool;
+	struct session_thread *st;
+	struct session_tslot *ts;
+	unsigned int count;
+	CK_RV ck_rv;
+
+	if (!session || !tslot)
+		return CKR_ARGUMENTS_BAD;
+
+	/* fast path: no locks */
+	st = pthread_getspecific(pool->tkey);
+	for (ts = st ? st->tslots : NULL; ts; ts = ts->next) {
+		if ((ts->slot_id == slot_id) &&
+		    (ts->hsession != CK_INVALID_HANDLE) && !ts->dirty) {
+			*session = ts->hsession;
+			*tslot = ts;
+			return CKR_OK;
+		}
+	}
+
+	ts = _thread_slot(pkcs, slot_id, dbg);
+	if (!ts)
+		return CKR_HOST_MEMORY;
+
+	/* a failed operation may still be active on the session */
+	if (ts->hsession != CK_INVALID_HANDLE) {
+		pkcs11_session_close(pkcs, &ts->hsession, dbg);
+		__atomic_sub_fetch(&pool->tcount, 1, __ATOMIC_RELAXED);
+		ts->dirty = false;
+	}
+
+	count = __atomic_add_fetch(&pool->tcount, 1, __ATOMIC_RELAXED);
+	if (pool->tmax && (count > pool->tmax)) {
+		__atomic_sub_fetch(&pool->tcount, 1, __ATOMIC_RELAXED);
+		ps_dbg_debug(dbg, "pkcs: %p, slot: %lu, thread session limit reached",
+			     pkcs, slot_id);
+		return CKR_SESSION_COUNT;
+	}
+
+	ck_rv = pkcs11_session_open_login(pkcs, slot_id, &ts->hsession,
+					  pin, dbg);
+	if (ck_rv != CKR_OK) {
+		__atomic_sub_fetch(&pool->tcount, 1, __ATOMIC_RELAXED);
+		return ck_rv;
+	}
+
+	ps_dbg_debug(dbg, "pkcs: %p, slot: %lu, session: %lu (thread)",
+		     pkcs, slot_id, ts->hsession);
+	*session = ts->hsession;
+	*tslot = ts;
+	return CKR_OK;
+}
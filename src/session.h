@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PKCS11SIGN_SESSION_H
+#define _PKCS11SIGN_SESSION_H
+
+#include "common.h"
+#include "debug.h"
+#include "pkcs11.h"
+
+#define PS_SESSION_POOL_SIZE_DEFAULT	8
+
+int session_pool_init(struct pkcs11_module *pkcs, unsigned int size,
+		      struct dbg *dbg);
+void session_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void session_pool_lock(struct pkcs11_module *pkcs);
+void session_pool_unlock(struct pkcs11_module *pkcs);
+void session_pool_forget(struct pkcs11_module *pkcs);
+void session_threads_lock(void);
+void session_threads_unlock(void);
+
+CK_RV session_pool_get(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		       const char *pin, CK_SESSION_HANDLE_PTR session,
+		       struct dbg *dbg);
+void session_pool_put(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+		      CK_SESSION_HANDLE_PTR session, struct dbg *dbg);
+
+int session_thread_init(struct pkcs11_module *pkcs, unsigned int max,
+			struct dbg *dbg);
+CK_RV session_thread_get(struct pkcs11_module *pkcs, CK_SLOT_ID slot_id,
+			 const char *pin, CK_SESSION_HANDLE_PTR session,
+			 struct session_tslot **tslot, struct dbg *dbg);
+
+#endif /* _PKCS11SIGN_SESSION_H */
@@ -16,56 +16,100 @@
 #include "pkcs11.h"
 #include "object.h"
 #include "keymgmt.h"
+#include "worker.h"
+#include "pkcs11sign.h"
 
-static int op_ctx_signature_size(struct op_ctx *opctx, const CK_MECHANISM_PTR mech, size_t *siglen)
+static int op_ctx_sign_init(struct op_ctx *opctx, const CK_MECHANISM_PTR mech)
 {
-	unsigned char *rawsig, dummy;
-	size_t rawsiglen, len;
+	CK_RV ck_rv;
 
-	if (pkcs11_sign_init(&opctx->pctx->pkcs11, opctx->hsession,
-			     mech, opctx->hobject,
-			     &opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
+	ck_rv = pkcs11_sign_init(&opctx->pctx->pkcs11, opctx->hsession,
+				 mech, opctx->hobject, &opctx->pctx->dbg);
+	if ((ck_rv != CKR_OK) && op_ctx_object_retry(opctx, ck_rv))
+		ck_rv = pkcs11_sign_init(&opctx->pctx->pkcs11, opctx->hsession,
+					 mech, opctx->hobject,
+					 &opctx->pctx->dbg);
+	if (ck_rv != CKR_OK) {
+		ps_opctx_debug(opctx, "ERROR: pkcs11_sign_init() failed");
 		return OSSL_RV_ERR;
 	}
 
+	/* cleared, when the operation is finished */
+	op_ctx_session_dirty(opctx, true);
+	return OSSL_RV_OK;
+}
+
+struct sign_req {
+	struct op_ctx *opctx;
+	CK_MECHANISM_PTR mech;
+	const unsigned char *tbs;
+	size_t tbslen;
+	unsigned char *sig;
+	size_t *siglen;
+	int rv;
+};
+
+static void op_ctx_sign_fn(void *arg)
+{
+	struct sign_req *req = arg;
+	struct op_ctx *opctx = req->opctx;
+
+	req->rv = OSSL_RV_ERR;
+	if (op_ctx_sign_init(opctx, req->mech) != OSSL_RV_OK)
+		return;
+
 	if (pkcs11_sign(&opctx->pctx->pkcs11, opctx->hsession,
-			      &dummy, sizeof(dummy), NULL, &rawsiglen,
-			      &opctx->pctx->dbg) != CKR_OK) {
+			req->tbs, req->tbslen, req->sig, req->siglen,
+			&opctx->pctx->dbg) != CKR_OK) {
 		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
+		return;
+	}
+	op_ctx_session_dirty(opctx, false);
+	req->rv = OSSL_RV_OK;
+}
+
+/* single-part token signature, see op_ctx_run() */
+static int op_ctx_sign(struct op_ctx *opctx, CK_MECHANISM_PTR mech,
+		       const unsigned char *tbs, size_t tbslen,
+		       unsigned char *sig, size_t *siglen)
+{
+	struct sign_req req = {
+		.opctx = opctx,
+		.mech = mech,
+		.tbs = tbs,
+		.tbslen = tbslen,
+		.sig = sig,
+		.siglen = siglen,
+	};
+
+	if (op_ctx_run(opctx, op_ctx_sign_fn, &req) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	return req.rv;
+}
+
+static int op_ctx_signature_size(struct op_ctx *opctx, size_t *siglen)
+{
+	unsigned int keylen = opctx->key->keylen;
+
+	if (!keylen) {
+		ps_opctx_debug(opctx, "ERROR: key size unknown");
 		return OSSL_RV_ERR;
 	}
 
 	switch (opctx->type) {
 	case EVP_PKEY_EC:
-		rawsig = OPENSSL_malloc(rawsiglen);
-		if (!rawsig) {
-			ps_opctx_debug(opctx, "ERROR: cannot alloc dummy buffer");
-			return OSSL_RV_ERR;
-		}
-
-		/*
-		 * HACK: the length of OPENSSL ecdsa signatures depends on its content.
-		 * Filling the dummy buffer with 0xff cause the convertion to return
-		 * the maximum length.
-		 */
-		memset(rawsig, 0xff, rawsiglen);
-
-		if (ossl_ecdsa_signature(rawsig, rawsiglen, NULL, &len) != OSSL_RV_OK) {
-			ps_opctx_debug(opctx, "ERROR: ossl_build_ecdsa_signature() failed");
-			OPENSSL_free(rawsig);
-			return OSSL_RV_ERR;
-		}
-		OPENSSL_free(rawsig);
+		*siglen = ossl_ecdsa_signature_size(keylen);
 		break;
 	case EVP_PKEY_RSA:
-		len = rawsiglen;
+	case EVP_PKEY_RSA_PSS:
+		*siglen = keylen;
 		break;
 	default:
 		return OSSL_RV_ERR;
 	}
 
-	*siglen = len;
+	ps_opctx_debug(opctx, "opctx: %p, siglen: %lu", opctx, *siglen);
 	return OSSL_RV_OK;
 }
 
@@ -134,7 +178,6 @@ static int signature_op_ctx_new_fwd(struct op_ctx *opctx)
 	if (!opctx->fwd_op_ctx) {
 		put_error_op_ctx(opctx, PS_ERR_DEFAULT_PROV_FUNC_FAILED,
 				 "fwd_newctx_fn failed");
-		op_ctx_free(opctx);
 		return OSSL_RV_ERR;
 	}
 	opctx->fwd_op_ctx_free = fwd_freectx_fn;
@@ -152,23 +195,15 @@ static struct op_ctx *signature_op_ctx_new(
 	ps_dbg_debug(&pctx->dbg, "propq: %s pkey_type: %d",
 		     propq != NULL ? propq : "", pkey_type);
 
+	/* the forward context is created on init or on demand */
 	opctx = op_ctx_new(pctx, propq, pkey_type);
 	if (!opctx) {
 		ps_dbg_error(&pctx->dbg, "ERROR: op_ctx_new() failed");
 		return NULL;
 	}
 
-	if (signature_op_ctx_new_fwd(opctx) != OSSL_RV_OK) {
-		ps_dbg_error(&pctx->dbg, "ERROR: signature_op_ctx_new_fwd() failed");
-		goto err;
-	}
-
 	ps_dbg_debug(&pctx->dbg, "opctx: %p", opctx);
 	return opctx;
-
-err:
-	op_ctx_free(opctx);
-	return NULL;
 }
 
 static void *ps_signature_op_dupctx_fwd(struct op_ctx *opctx)
@@ -213,12 +248,14 @@ static void *ps_signature_op_dupctx(void *vopctx)
 		return NULL;
 	}
 
-	opctx_new->fwd_op_ctx = ps_signature_op_dupctx_fwd(opctx);
-	if (!opctx_new->fwd_op_ctx) {
-		ps_opctx_debug(opctx, "ERROR: unable to dup fwd_op_ctx");
-		goto err;
+	if (opctx->fwd_op_ctx) {
+		opctx_new->fwd_op_ctx = ps_signature_op_dupctx_fwd(opctx);
+		if (!opctx_new->fwd_op_ctx) {
+			ps_opctx_debug(opctx, "ERROR: unable to dup fwd_op_ctx");
+			goto err;
+		}
+		opctx_new->fwd_op_ctx_free = opctx->fwd_op_ctx_free;
 	}
-	opctx_new->fwd_op_ctx_free = opctx->fwd_op_ctx_free;
 
 	if (opctx->mdctx) {
 		opctx_new->mdctx = EVP_MD_CTX_new();
@@ -257,11 +294,122 @@ err:
 	return NULL;
 }
 
+static int ps_signature_op_sign_batch(struct op_ctx *opctx, OSSL_PARAM *p);
+static int signature_op_ctx_fwd(struct op_ctx *opctx);
+
+/* params kept in opctx->params (see op_ctx_params_native()) */
+static const char * const signature_rsa_param_keys[] = {
+	OSSL_SIGNATURE_PARAM_PAD_MODE,
+	OSSL_SIGNATURE_PARAM_DIGEST,
+	OSSL_SIGNATURE_PARAM_MGF1_DIGEST,
+	OSSL_SIGNATURE_PARAM_PSS_SALTLEN,
+	PS_SIGNATURE_PARAM_BATCH,
+	NULL
+};
+
+static const char * const signature_ec_param_keys[] = {
+	OSSL_SIGNATURE_PARAM_DIGEST,
+	PS_SIGNATURE_PARAM_BATCH,
+	NULL
+};
+
+static const OSSL_PARAM signature_gettable_batch[] = {
+	OSSL_PARAM_octet_string(PS_SIGNATURE_PARAM_BATCH, NULL, 0),
+	OSSL_PARAM_END
+};
+
+static const char * const *signature_param_keys(struct op_ctx *opctx)
+{
+	return (opctx->type == EVP_PKEY_EC) ?
+		signature_ec_param_keys :
+		signature_rsa_param_keys;
+}
+
+static int signature_params_get(struct op_ctx *opctx, OSSL_PARAM params[])
+{
+	bool rsa = (opctx->type != EVP_PKEY_EC);
+	OSSL_PARAM *p;
+	int rv = OSSL_RV_OK;
+
+	for (p = params; p && p->key && rv; p++) {
+		if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_PAD_MODE))
+			rv = ossl_param_set_padmode(p, opctx->params.padmode);
+		else if (!strcmp(p->key, OSSL_SIGNATURE_PARAM_DIGEST))
+			rv = OSSL_PARAM_set_utf8_string(p, opctx->params.digest);
+		else if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_MGF1_DIGEST))
+			rv = OSSL_PARAM_set_utf8_string(p,
+					opctx->params.mgf1[0] ?
+						opctx->params.mgf1 :
+						opctx->params.digest);
+		else if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_PSS_SALTLEN))
+			rv = ossl_param_set_saltlen(p, opctx->params.saltlen);
+	}
+
+	if (!rv) {
+		put_error_op_ctx(opctx, PS_ERR_INVALID_PARAM,
+				 "unable to get param: %s", (p - 1)->key);
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
+static int signature_params_set(struct op_ctx *opctx,
+				const OSSL_PARAM params[])
+{
+	bool rsa = (opctx->type != EVP_PKEY_EC);
+	char digest[PS_DIGEST_NAME_MAX];
+	const OSSL_PARAM *p;
+	char *str;
+
+	for (p = params; p && p->key; p++) {
+		if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_PAD_MODE)) {
+			if (ossl_param_get_padmode(p, &opctx->params.padmode) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_PADDING,
+						 "invalid pad mode");
+				return OSSL_RV_ERR;
+			}
+			opctx->params.padmode_set = true;
+		} else if (!strcmp(p->key, OSSL_SIGNATURE_PARAM_DIGEST)) {
+			str = digest;
+			if ((OSSL_PARAM_get_utf8_string(p, &str,
+					sizeof(digest)) != OSSL_RV_OK) ||
+			    /* fixed by digest sign init */
+			    (opctx->params.digest_fixed &&
+			     !EVP_MD_is_a(opctx->md, digest))) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_MD,
+						 "invalid digest");
+				return OSSL_RV_ERR;
+			}
+			strcpy(opctx->params.digest, digest);
+		} else if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_MGF1_DIGEST)) {
+			str = opctx->params.mgf1;
+			if (OSSL_PARAM_get_utf8_string(p, &str,
+					sizeof(opctx->params.mgf1)) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_MD,
+						 "invalid mgf1 digest");
+				return OSSL_RV_ERR;
+			}
+		} else if (rsa && !strcmp(p->key, OSSL_SIGNATURE_PARAM_PSS_SALTLEN)) {
+			if (ossl_param_get_saltlen(p, &opctx->params.saltlen) != OSSL_RV_OK) {
+				put_error_op_ctx(opctx, PS_ERR_INVALID_SALTLEN,
+						 "invalid pss saltlen");
+				return OSSL_RV_ERR;
+			}
+			opctx->params.saltlen_set = true;
+		}
+	}
+
+	return OSSL_RV_OK;
+}
+
 static int ps_signature_op_get_ctx_params(void *vopctx, OSSL_PARAM params[])
 {
 	OSSL_FUNC_signature_get_ctx_params_fn *fwd_get_params_fn;
 	struct op_ctx *opctx = vopctx;
 	const OSSL_PARAM *p;
+	OSSL_PARAM *pb;
+	bool native;
 
 	if (opctx == NULL)
 		return OSSL_RV_ERR;
@@ -270,38 +418,48 @@ static int ps_signature_op_get_ctx_params(void *vopctx, OSSL_PARAM params[])
 	for (p = params; p && p->key; p++)
 		ps_opctx_debug(opctx, "param: %s", p->key);
 
+	pb = OSSL_PARAM_locate(params, PS_SIGNATURE_PARAM_BATCH);
+	if (pb && (ps_signature_op_sign_batch(opctx, pb) != OSSL_RV_OK))
+		return OSSL_RV_ERR;
+
+	native = op_ctx_params_native(opctx);
+	if (native && !op_ctx_params_fwd(params, signature_param_keys(opctx)))
+		return signature_params_get(opctx, params);
+
+	if (signature_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	fwd_get_params_fn = (OSSL_FUNC_signature_get_ctx_params_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
 				  OSSL_FUNC_SIGNATURE_GET_CTX_PARAMS,
 				  &opctx->pctx->dbg);
 
 	/* fwd_get_params_fn is optional */
-	if (!fwd_get_params_fn)
-		return OSSL_RV_OK;
-
-	if (fwd_get_params_fn(opctx->fwd_op_ctx, params) != OSSL_RV_OK) {
+	if (fwd_get_params_fn &&
+	    (fwd_get_params_fn(opctx->fwd_op_ctx, params) != OSSL_RV_OK)) {
 		put_error_op_ctx(opctx,
 				 PS_ERR_DEFAULT_PROV_FUNC_FAILED,
 				 "fwd_get_params_fn failed");
 		return OSSL_RV_ERR;
 	}
 
-	return OSSL_RV_OK;
+	return native ? signature_params_get(opctx, params) : OSSL_RV_OK;
 }
 
-static int ps_signature_op_set_ctx_params(void *vopctx,
-					  const OSSL_PARAM params[])
+/* params the prepared mechanism is derived from */
+static const char * const signature_mech_param_keys[] = {
+	OSSL_SIGNATURE_PARAM_PAD_MODE,
+	OSSL_SIGNATURE_PARAM_DIGEST,
+	OSSL_SIGNATURE_PARAM_MGF1_DIGEST,
+	OSSL_SIGNATURE_PARAM_PSS_SALTLEN,
+	OSSL_SIGNATURE_PARAM_DIGEST_SIZE,
+	NULL
+};
+
+static int signature_set_ctx_params_fwd(struct op_ctx *opctx,
+					const OSSL_PARAM params[])
 {
 	OSSL_FUNC_signature_set_ctx_params_fn *fwd_set_ctx_params_fn;
-	struct op_ctx *opctx = vopctx;
-	const OSSL_PARAM *p;
-
-	if (!opctx)
-		return OSSL_RV_ERR;
-
-	ps_opctx_debug(opctx, "opctx: %p", opctx);
-	for (p = params; p && p->key; p++)
-		ps_opctx_debug(opctx, "param: %s", p->key);
 
 	fwd_set_ctx_params_fn = (OSSL_FUNC_signature_set_ctx_params_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
@@ -322,6 +480,35 @@ static int ps_signature_op_set_ctx_params(void *vopctx,
 	return OSSL_RV_OK;
 }
 
+static int ps_signature_op_set_ctx_params(void *vopctx,
+					  const OSSL_PARAM params[])
+{
+	struct op_ctx *opctx = vopctx;
+	const OSSL_PARAM *p;
+	bool native;
+
+	if (!opctx)
+		return OSSL_RV_ERR;
+
+	ps_opctx_debug(opctx, "opctx: %p", opctx);
+	for (p = params; p && p->key; p++)
+		ps_opctx_debug(opctx, "param: %s", p->key);
+
+	native = op_ctx_params_native(opctx);
+	if (native && (signature_params_set(opctx, params) != OSSL_RV_OK))
+		return OSSL_RV_ERR;
+
+	if (!native || opctx->fwd_op_ctx ||
+	    op_ctx_params_fwd(params, signature_param_keys(opctx))) {
+		if ((signature_op_ctx_fwd(opctx) != OSSL_RV_OK) ||
+		    (signature_set_ctx_params_fwd(opctx, params) != OSSL_RV_OK))
+			return OSSL_RV_ERR;
+	}
+
+	op_ctx_mech_params_check(opctx, params, signature_mech_param_keys);
+	return OSSL_RV_OK;
+}
+
 static const OSSL_PARAM *ps_signature_op_gettable_ctx_params(
 				struct op_ctx *opctx, int pkey_type)
 {
@@ -338,11 +525,15 @@ static const OSSL_PARAM *ps_signature_op_gettable_ctx_params(
 				&opctx->pctx->dbg);
 
 	/* fwd_gettable_params_fn is optional */
-	if (!fwd_gettable_params_fn)
-		return NULL;
+	params = fwd_gettable_params_fn ?
+		fwd_gettable_params_fn(opctx->fwd_op_ctx,
+				       opctx->pctx->fwd.ctx) : NULL;
 
-	params = fwd_gettable_params_fn(opctx->fwd_op_ctx,
-					opctx->pctx->fwd.ctx);
+	/* batch signing with token keys */
+	if (opctx->key && opctx->key->use_pkcs11)
+		params = fwd_sign_gettable_merge(&opctx->pctx->fwd, pkey_type,
+						 params,
+						 signature_gettable_batch);
 
 	for (p = params; p && p->key; p++)
 		ps_opctx_debug(opctx, "opctx: %p, param: %s",
@@ -391,6 +582,12 @@ static int ps_signature_op_get_ctx_md_params(void *vopctx, OSSL_PARAM params[])
 	for (p = params; p && p->key; p++)
 		ps_opctx_debug(opctx, "param: %s", p->key);
 
+	/* digest of token key operations */
+	if (op_ctx_params_native(opctx) && !opctx->fwd_op_ctx)
+		return opctx->mdctx ?
+			EVP_MD_CTX_get_params(opctx->mdctx, params) :
+			OSSL_RV_OK;
+
 	fwd_get_md_params_fn = (OSSL_FUNC_signature_get_ctx_md_params_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
 				OSSL_FUNC_SIGNATURE_GET_CTX_MD_PARAMS,
@@ -424,6 +621,12 @@ static int ps_signature_op_set_ctx_md_params(void *vopctx,
 	for (p = params; p != NULL && p->key != NULL; p++)
 		ps_opctx_debug(opctx, "param: %s", p->key);
 
+	/* digest of token key operations */
+	if (op_ctx_params_native(opctx) && !opctx->fwd_op_ctx)
+		return opctx->mdctx ?
+			EVP_MD_CTX_set_params(opctx->mdctx, params) :
+			OSSL_RV_OK;
+
 	fwd_set_md_params_fn = (OSSL_FUNC_signature_set_ctx_md_params_fn *)
 			fwd_sign_get_func(&opctx->pctx->fwd,
 				opctx->type,
@@ -458,6 +661,12 @@ static const OSSL_PARAM *ps_signature_op_gettable_ctx_md_params(
 	ps_opctx_debug(opctx, "opctx: %p, pkey_type: %d",
 		       opctx, pkey_type);
 
+	/* digest of token key operations */
+	if (op_ctx_params_native(opctx) && !opctx->fwd_op_ctx)
+		return opctx->md ?
+			EVP_MD_gettable_ctx_params(opctx->md) :
+			NULL;
+
 	fwd_gettable_md_params_fn =
 		(OSSL_FUNC_signature_gettable_ctx_md_params_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, pkey_type,
@@ -486,6 +695,12 @@ static const OSSL_PARAM *ps_signature_op_settable_ctx_md_params(
 	ps_opctx_debug(opctx, "opctx: %p, pkey_type: %d",
 		       opctx, pkey_type);
 
+	/* digest of token key operations */
+	if (op_ctx_params_native(opctx) && !opctx->fwd_op_ctx)
+		return opctx->md ?
+			EVP_MD_settable_ctx_params(opctx->md) :
+			NULL;
+
 	fwd_settable_md_params_fn =
 		(OSSL_FUNC_signature_settable_ctx_md_params_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, pkey_type,
@@ -518,7 +733,8 @@ static EVP_MD *ps_signature_op_get_md(struct op_ctx *opctx)
 
 	ps_opctx_debug(opctx, "opctx: %p", opctx);
 
-	if (!ps_signature_op_get_ctx_params(opctx, ctx_params) ||
+	if (!opctx->fwd_op_ctx ||
+	    !ps_signature_op_get_ctx_params(opctx, ctx_params) ||
 	    !OSSL_PARAM_modified(&ctx_params[0]) ||
 	    !OSSL_PARAM_modified(&ctx_params[1])) {
 		ps_opctx_debug(opctx, "ps_signature_op_get_ctx_params failed");
@@ -599,11 +815,19 @@ static int ps_signature_op_sign_init(void *vopctx, void *vkey,
 		return OSSL_RV_ERR;
 	}
 
-	if (ps_signature_op_sign_init_fwd(opctx, key, params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: op_ctx_init() failed");
+	if (op_ctx_params_native(opctx) && !opctx->fwd_op_ctx)
+		return ps_signature_op_set_ctx_params(opctx, params);
+
+	if ((!opctx->fwd_op_ctx &&
+	     (signature_op_ctx_new_fwd(opctx) != OSSL_RV_OK)) ||
+	    (ps_signature_op_sign_init_fwd(opctx, key, params) != OSSL_RV_OK)) {
+		ps_opctx_debug(opctx, "ERROR: ps_signature_op_sign_init_fwd() failed");
 		return OSSL_RV_ERR;
 	}
 
+	if (op_ctx_params_native(opctx))
+		return signature_params_set(opctx, params);
+
 	return OSSL_RV_OK;
 }
 
@@ -611,35 +835,15 @@ static int signature_mechanism_prepare_rsa(struct op_ctx *opctx,
 					   CK_MECHANISM_PTR mech,
 					   CK_RSA_PKCS_PSS_PARAMS_PTR pss_params)
 {
-	char digest[32], mgf[32];
-	int padmode, saltlen, digest_size;
+	const char *digest = opctx->params.digest;
+	const char *mgf = opctx->params.mgf1[0] ?
+				opctx->params.mgf1 :
+				opctx->params.digest;
+	int saltlen = opctx->params.saltlen;
 	unsigned long key_size;
+	int digest_size;
 	int s;
 
-	OSSL_PARAM s_params[] = {
-		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_DIGEST,
-				       &digest, sizeof(digest)),
-		OSSL_PARAM_utf8_string(OSSL_SIGNATURE_PARAM_MGF1_DIGEST,
-				       &mgf, sizeof(mgf)),
-		OSSL_PARAM_END
-	};
-	OSSL_PARAM i_params[] = {
-		OSSL_PARAM_int(OSSL_SIGNATURE_PARAM_PAD_MODE, &padmode),
-		OSSL_PARAM_int(OSSL_SIGNATURE_PARAM_PSS_SALTLEN, &saltlen),
-		OSSL_PARAM_int(OSSL_SIGNATURE_PARAM_DIGEST_SIZE, &digest_size),
-		OSSL_PARAM_END
-	};
-
-	if (ps_signature_op_get_ctx_params(opctx, s_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_signature_op_get_ctx_params(string) failed");
-		return OSSL_RV_ERR;
-	}
-
-	if (ps_signature_op_get_ctx_params(opctx, i_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: ps_signature_op_get_ctx_params(int) failed");
-		return OSSL_RV_ERR;
-	}
-
 	s = keymgmt_get_size(opctx->key);
 	if (s < 0) {
 		ps_opctx_debug(opctx, "ERROR: keymgmt_get_size failed");
@@ -647,25 +851,20 @@ static int signature_mechanism_prepare_rsa(struct op_ctx *opctx,
 	}
 	key_size = s;
 
-	if (!OSSL_PARAM_modified(&i_params[0]))
-		padmode = RSA_NO_PADDING;
-
-	if (mechtype_by_id(padmode, &mech->mechanism) != OSSL_RV_OK) {
+	if (mechtype_by_id(opctx->params.padmode,
+			   &mech->mechanism) != OSSL_RV_OK) {
 		ps_opctx_debug(opctx, "ERROR: mechtype_by_id() failed");
 		return OSSL_RV_ERR;
 	}
 
 	switch(mech->mechanism) {
 	case CKM_RSA_PKCS_PSS:
-		if (!OSSL_PARAM_modified(&s_params[0]) ||
-		    !OSSL_PARAM_modified(&s_params[1]) ||
-		    !OSSL_PARAM_modified(&i_params[1])) {
+		if (!digest[0]) {
 			ps_opctx_debug(opctx, "ERROR: pss parameters missing");
 			return OSSL_RV_ERR;
 		}
 
-		if (!OSSL_PARAM_modified(&i_params[2]) &&
-		    (size_by_name(digest, &digest_size) != OSSL_RV_OK)) {
+		if (size_by_name(digest, &digest_size) != OSSL_RV_OK) {
 			ps_opctx_debug(opctx, "ERROR: size_by_name(%s) failed",
 				       digest);
 			return OSSL_RV_ERR;
@@ -716,24 +915,37 @@ static int signature_mechanism_prepare_ec(CK_MECHANISM_PTR mech)
 	return OSSL_RV_OK;
 }
 
+/*
+ * The mechanism is built once per init and kept in the op_ctx. It is
+ * rebuilt only if set_ctx_params changed one of its inputs.
+ */
 static int signature_mechanism_prepare(struct op_ctx *opctx,
-				       CK_MECHANISM_PTR mech,
-				       CK_RSA_PKCS_PSS_PARAMS_PTR pss_params)
+				       CK_MECHANISM_PTR *mech)
 {
 	int rv = OSSL_RV_ERR;
 
+	if (opctx->mech.valid)
+		goto out;
+
 	switch (opctx->type) {
 	case EVP_PKEY_EC:
-		rv = signature_mechanism_prepare_ec(mech);
+		rv = signature_mechanism_prepare_ec(&opctx->mech.mech);
 		break;
 	case EVP_PKEY_RSA:
-		rv = signature_mechanism_prepare_rsa(opctx, mech, pss_params);
+		rv = signature_mechanism_prepare_rsa(opctx, &opctx->mech.mech,
+						     &opctx->mech.params.pss);
 		break;
 	default:
 		break;
 	}
 
-	return rv;
+	if (rv != OSSL_RV_OK)
+		return rv;
+
+	opctx->mech.valid = true;
+out:
+	*mech = &opctx->mech.mech;
+	return OSSL_RV_OK;
 }
 
 static int ps_signature_op_sign_fwd(struct op_ctx *opctx,
@@ -770,10 +982,9 @@ static int ps_signature_op_sign(void *vopctx,
 				size_t sigsize,
 				const unsigned char *tbs, size_t tbslen)
 {
-	CK_RSA_PKCS_PSS_PARAMS pss_params;
 	struct op_ctx *opctx = vopctx;
+	CK_MECHANISM_PTR mech;
 	size_t raw_siglen;
-	CK_MECHANISM mech;
 
 	if (opctx == NULL)
 		return OSSL_RV_ERR;
@@ -791,50 +1002,179 @@ static int ps_signature_op_sign(void *vopctx,
 		return ps_signature_op_sign_fwd(opctx, sig, siglen, sigsize,
 						tbs, tbslen);
 
-	if (signature_mechanism_prepare(opctx, &mech,
-					&pss_params) != OSSL_RV_OK) {
+	if (!sig)
+		return op_ctx_signature_size(opctx, siglen);
+
+	if (signature_mechanism_prepare(opctx, &mech) != OSSL_RV_OK) {
 		ps_opctx_debug(opctx,
 			       "ERROR: signature_mechanism_prepare() failed");
 		return OSSL_RV_ERR;
 	}
 
-	if (op_ctx_object_ensure(opctx) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: op_ctx_object_ensure() failed");
+	raw_siglen = sigsize;
+	if (op_ctx_sign(opctx, mech, tbs, tbslen,
+			sig, &raw_siglen) != OSSL_RV_OK)
 		return OSSL_RV_ERR;
+
+	switch (opctx->type) {
+	case EVP_PKEY_EC:
+		ps_opctx_debug(opctx, "raw signature: [%p, %lu]",
+			       sig, raw_siglen);
+		ps_dbg_debug_dump(&opctx->pctx->dbg,
+				  sig, raw_siglen);
+
+		*siglen = sigsize;
+		if (ossl_ecdsa_signature(sig, raw_siglen, sig, siglen) != OSSL_RV_OK) {
+			ps_opctx_debug(opctx,
+				       "ERROR: ossl_build_ecdsa_signature() failed");
+			return OSSL_RV_ERR;
+		}
+		break;
+	default:
+		*siglen = raw_siglen;
 	}
 
-	if (!sig)
-		return op_ctx_signature_size(opctx, &mech, siglen);
+	ps_opctx_debug(opctx, "signature: [%p, %lu]",
+		       sig, *siglen);
+	ps_dbg_debug_dump(&opctx->pctx->dbg,
+			  sig, *siglen);
 
-	if (pkcs11_sign_init(&opctx->pctx->pkcs11, opctx->hsession,
-			     &mech, opctx->hobject,
-			     &opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
+	return OSSL_RV_OK;
+}
+
+struct sign_batch_req {
+	struct op_ctx *opctx;
+	CK_MECHANISM_PTR mech;
+	struct ps_sign_batch_item *items;
+	size_t nitems;
+	size_t sigsize;
+};
+
+/* all items of a batch are signed with one session */
+static void op_ctx_sign_batch_fn(void *arg)
+{
+	struct sign_batch_req *req = arg;
+	struct op_ctx *opctx = req->opctx;
+	struct ps_sign_batch_item *item;
+	size_t i, raw_siglen;
+
+	for (i = 0; i < req->nitems; i++) {
+		item = &req->items[i];
+		if (!item->tbs || !item->sig || (item->sigsize < req->sigsize)) {
+			ps_opctx_debug(opctx, "ERROR: invalid item skipped [item: %lu, sigsize: %lu]",
+				       i, item->sigsize);
+			continue;
+		}
+
+		if (op_ctx_sign_init(opctx, req->mech) != OSSL_RV_OK)
+			continue;
+
+		raw_siglen = item->sigsize;
+		if (pkcs11_sign(&opctx->pctx->pkcs11, opctx->hsession,
+				item->tbs, item->tbslen,
+				item->sig, &raw_siglen,
+				&opctx->pctx->dbg) != CKR_OK) {
+			ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed [item: %lu]",
+				       i);
+			continue;
+		}
+		op_ctx_session_dirty(opctx, false);
+
+		item->siglen = raw_siglen;
+		item->status = 1;
+	}
+}
+
+static int ps_signature_op_sign_batch_fwd(struct op_ctx *opctx,
+					  struct ps_sign_batch_item *items,
+					  size_t nitems)
+{
+	size_t i;
+
+	for (i = 0; i < nitems; i++) {
+		items[i].siglen = items[i].sigsize;
+		if (ps_signature_op_sign_fwd(opctx, items[i].sig,
+					     &items[i].siglen,
+					     items[i].sigsize,
+					     items[i].tbs,
+					     items[i].tbslen) == OSSL_RV_OK)
+			items[i].status = 1;
+	}
+
+	return OSSL_RV_OK;
+}
+
+/*
+ * Sign a batch of items (see pkcs11sign.h). The mechanism is prepared
+ * once and all items are signed within a single token operation run.
+ */
+static int ps_signature_op_sign_batch(struct op_ctx *opctx, OSSL_PARAM *p)
+{
+	struct sign_batch_req req = {
+		.opctx = opctx,
+	};
+	struct ps_sign_batch_item *item;
+	size_t i, siglen;
+
+	if ((p->data_type != OSSL_PARAM_OCTET_STRING) || !p->data ||
+	    !p->data_size ||
+	    (p->data_size % sizeof(struct ps_sign_batch_item))) {
+		put_error_op_ctx(opctx, PS_ERR_INTERNAL_ERROR,
+				 "invalid %s parameter", PS_SIGNATURE_PARAM_BATCH);
 		return OSSL_RV_ERR;
 	}
 
-	if (pkcs11_sign(&opctx->pctx->pkcs11, opctx->hsession,
-			tbs, tbslen, sig, &raw_siglen,
-			&opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
+	if (!opctx->key || (opctx->operation != EVP_PKEY_OP_SIGN)) {
+		put_error_op_ctx(opctx, PS_ERR_OPRATION_NOT_INITIALIZED,
+				 "sign operation not initialized");
 		return OSSL_RV_ERR;
 	}
 
-	ps_opctx_debug(opctx, "raw signature: [%p, %lu]",
-		       sig, raw_siglen);
-	ps_dbg_debug_dump(&opctx->pctx->dbg,
-			  sig, raw_siglen);
+	req.items = p->data;
+	req.nitems = p->data_size / sizeof(struct ps_sign_batch_item);
+	ps_opctx_debug(opctx, "opctx: %p, batch items: %lu",
+		       opctx, req.nitems);
+
+	for (i = 0; i < req.nitems; i++) {
+		req.items[i].siglen = 0;
+		req.items[i].status = 0;
+	}
+	p->return_size = p->data_size;
+
+	if (!opctx->key->use_pkcs11)
+		return ps_signature_op_sign_batch_fwd(opctx, req.items,
+						      req.nitems);
+
+	if (op_ctx_signature_size(opctx, &req.sigsize) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
 
-	if (ossl_ecdsa_signature(sig, raw_siglen, sig, siglen) != OSSL_RV_OK) {
+	if (signature_mechanism_prepare(opctx, &req.mech) != OSSL_RV_OK) {
 		ps_opctx_debug(opctx,
-			       "ERROR: ossl_build_ecdsa_signature() failed");
+			       "ERROR: signature_mechanism_prepare() failed");
 		return OSSL_RV_ERR;
 	}
 
-	ps_opctx_debug(opctx, "signature: [%p, %lu]",
-		       sig, *siglen);
-	ps_dbg_debug_dump(&opctx->pctx->dbg,
-			  sig, *siglen);
+	if (op_ctx_run(opctx, op_ctx_sign_batch_fn, &req) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	if (opctx->type != EVP_PKEY_EC)
+		return OSSL_RV_OK;
+
+	for (i = 0; i < req.nitems; i++) {
+		item = &req.items[i];
+		if (!item->status)
+			continue;
+
+		siglen = item->sigsize;
+		if (ossl_ecdsa_signature(item->sig, item->siglen, item->sig,
+					 &siglen) != OSSL_RV_OK) {
+			ps_opctx_debug(opctx, "ERROR: ossl_ecdsa_signature() failed [item: %lu]",
+				       i);
+			item->status = 0;
+			continue;
+		}
+		item->siglen = siglen;
+	}
 
 	return OSSL_RV_OK;
 }
@@ -860,6 +1200,9 @@ static int ps_signature_op_verify_init(void *vopctx, void *vkey,
 		return OSSL_RV_ERR;
 	}
 
+	if (signature_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	fwd_verify_init_fn = (OSSL_FUNC_signature_verify_init_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
 				  OSSL_FUNC_SIGNATURE_VERIFY_INIT,
@@ -902,6 +1245,9 @@ static int ps_signature_op_verify_recover_init(void *vopctx, void *vkey,
 		return OSSL_RV_ERR;
 	}
 
+	if (signature_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	fwd_verify_recover_init_fn =
 		(OSSL_FUNC_signature_verify_recover_init_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
@@ -1022,6 +1368,61 @@ static int ps_signature_op_digest_sign_init_fwd(struct op_ctx *opctx,
 
 }
 
+/*
+ * Sign operations of token keys keep their parameters in the op_ctx and
+ * do not need a forward context. It is created for operations and
+ * parameters served by the default provider only, and initialized with
+ * the state of the op_ctx.
+ */
+static int signature_op_ctx_fwd(struct op_ctx *opctx)
+{
+	OSSL_PARAM params[5], *p = params;
+	bool pss;
+	int rv;
+
+	if (opctx->fwd_op_ctx)
+		return OSSL_RV_OK;
+
+	if (signature_op_ctx_new_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	ps_opctx_debug(opctx, "opctx: %p, forward context created", opctx);
+
+	if (!op_ctx_params_native(opctx))
+		return OSSL_RV_OK;
+
+	pss = (opctx->params.padmode == RSA_PKCS1_PSS_PADDING);
+	if (!opctx->params.digest_fixed && opctx->params.digest[0])
+		*p++ = OSSL_PARAM_construct_utf8_string(
+				OSSL_SIGNATURE_PARAM_DIGEST,
+				opctx->params.digest, 0);
+	if (opctx->params.padmode_set)
+		*p++ = OSSL_PARAM_construct_int(OSSL_SIGNATURE_PARAM_PAD_MODE,
+						&opctx->params.padmode);
+	if (pss && opctx->params.mgf1[0])
+		*p++ = OSSL_PARAM_construct_utf8_string(
+				OSSL_SIGNATURE_PARAM_MGF1_DIGEST,
+				opctx->params.mgf1, 0);
+	if (pss && opctx->params.saltlen_set)
+		*p++ = OSSL_PARAM_construct_int(
+				OSSL_SIGNATURE_PARAM_PSS_SALTLEN,
+				&opctx->params.saltlen);
+	*p = OSSL_PARAM_construct_end();
+
+	rv = opctx->params.digest_fixed ?
+		ps_signature_op_digest_sign_init_fwd(opctx,
+						     opctx->params.digest,
+						     opctx->key, NULL) :
+		ps_signature_op_sign_init_fwd(opctx, opctx->key, NULL);
+	if ((rv != OSSL_RV_OK) ||
+	    (signature_set_ctx_params_fwd(opctx, params) != OSSL_RV_OK)) {
+		op_ctx_free_fwd(opctx);
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
 static int ps_signature_op_digest_sign_init(struct op_ctx *opctx,
 					    const char *mdname,
 					    struct obj *key,
@@ -1043,18 +1444,21 @@ static int ps_signature_op_digest_sign_init(struct op_ctx *opctx,
 		return OSSL_RV_ERR;
 	}
 
-	if (ps_signature_op_digest_sign_init_fwd(opctx, mdname,
-						 key, params) != OSSL_RV_OK)
+	if (!op_ctx_params_native(opctx) &&
+	    (signature_op_ctx_fwd(opctx) != OSSL_RV_OK))
+		return OSSL_RV_ERR;
+
+	if (opctx->fwd_op_ctx &&
+	    (ps_signature_op_digest_sign_init_fwd(opctx, mdname,
+						  key, params) != OSSL_RV_OK))
 		return OSSL_RV_ERR;
 
 	if (!opctx->key->use_pkcs11)
 		return OSSL_RV_OK;
 
-	/* mdctx */
-	if (opctx->mdctx != NULL)
-		EVP_MD_CTX_free(opctx->mdctx);
-
-	opctx->mdctx = EVP_MD_CTX_new();
+	/* mdctx, kept (reset) while the context is pooled */
+	if (opctx->mdctx == NULL)
+		opctx->mdctx = EVP_MD_CTX_new();
 	if (opctx->mdctx == NULL) {
 		put_error_op_ctx(opctx, PS_ERR_MALLOC_FAILED,
 			 "EVP_MD_CTX_new failed");
@@ -1064,6 +1468,7 @@ static int ps_signature_op_digest_sign_init(struct op_ctx *opctx,
 	/* md */
 	if (opctx->md)
 		EVP_MD_free(opctx->md);
+	opctx->md = NULL;
 
 	opctx->md = (mdname) ?
 		EVP_MD_fetch(opctx->pctx->core.libctx, mdname, opctx->prop) :
@@ -1075,6 +1480,15 @@ static int ps_signature_op_digest_sign_init(struct op_ctx *opctx,
 		return OSSL_RV_ERR;
 	}
 
+	snprintf(opctx->params.digest, sizeof(opctx->params.digest), "%s",
+		 mdname ? mdname : EVP_MD_get0_name(opctx->md));
+	opctx->params.digest_fixed = true;
+
+	if ((opctx->fwd_op_ctx ?
+	     signature_params_set(opctx, params) :
+	     ps_signature_op_set_ctx_params(opctx, params)) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	if (EVP_DigestInit_ex2(opctx->mdctx, opctx->md, params) != OSSL_RV_OK) {
 		put_error_op_ctx(opctx, PS_ERR_MALLOC_FAILED,
 				 "EVP_DigestInit_ex2 failed");
@@ -1128,7 +1542,7 @@ static int ps_signature_op_digest_sign_update(void *vctx,
 		return ps_signature_op_digest_sign_update_fwd(opctx, data,
 							      datalen);
 
-	if (!opctx->mdctx) {
+	if (!opctx->mdctx || !EVP_MD_CTX_get0_md(opctx->mdctx)) {
 		put_error_op_ctx(opctx, PS_ERR_OPRATION_NOT_INITIALIZED,
 				 "digest sign operation not initialized");
 		return OSSL_RV_ERR;
@@ -1176,11 +1590,10 @@ static int ps_signature_op_digest_sign_final(void *vopctx,
 					     size_t sigsize)
 {
 	unsigned char tbs[DER_DIGESTINFO_MAX + EVP_MAX_MD_SIZE], *digest;
-	CK_RSA_PKCS_PSS_PARAMS pss_params;
 	unsigned int tbslen = 0, dlen = 0;
 	struct op_ctx *opctx = vopctx;
+	CK_MECHANISM_PTR mech;
 	size_t raw_siglen;
-	CK_MECHANISM mech;
 
 	if (!opctx || !siglen)
 		return OSSL_RV_ERR;
@@ -1198,29 +1611,24 @@ static int ps_signature_op_digest_sign_final(void *vopctx,
 		return ps_signature_op_digest_sign_final_fwd(opctx, sig,
 							     siglen, sigsize);
 
-	if (!opctx->mdctx) {
+	if (!opctx->mdctx || !EVP_MD_CTX_get0_md(opctx->mdctx)) {
 		put_error_op_ctx(opctx, PS_ERR_OPRATION_NOT_INITIALIZED,
 				 "digest sign operation not initialized");
 		return OSSL_RV_ERR;
 	}
 
-	if (signature_mechanism_prepare(opctx, &mech, &pss_params) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: signature_mechanism_prepare failed");
-		return OSSL_RV_ERR;
-	}
+	if (!sig)
+		return op_ctx_signature_size(opctx, siglen);
 
-	if (op_ctx_object_ensure(opctx) != OSSL_RV_OK) {
-		ps_opctx_debug(opctx, "ERROR: op_ctx_object_ensure() failed");
+	if (signature_mechanism_prepare(opctx, &mech) != OSSL_RV_OK) {
+		ps_opctx_debug(opctx, "ERROR: signature_mechanism_prepare failed");
 		return OSSL_RV_ERR;
 	}
 
-	if (!sig)
-		return op_ctx_signature_size(opctx, &mech, siglen);
-
 	switch (opctx->type) {
 	case EVP_PKEY_RSA:
 		/* prefix hash with DER-encoded algo */
-		if ((mech.mechanism == CKM_RSA_PKCS) &&
+		if ((mech->mechanism == CKM_RSA_PKCS) &&
 		    (ossl_hash_prefix(opctx->mdctx, tbs, &tbslen) != OSSL_RV_OK))
 			return OSSL_RV_ERR;
 		digest = tbs + tbslen;
@@ -1241,21 +1649,11 @@ static int ps_signature_op_digest_sign_final(void *vopctx,
 	ps_dbg_debug_dump(&opctx->pctx->dbg,
 			  digest, dlen);
 
-	if (pkcs11_sign_init(&opctx->pctx->pkcs11, opctx->hsession,
-			     &mech, opctx->hobject,
-			     &opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
-		return OSSL_RV_ERR;
-	}
-
 	tbslen += dlen;
 	raw_siglen = sigsize;
-	if (pkcs11_sign(&opctx->pctx->pkcs11, opctx->hsession,
-			tbs, tbslen, sig, &raw_siglen,
-			&opctx->pctx->dbg) != CKR_OK) {
-		ps_opctx_debug(opctx, "ERROR: pkcs11_sign() failed");
+	if (op_ctx_sign(opctx, mech, tbs, tbslen,
+			sig, &raw_siglen) != OSSL_RV_OK)
 		return OSSL_RV_ERR;
-	}
 
 	switch (opctx->type) {
 	case EVP_PKEY_EC:
@@ -1264,6 +1662,7 @@ static int ps_signature_op_digest_sign_final(void *vopctx,
 		ps_dbg_debug_dump(&opctx->pctx->dbg,
 				  sig, raw_siglen);
 
+		*siglen = sigsize;
 		if (ossl_ecdsa_signature(sig, raw_siglen, sig, siglen) != OSSL_RV_OK) {
 			ps_opctx_debug(opctx, "ERROR: ossl_build_ecdsa_signature() failed");
 			return OSSL_RV_ERR;
@@ -1303,6 +1702,9 @@ static int ps_signature_op_digest_verify_init(void *vctx, const char *mdname,
 		return OSSL_RV_ERR;
 	}
 
+	if (signature_op_ctx_fwd(opctx) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
 	fwd_digest_verify_init_fn = (OSSL_FUNC_signature_digest_verify_init_fn *)
 		fwd_sign_get_func(&opctx->pctx->fwd, opctx->type,
 				  OSSL_FUNC_SIGNATURE_DIGEST_VERIFY_INIT,
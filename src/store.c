@@ -4,7 +4,11 @@
  */
 
 #include <stdbool.h>
+#include <time.h>
 #include <openssl/store.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/core_names.h>
 #include <openssl/core_object.h>
 
@@ -14,6 +18,9 @@
 #include "pkcs11.h"
 #include "uri.h"
 #include "object.h"
+#include "fork.h"
+#include "keyindex.h"
+#include "store.h"
 
 #define KEY_PARAMS	4
 
@@ -22,13 +29,30 @@ static const int key_obj_type = OSSL_OBJECT_PKEY;
 struct store_ctx {
 	struct provider_ctx *pctx;
 	struct parsed_uri *puri;
+	char *cache_uri;
 	CK_SLOT_ID slot_id;
 	char *slot_login_info;
+	/* lookup started, objects are fetched on demand */
 	bool objects_loaded;
 	struct obj **objects;
 	CK_ULONG nobjects;
+	CK_ULONG objects_size;
 	CK_ULONG load_idx;
 	int expect;
+
+	/* active object search, see search_next() */
+	CK_SESSION_HANDLE sh;
+	bool search_done;
+	/* handles from C_FindObjects(), or all from the key index */
+	bool find_active;
+	bool indexed;
+	CK_OBJECT_HANDLE_PTR handles;
+	CK_ULONG nhandles;
+	CK_ULONG handle_idx;
+	/* objects loaded before the search was restarted */
+	CK_ULONG nskip;
+	unsigned int fork_gen;
+	unsigned int token_gen;
 };
 
 #define MAX_PIN		64
@@ -120,27 +144,6 @@ static int get_object_params(struct obj *obj)
 	return OSSL_RV_OK;
 }
 
-static struct obj *get_next_loadable_object(struct store_ctx *sctx)
-{
-	if (!sctx)
-		return NULL;
-
-	while (sctx->load_idx < sctx->nobjects) {
-		struct obj *o = sctx->objects[sctx->load_idx++];
-
-		/* TODO add certificate support */
-		switch (obj_get_class(o)) {
-		case CKO_PUBLIC_KEY:
-		case CKO_PRIVATE_KEY:
-			return o;
-		default:
-			continue;
-		}
-	}
-
-	return NULL;
-}
-
 static int handle_pkcs11_module(struct store_ctx *sctx)
 {
 	struct dbg *dbg = &sctx->pctx->dbg;
@@ -163,64 +166,54 @@ static int handle_pkcs11_module(struct store_ctx *sctx)
 	return 0;
 }
 
-static bool match_token_uri(struct pkcs11_module *pkcs11, CK_SLOT_ID slot_id,
-			    struct parsed_uri *puri, struct dbg *dbg)
+static bool match_token_uri(const struct pkcs11_slot *slot,
+			    struct parsed_uri *puri)
 {
-	CK_TOKEN_INFO ti;
-
 	if(!puri->tok_token && !puri->tok_manuf &&
 	   !puri->tok_serial && !puri->tok_model)
 		return true;
 
-	if (pkcs11_get_token_info(pkcs11, slot_id, &ti, dbg) != CKR_OK)
+	if (!slot->has_token_info)
 		return false;
 
 	if (puri->tok_token &&
-	    (pkcs11_strcmp(puri->tok_token, (const CK_CHAR_PTR)&ti.label,
-			   sizeof(ti.label)) != 0))
+	    (pkcs11_str_cmp(puri->tok_token, &slot->tok_label) != 0))
 		return false;
 
 	if (puri->tok_manuf &&
-	    (pkcs11_strcmp(puri->tok_manuf, (const CK_CHAR_PTR)&ti.manufacturerID,
-			   sizeof(ti.manufacturerID)) != 0))
+	    (pkcs11_str_cmp(puri->tok_manuf, &slot->tok_manuf) != 0))
 		return false;
 
 	if (puri->tok_serial &&
-	    (pkcs11_strcmp(puri->tok_serial, (const CK_CHAR_PTR)&ti.serialNumber,
-			   sizeof(ti.serialNumber)) != 0))
+	    (pkcs11_str_cmp(puri->tok_serial, &slot->tok_serial) != 0))
 		return false;
 
 	if (puri->tok_model &&
-	    (pkcs11_strcmp(puri->tok_model, (const CK_CHAR_PTR)&ti.model,
-			   sizeof(ti.model)) != 0))
+	    (pkcs11_str_cmp(puri->tok_model, &slot->tok_model) != 0))
 		return false;
 
 	return true;
 }
 
-static bool match_slot_uri(struct pkcs11_module *pkcs11, CK_SLOT_ID slot_id,
-			   struct parsed_uri *puri, struct dbg *dbg)
+static bool match_slot_uri(const struct pkcs11_slot *slot,
+			   struct parsed_uri *puri)
 {
-	CK_SLOT_INFO si;
-
 	if (puri->slt_id &&
-	    (slot_id != strtoul(puri->slt_id, NULL, 10)))
+	    (slot->id != strtoul(puri->slt_id, NULL, 10)))
 		return false;
 
 	if (!puri->slt_manuf && !puri->slt_desc)
 		return true;
 
-	if (pkcs11_get_slot_info(pkcs11, slot_id, &si, dbg) != CKR_OK)
+	if (!slot->has_slot_info)
 		return false;
 
 	if (puri->slt_manuf &&
-	    (pkcs11_strcmp(puri->slt_manuf, (const CK_CHAR_PTR)&si.manufacturerID,
-			   sizeof(si.manufacturerID)) != 0))
+	    (pkcs11_str_cmp(puri->slt_manuf, &slot->slt_manuf) != 0))
 		return false;
 
 	if (puri->slt_desc &&
-	    (pkcs11_strcmp(puri->slt_desc, (const CK_CHAR_PTR)&si.slotDescription,
-			   sizeof(si.slotDescription)) != 0))
+	    (pkcs11_str_cmp(puri->slt_desc, &slot->slt_desc) != 0))
 		return false;
 
 	return true;
@@ -258,153 +251,708 @@ static bool match_library_uri(struct pkcs11_module *pkcs11, struct parsed_uri *p
 #define LOGIN_INFO_FMT	"PKCS#11 token \'%s\' in slot %lu (user pin)"
 static void prepare_login_info(struct store_ctx *sctx, struct dbg *dbg)
 {
-	char *tlabel = NULL;
-	CK_TOKEN_INFO ti;
+	const struct pkcs11_slot *slot;
+	struct pkcs11_slots *slots;
 
-	if (pkcs11_get_token_info(&sctx->pctx->pkcs11, sctx->slot_id,
-				  &ti, dbg) == CKR_OK)
-		tlabel = OPENSSL_strndup((char *)ti.label, pkcs11_strlen(ti.label, sizeof(ti.label)));
+	slots = pkcs11_slots_get(&sctx->pctx->pkcs11, false, dbg);
+	slot = pkcs11_slots_find(slots, sctx->slot_id);
 
 	asprintf(&sctx->slot_login_info, LOGIN_INFO_FMT,
-		 tlabel ?: "", sctx->slot_id);
-	OPENSSL_free(tlabel);
+		 (slot && slot->has_token_info) ? slot->tok_label.s : "",
+		 sctx->slot_id);
+	pkcs11_slots_put(slots);
+}
+
+/* the key of an indexed handle must still match the uri */
+static bool obj_match_uri(const struct obj *obj, const struct parsed_uri *puri)
+{
+	CK_OBJECT_CLASS class;
+	CK_BYTE_PTR val;
+	CK_ULONG len;
+
+	class = puri->obj_type ? pkcs11_type_class(puri->obj_type) :
+				 CKO_PRIVATE_KEY;
+	if (obj_get_class(obj) != class)
+		return false;
+	if (puri->obj_object &&
+	    ((obj_get_label(obj, &val, &len) != OSSL_RV_OK) ||
+	     (len != strlen(puri->obj_object)) ||
+	     memcmp(val, puri->obj_object, len)))
+		return false;
+	if (puri->obj_id.p &&
+	    ((obj_get_id(obj, &val, &len) != OSSL_RV_OK) ||
+	     (len != puri->obj_id.plen) ||
+	     memcmp(val, puri->obj_id.p, len)))
+		return false;
+	return true;
 }
 
-static int load_object_handles(struct store_ctx *sctx, CK_SESSION_HANDLE sh,
-			       CK_OBJECT_HANDLE_PTR handles, CK_ULONG nhandles)
+static struct obj *load_object_handle(struct store_ctx *sctx,
+				      CK_OBJECT_HANDLE handle)
 {
 	struct provider_ctx *pctx = sctx->pctx;
 	struct dbg *dbg = &pctx->dbg;
-	struct obj **objs;
-	CK_ULONG nobjs, i;
+	struct obj *obj;
+	CK_RV rv;
 
-	objs = OPENSSL_zalloc((sizeof(struct obj *) * nhandles));
-	if (!objs)
-		return OSSL_RV_ERR;
-	nobjs = nhandles;
+	obj = obj_new_init(pctx, sctx->slot_id, sctx->puri->pin);
+	if (!obj)
+		return NULL;
 
-	for (i = 0; i < nhandles; i++) {
-		objs[i] = obj_new_init(pctx, sctx->slot_id, sctx->puri->pin);
-		if (!objs[i]) {
-			goto err;
-		}
+	rv = pkcs11_fetch_attributes(&pctx->pkcs11, sctx->sh, handle,
+				     &obj->attrs, &obj->nattrs, dbg);
+	if (rv != CKR_OK) {
+		ps_dbg_error(dbg, "sctx: %p, attribute lookup failed (handle: %lu)",
+			     sctx, handle);
+		/* stale handles (e.g. from the key index) */
+		pkcs11_token_event(&pctx->pkcs11, rv);
+		goto err;
+	}
 
-		if (pkcs11_fetch_attributes(&sctx->pctx->pkcs11, sh,
-					    handles[i], &objs[i]->attrs,
-					    &objs[i]->nattrs, dbg) != CKR_OK) {
-			ps_dbg_error(dbg, "sctx: %p, attribute lookup failed (handle: %lu)",
-				     sctx, handles[i]);
-			goto err;
-		}
+	if (sctx->indexed && !obj_match_uri(obj, sctx->puri)) {
+		ps_dbg_warn(dbg, "sctx: %p, key index mismatch (handle: %lu)",
+			    sctx, handle);
+		/* handle reused by another object, the index is stale */
+		pkcs11_token_event(&pctx->pkcs11, CKR_OBJECT_HANDLE_INVALID);
+		goto err;
+	}
+	obj_set_handle(obj, handle);
 
-		if (get_object_params(objs[i]) != OSSL_RV_OK) {
-			ps_dbg_error(dbg, "sctx: %p, params lookup failed (handle: %lu)",
-				     sctx, handles[i]);
-			goto err;
-		}
+	if (get_object_params(obj) != OSSL_RV_OK) {
+		ps_dbg_error(dbg, "sctx: %p, params lookup failed (handle: %lu)",
+			     sctx, handle);
+		goto err;
 	}
 
-	sctx->objects = objs;
-	sctx->nobjects = nobjs;
+	return obj;
+err:
+	obj_free(obj);
+	return NULL;
+}
 
-	ps_dbg_debug(dbg, "sctx: %p, %d objects found", sctx, sctx->nobjects);
+static int objects_append(struct store_ctx *sctx, struct obj *obj)
+{
+	struct obj **objs;
+	CK_ULONG size;
 
-	return OSSL_RV_OK;
-err:
-	for (i = 0; i < nobjs; i++) {
-		obj_free(objs[i]);
+	if (sctx->nobjects == sctx->objects_size) {
+		size = sctx->objects_size ? sctx->objects_size * 2 : 8;
+		objs = OPENSSL_realloc(sctx->objects,
+				       size * sizeof(struct obj *));
+		if (!objs)
+			return OSSL_RV_ERR;
+		sctx->objects = objs;
+		sctx->objects_size = size;
 	}
-	OPENSSL_free(objs);
-	return OSSL_RV_ERR;
+
+	sctx->objects[sctx->nobjects++] = obj;
+	return OSSL_RV_OK;
 }
 
-static CK_SLOT_ID lookup_slot_id(struct pkcs11_module *pkcs11, struct parsed_uri *puri, struct dbg *dbg)
+static CK_SLOT_ID match_slots(struct pkcs11_module *pkcs11,
+			      const struct pkcs11_slots *slots,
+			      struct parsed_uri *puri, CK_ULONG *nmatch,
+			      struct dbg *dbg)
 {
-	CK_SLOT_ID_PTR slots;
-	CK_ULONG nslots, i;
 	CK_SLOT_ID found = CK_UNAVAILABLE_INFORMATION;
-	CK_SLOT_ID rv = CK_UNAVAILABLE_INFORMATION;
-
-	if (pkcs11_get_slots(pkcs11, &slots, &nslots, dbg) != CKR_OK) {
-		ps_dbg_debug(dbg, "%s: slot lookup failed",
-			     pkcs11->soname);
-		return rv;
-	}
+	CK_ULONG i;
 
-	for (i = 0; i < nslots; i++) {
-		CK_SLOT_ID sid = slots[i];
+	*nmatch = 0;
+	for (i = 0; i < slots->nslots; i++) {
+		const struct pkcs11_slot *slot = &slots->slot[i];
 
-		if (!match_slot_uri(pkcs11, sid, puri, dbg)) {
+		if (!match_slot_uri(slot, puri)) {
 			ps_dbg_debug(dbg, "%s: slot %lu: slot mismatch",
-				     pkcs11->soname, sid);
+				     pkcs11->soname, slot->id);
 			continue;
 		}
 
-		if (!match_token_uri(pkcs11, sid, puri, dbg)) {
+		if (!match_token_uri(slot, puri)) {
 			ps_dbg_debug(dbg, "%s: slot %lu: token mismatch",
-				     pkcs11->soname, sid);
+				     pkcs11->soname, slot->id);
 			continue;
 		}
 
-		if (found != CK_UNAVAILABLE_INFORMATION) {
+		if (++(*nmatch) > 1) {
 			ps_dbg_debug(dbg, "%s: too many matching slots/tokens (%lu, %lu)",
-				     pkcs11->soname, found, sid);
-			goto out;
+				     pkcs11->soname, found, slot->id);
+			return CK_UNAVAILABLE_INFORMATION;
+		}
+
+		found = slot->id;
+	}
+
+	return found;
+}
+
+static CK_SLOT_ID lookup_slot_id(struct pkcs11_module *pkcs11, struct parsed_uri *puri, struct dbg *dbg)
+{
+	CK_SLOT_ID rv = CK_UNAVAILABLE_INFORMATION;
+	struct pkcs11_slots *slots;
+	CK_ULONG nmatch;
+	bool refresh;
+
+	/* no match in the cached slots: the token may be new, refetch once */
+	for (refresh = false; ; refresh = true) {
+		slots = pkcs11_slots_get(pkcs11, refresh, dbg);
+		if (!slots) {
+			ps_dbg_debug(dbg, "%s: slot lookup failed",
+				     pkcs11->soname);
+			return rv;
+		}
+
+		rv = match_slots(pkcs11, slots, puri, &nmatch, dbg);
+		pkcs11_slots_put(slots);
+
+		if (nmatch || refresh)
+			return rv;
+	}
+}
+
+/*
+ * Store cache
+ *
+ * Maps the normalized uri of a store to the slot and the objects found
+ * by the lookup. Only uris with a pin (pin-value or pin-source) are
+ * cached, a hit requires the same pin. The entries keep a salted digest
+ * of the pin, the cached objects have no pin. Entries expire after ttl
+ * seconds, on fork and on token events (pkcs11_token_event()). The cached
+ * objects are templates, each store gets its own copies.
+ */
+#define CACHE_PIN_SALT_LEN	16
+#define CACHE_PIN_MD_LEN	32
+
+struct store_cache_entry {
+	char *uri;
+	unsigned char pin_salt[CACHE_PIN_SALT_LEN];
+	unsigned char pin_md[CACHE_PIN_MD_LEN];
+	CK_SLOT_ID slot_id;
+	struct obj **objects;
+	CK_ULONG nobjects;
+	time_t expires;
+	unsigned int fork_gen;
+	unsigned int token_gen;
+	struct store_cache_entry *next;
+};
+
+static time_t _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void objects_free(struct obj **objs, CK_ULONG nobjs)
+{
+	CK_ULONG i;
+
+	if (!objs)
+		return;
+
+	for (i = 0; i < nobjs; i++)
+		obj_free(objs[i]);
+	OPENSSL_free(objs);
+}
+
+static struct obj **objects_dup(struct obj **objs, CK_ULONG nobjs)
+{
+	struct obj **dup;
+	CK_ULONG i;
+
+	dup = OPENSSL_zalloc(sizeof(struct obj *) * nobjs);
+	if (!dup)
+		return NULL;
+
+	for (i = 0; i < nobjs; i++) {
+		dup[i] = obj_dup(objs[i]);
+		if (!dup[i]) {
+			objects_free(dup, nobjs);
+			return NULL;
 		}
+	}
 
-		found = sid;
+	return dup;
+}
+
+/* replaces the pin of the objects, NULL removes it */
+static int objects_set_pin(struct obj **objs, CK_ULONG nobjs, const char *pin)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < nobjs; i++) {
+		if (objs[i]->pin)
+			OPENSSL_clear_free(objs[i]->pin, strlen(objs[i]->pin));
+		objs[i]->pin = pin ? OPENSSL_strdup(pin) : NULL;
+		if (pin && !objs[i]->pin)
+			return OSSL_RV_ERR;
 	}
 
-	rv = found;
+	return OSSL_RV_OK;
+}
+
+static void cache_entry_free(struct store_cache_entry *e)
+{
+	if (!e)
+		return;
+
+	objects_free(e->objects, e->nobjects);
+	OPENSSL_free(e->uri);
+	OPENSSL_clear_free(e, sizeof(*e));
+}
+
+/* md = SHA-256(salt || pin) */
+static int cache_pin_digest(struct store_ctx *sctx, const unsigned char *salt,
+			    unsigned char md[CACHE_PIN_MD_LEN])
+{
+	const char *pin = sctx->puri->pin;
+	EVP_MD_CTX *mdctx = NULL;
+	unsigned int mdlen = 0;
+	EVP_MD *sha256;
+	int rv = OSSL_RV_ERR;
+
+	sha256 = EVP_MD_fetch(sctx->pctx->core.libctx, "SHA256", NULL);
+	if (!sha256)
+		goto out;
+
+	mdctx = EVP_MD_CTX_new();
+	if (!mdctx ||
+	    !EVP_DigestInit_ex2(mdctx, sha256, NULL) ||
+	    !EVP_DigestUpdate(mdctx, salt, CACHE_PIN_SALT_LEN) ||
+	    !EVP_DigestUpdate(mdctx, pin, strlen(pin)) ||
+	    !EVP_DigestFinal_ex(mdctx, md, &mdlen) ||
+	    (mdlen != CACHE_PIN_MD_LEN))
+		goto out;
+
+	rv = OSSL_RV_OK;
 out:
-	OPENSSL_free(slots);
+	EVP_MD_CTX_free(mdctx);
+	EVP_MD_free(sha256);
 	return rv;
 }
 
-static int lookup_objects(struct store_ctx *sctx,
-			  OSSL_PASSPHRASE_CALLBACK *pw_cb,
-			  void *pw_cbarg)
+static bool cache_entry_valid(struct pkcs11_module *pkcs,
+			      struct store_cache_entry *e, time_t now)
 {
-	struct pkcs11_module *pkcs11 = &sctx->pctx->pkcs11;
-	CK_SESSION_HANDLE sh = CK_INVALID_HANDLE;
-	struct parsed_uri *puri = sctx->puri;
-	CK_OBJECT_HANDLE_PTR handles = NULL;
+	return (now < e->expires) &&
+	       (e->fork_gen == atfork_generation()) &&
+	       (e->token_gen == pkcs11_token_generation(pkcs));
+}
+
+/* unlink and free expired entries and entries beyond max */
+static void cache_expire(struct pkcs11_module *pkcs, unsigned int max)
+{
+	struct store_cache *cache = &pkcs->scache;
+	struct store_cache_entry **pe, *e;
+	time_t now = _now();
+	unsigned int n = 0;
+
+	pe = &cache->entries;
+	while ((e = *pe)) {
+		if ((n < max) && cache_entry_valid(pkcs, e, now)) {
+			pe = &e->next;
+			n++;
+			continue;
+		}
+		*pe = e->next;
+		cache_entry_free(e);
+		cache->nentries--;
+	}
+}
+
+static int store_cache_lookup(struct store_ctx *sctx)
+{
+	struct pkcs11_module *pkcs = &sctx->pctx->pkcs11;
+	struct store_cache *cache = &pkcs->scache;
 	struct dbg *dbg = &sctx->pctx->dbg;
+	unsigned char md[CACHE_PIN_MD_LEN];
+	struct store_cache_entry *e;
 	int rv = OSSL_RV_ERR;
-	CK_ULONG nhandles;
 
-	if (!puri->pin)
-		puri->pin = pin_from_cb(pw_cb, pw_cbarg, sctx->slot_login_info);
+	if (!sctx->cache_uri)
+		return OSSL_RV_ERR;
 
-	if (pkcs11_session_open_login(pkcs11, sctx->slot_id, &sh,
-				      puri->pin, dbg) != CKR_OK)
+	pthread_mutex_lock(&cache->mutex);
+	cache_expire(pkcs, PS_STORE_CACHE_MAX);
+
+	/* at most one entry per uri, see store_cache_add() */
+	for (e = cache->entries; e; e = e->next) {
+		if (!strcmp(e->uri, sctx->cache_uri))
+			break;
+	}
+
+	if (e && ((cache_pin_digest(sctx, e->pin_salt, md) != OSSL_RV_OK) ||
+		  CRYPTO_memcmp(md, e->pin_md, CACHE_PIN_MD_LEN)))
+		e = NULL;
+	OPENSSL_cleanse(md, sizeof(md));
+
+	if (!e) {
+		cache->misses++;
+		goto out;
+	}
+
+	sctx->objects = objects_dup(e->objects, e->nobjects);
+	if (!sctx->objects)
+		goto out;
+	if (objects_set_pin(sctx->objects, e->nobjects,
+			    sctx->puri->pin) != OSSL_RV_OK) {
+		objects_free(sctx->objects, e->nobjects);
+		sctx->objects = NULL;
+		goto out;
+	}
+	sctx->nobjects = e->nobjects;
+	sctx->objects_size = e->nobjects;
+	sctx->slot_id = e->slot_id;
+	sctx->load_idx = 0;
+	sctx->objects_loaded = true;
+	sctx->search_done = true;
+
+	cache->hits++;
+	rv = OSSL_RV_OK;
+out:
+	pthread_mutex_unlock(&cache->mutex);
+
+	ps_dbg_debug(dbg, "sctx: %p, uri: %s, cache %s", sctx,
+		     sctx->cache_uri, (rv == OSSL_RV_OK) ? "hit" : "miss");
+	return rv;
+}
+
+static void store_cache_add(struct store_ctx *sctx, unsigned int fork_gen,
+			    unsigned int token_gen)
+{
+	struct pkcs11_module *pkcs = &sctx->pctx->pkcs11;
+	struct store_cache *cache = &pkcs->scache;
+	struct store_cache_entry *e, **pe;
+
+	if (!sctx->cache_uri)
+		return;
+
+	e = OPENSSL_zalloc(sizeof(*e));
+	if (!e)
+		return;
+
+	e->uri = OPENSSL_strdup(sctx->cache_uri);
+	e->objects = objects_dup(sctx->objects, sctx->nobjects);
+	if (!e->uri || !e->objects ||
+	    (objects_set_pin(e->objects, sctx->nobjects, NULL) != OSSL_RV_OK) ||
+	    (RAND_bytes_ex(sctx->pctx->core.libctx, e->pin_salt,
+			   CACHE_PIN_SALT_LEN, 0) != 1) ||
+	    (cache_pin_digest(sctx, e->pin_salt, e->pin_md) != OSSL_RV_OK)) {
+		cache_entry_free(e);
+		return;
+	}
+	e->nobjects = sctx->nobjects;
+	e->slot_id = sctx->slot_id;
+	e->expires = _now() + cache->ttl;
+	e->fork_gen = fork_gen;
+	e->token_gen = token_gen;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/* replace an entry of the same uri */
+	for (pe = &cache->entries; *pe; pe = &(*pe)->next) {
+		if (!strcmp((*pe)->uri, e->uri)) {
+			struct store_cache_entry *old = *pe;
+
+			*pe = old->next;
+			cache_entry_free(old);
+			cache->nentries--;
+			break;
+		}
+	}
+
+	e->next = cache->entries;
+	cache->entries = e;
+	cache->nentries++;
+	cache_expire(pkcs, PS_STORE_CACHE_MAX);
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+int store_cache_init(struct pkcs11_module *pkcs, unsigned int ttl,
+		     struct dbg *dbg)
+{
+	struct store_cache *cache = &pkcs->scache;
+	int rc;
+
+	cache->entries = NULL;
+	cache->nentries = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+
+	if (!ttl)
+		return OSSL_RV_OK;
+
+	rc = pthread_mutex_init(&cache->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
 		return OSSL_RV_ERR;
+	}
+	cache->ttl = ttl;
+
+	ps_dbg_debug(dbg, "pkcs: %p, store cache ttl: %u", pkcs, ttl);
+	return OSSL_RV_OK;
+}
+
+void store_cache_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct store_cache *cache = &pkcs->scache;
+	struct store_cache_entry *e;
+
+	if (!cache->ttl)
+		return;
+
+	pthread_mutex_lock(&cache->mutex);
+	while ((e = cache->entries)) {
+		cache->entries = e->next;
+		cache_entry_free(e);
+	}
+	cache->nentries = 0;
+	pthread_mutex_unlock(&cache->mutex);
 
-	if (pkcs11_find_objects(pkcs11, sh,
-				puri->obj_object, puri->obj_id.p,
-				puri->obj_id.plen, puri->obj_type,
-				&handles, &nhandles, dbg) != CKR_OK)
+	ps_dbg_info(dbg, "pkcs: %p, store cache: ttl: %u, hits: %lu, misses: %lu",
+		    pkcs, cache->ttl, cache->hits, cache->misses);
+
+	cache->ttl = 0;
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+void store_cache_lock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->scache.ttl)
+		pthread_mutex_lock(&pkcs->scache.mutex);
+}
+
+void store_cache_unlock(struct pkcs11_module *pkcs)
+{
+	if (pkcs->scache.ttl)
+		pthread_mutex_unlock(&pkcs->scache.mutex);
+}
+
+static void search_end(struct store_ctx *sctx)
+{
+	struct pkcs11_module *pkcs11 = &sctx->pctx->pkcs11;
+	struct dbg *dbg = &sctx->pctx->dbg;
+
+	if (sctx->sh != CK_INVALID_HANDLE) {
+		if (sctx->find_active)
+			pkcs11_find_objects_final(pkcs11, sctx->sh, dbg);
+		pkcs11_session_close(pkcs11, &sctx->sh, dbg);
+	}
+	sctx->find_active = false;
+	OPENSSL_free(sctx->handles);
+	sctx->handles = NULL;
+	sctx->nhandles = 0;
+	sctx->handle_idx = 0;
+	sctx->search_done = true;
+}
+
+static bool objects_skip(struct store_ctx *sctx, CK_OBJECT_HANDLE handle)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < sctx->nskip; i++) {
+		if (obj_get_handle(sctx->objects[i]) == handle)
+			return true;
+	}
+	return false;
+}
+
+static int search_init(struct store_ctx *sctx, bool use_index);
+
+/*
+ * Fetches the next handle of the search (find-batch handles at a time,
+ * unless all are from the key index) and the attributes of its object.
+ * A failed handle from the key index restarts the search on the token.
+ * Returns NULL at the end of the search or on error.
+ */
+static struct obj *search_next(struct store_ctx *sctx)
+{
+	struct pkcs11_module *pkcs11 = &sctx->pctx->pkcs11;
+	struct dbg *dbg = &sctx->pctx->dbg;
+	CK_OBJECT_HANDLE handle;
+	struct obj *obj;
+
+	if (sctx->search_done)
+		return NULL;
+
+next:
+	if (sctx->handle_idx == sctx->nhandles) {
+		sctx->nhandles = 0;
+		if (sctx->find_active &&
+		    (pkcs11_find_objects_next(pkcs11, sctx->sh, sctx->handles,
+					      pkcs11_find_batch(pkcs11),
+					      &sctx->nhandles, dbg) != CKR_OK))
+			goto err;
+		sctx->handle_idx = 0;
+
+		if (!sctx->nhandles) {
+			ps_dbg_debug(dbg, "sctx: %p, %lu objects found",
+				     sctx, sctx->nobjects);
+			search_end(sctx);
+			if (sctx->nobjects)
+				store_cache_add(sctx, sctx->fork_gen,
+						sctx->token_gen);
+			return NULL;
+		}
+	}
+
+	handle = sctx->handles[sctx->handle_idx++];
+	if (objects_skip(sctx, handle))
+		goto next;
+
+	obj = load_object_handle(sctx, handle);
+	if (!obj)
 		goto err;
 
-	if (nhandles== 0) {
-		ps_dbg_error(dbg, "sctx: %p, no objects found in slot %d",
-			     sctx, sctx->slot_id);
+	if (objects_append(sctx, obj) != OSSL_RV_OK) {
+		obj_free(obj);
 		goto err;
 	}
 
+	if (!sctx->indexed)
+		key_index_add(pkcs11, sctx->slot_id, obj);
+
+	return obj;
+err:
+	ps_dbg_error(dbg, "sctx: %p, slot %lu failed to load objects",
+		     sctx, sctx->slot_id);
+	search_end(sctx);
+
+	/* stale key index, search again for the remaining objects */
+	if (sctx->indexed) {
+		sctx->nskip = sctx->nobjects;
+		if (search_init(sctx, false) == OSSL_RV_OK)
+			return search_next(sctx);
+	}
+	return NULL;
+}
+
+/* returns the next loadable object, without consuming it */
+static struct obj *peek_loadable_object(struct store_ctx *sctx)
+{
+	struct obj *o;
+
+	while (1) {
+		if (sctx->load_idx < sctx->nobjects)
+			o = sctx->objects[sctx->load_idx];
+		else if (!(o = search_next(sctx)))
+			return NULL;
+
+		/* TODO add certificate support */
+		switch (obj_get_class(o)) {
+		case CKO_PUBLIC_KEY:
+		case CKO_PRIVATE_KEY:
+			return o;
+		default:
+			sctx->load_idx++;
+			continue;
+		}
+	}
+}
+
+static struct obj *get_next_loadable_object(struct store_ctx *sctx)
+{
+	struct obj *o;
+
+	o = peek_loadable_object(sctx);
+	if (o)
+		sctx->load_idx++;
+
+	return o;
+}
+
+/*
+ * Starts the object search. The handles are taken from the key index, if
+ * enabled, else from C_FindObjects().
+ */
+static int search_init(struct store_ctx *sctx, bool use_index)
+{
+	struct pkcs11_module *pkcs11 = &sctx->pctx->pkcs11;
+	struct parsed_uri *puri = sctx->puri;
+	struct dbg *dbg = &sctx->pctx->dbg;
+
+	sctx->search_done = false;
+	sctx->indexed = false;
+
+	if (pkcs11_session_open_login(pkcs11, sctx->slot_id, &sctx->sh,
+				      puri->pin, dbg) != CKR_OK)
+		goto err;
+
+	sctx->indexed = use_index &&
+		(key_index_lookup(pkcs11, sctx->slot_id, sctx->sh,
+				  puri->obj_object, puri->obj_id.p,
+				  puri->obj_id.plen, puri->obj_type,
+				  &sctx->handles, &sctx->nhandles,
+				  dbg) == OSSL_RV_OK);
+	if (!sctx->indexed) {
+		sctx->handles = OPENSSL_malloc(pkcs11_find_batch(pkcs11) *
+					       sizeof(CK_OBJECT_HANDLE));
+		if (!sctx->handles)
+			goto err;
+
+		if (pkcs11_find_objects_init(pkcs11, sctx->sh,
+					     puri->obj_object, puri->obj_id.p,
+					     puri->obj_id.plen, puri->obj_type,
+					     dbg) != CKR_OK)
+			goto err;
+		sctx->find_active = true;
+	}
+
+	return OSSL_RV_OK;
+err:
+	search_end(sctx);
+	return OSSL_RV_ERR;
+}
+
+/* starts the object search and fetches the first object */
+static int search_start(struct store_ctx *sctx, bool use_index)
+{
+	if (search_init(sctx, use_index) != OSSL_RV_OK)
+		return OSSL_RV_ERR;
+
+	if (!search_next(sctx)) {
+		search_end(sctx);
+		return OSSL_RV_ERR;
+	}
+	return OSSL_RV_OK;
+}
+
+/*
+ * Looks up the objects of the uri. The other objects are fetched by the
+ * load calls.
+ */
+static int lookup_objects(struct store_ctx *sctx,
+			  OSSL_PASSPHRASE_CALLBACK *pw_cb,
+			  void *pw_cbarg)
+{
+	struct pkcs11_module *pkcs11 = &sctx->pctx->pkcs11;
+	struct parsed_uri *puri = sctx->puri;
+	struct dbg *dbg = &sctx->pctx->dbg;
+
+	if (sctx->objects_loaded)
+		return OSSL_RV_OK;
+	if (sctx->search_done)
+		return OSSL_RV_ERR;
+
+	if (!puri->pin)
+		puri->pin = pin_from_cb(pw_cb, pw_cbarg, sctx->slot_login_info);
+
+	/* token events during the lookup make it stale */
+	sctx->fork_gen = atfork_generation();
+	sctx->token_gen = pkcs11_token_generation(pkcs11);
+
 	sctx->load_idx = 0;
-	if (load_object_handles(sctx, sh, handles, nhandles) != OSSL_RV_OK) {
-		ps_dbg_error(dbg, "sctx: %p, slot %d failed to load object handles",
+	if (search_start(sctx, true) != OSSL_RV_OK) {
+		/* failed lookups are not repeated, see ps_store_eof() */
+		ps_dbg_error(dbg, "sctx: %p, no objects found in slot %lu",
 			     sctx, sctx->slot_id);
-		goto err;
+		return OSSL_RV_ERR;
 	}
 
 	sctx->objects_loaded = true;
-	rv = OSSL_RV_OK;
-err:
-	pkcs11_session_close(&sctx->pctx->pkcs11, &sh, dbg);
-	OPENSSL_free(handles);
-	return rv;
+	return OSSL_RV_OK;
 }
 
 static int store_ctx_open(struct store_ctx *sctx, const char *uri)
@@ -419,6 +967,13 @@ static int store_ctx_open(struct store_ctx *sctx, const char *uri)
 		return OSSL_RV_ERR;
 	}
 
+	/* uris without pin are not cached (pin from callback) */
+	if (pkcs11->scache.ttl && sctx->puri->pin) {
+		sctx->cache_uri = parsed_uri_normalize(sctx->puri);
+		if (store_cache_lookup(sctx) == OSSL_RV_OK)
+			return OSSL_RV_OK;
+	}
+
 	if (handle_pkcs11_module(sctx)) {
 		ps_dbg_error(dbg, "sctx: %p, pkcs11 module handling failed. uri: %s",
 			     sctx, uri);
@@ -453,7 +1008,10 @@ static void store_ctx_free(struct store_ctx *sctx)
 	if (!sctx)
 		return;
 
+	/* incomplete results are not cached, see search_next() */
+	search_end(sctx);
 	parsed_uri_free(sctx->puri);
+	OPENSSL_free(sctx->cache_uri);
 	for (i = 0; i < sctx->nobjects; i++) {
 		obj_free(sctx->objects[i]);
 	}
@@ -473,6 +1031,7 @@ static struct store_ctx *store_ctx_init(struct provider_ctx *pctx)
 	sctx->pctx = pctx;
 	sctx->slot_id = CK_UNAVAILABLE_INFORMATION;
 	sctx->objects_loaded = false;
+	sctx->sh = CK_INVALID_HANDLE;
 
 	return sctx;
 }
@@ -599,8 +1158,11 @@ static int ps_store_eof(void *vctx)
 	ps_dbg_debug(dbg, "sctx: %p, pctx: %p, entry",
 		     sctx, sctx->pctx);
 
-	rv = (!sctx->objects_loaded || (sctx->load_idx < sctx->nobjects)) ?
-		OSSL_RV_FALSE : OSSL_RV_TRUE;
+	/* lookup pending (needs the passphrase callback of the load) */
+	if (!sctx->objects_loaded)
+		rv = sctx->search_done ? OSSL_RV_TRUE : OSSL_RV_FALSE;
+	else
+		rv = peek_loadable_object(sctx) ? OSSL_RV_FALSE : OSSL_RV_TRUE;
 
 	ps_dbg_debug(dbg, "sctx: %p, pctx: %p, exit: %d",
 		     sctx, sctx->pctx, rv);
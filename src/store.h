@@ -6,6 +6,18 @@
 #ifndef _PKCS11SIGN_STORE_H
 #define _PKCS11SIGN_STORE_H
 
+#include "common.h"
+#include "debug.h"
+
+#define PS_STORE_CACHE_TTL_DEFAULT	0
+#define PS_STORE_CACHE_MAX		64
+
 extern const OSSL_ALGORITHM ps_store[];
 
+int store_cache_init(struct pkcs11_module *pkcs, unsigned int ttl,
+		     struct dbg *dbg);
+void store_cache_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void store_cache_lock(struct pkcs11_module *pkcs);
+void store_cache_unlock(struct pkcs11_module *pkcs);
+
 #endif /* _PKCS11SIGN_STORE_H */
@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <ctype.h>
 #include <string.h>
 #include <openssl/bio.h>
 #include <openssl/crypto.h>
@@ -269,6 +270,78 @@ static int parse(char *uri, struct parsed_uri *puri)
 	return 0;
 }
 
+struct normalized {
+	BIO *b;
+	const char *sep;
+};
+
+/* all bytes except unreserved characters (RFC 3986) are pct-encoded */
+static void normalize_attr(struct normalized *n, const char *attr,
+			   const char *val, size_t vlen, const char *next_sep)
+{
+	const unsigned char *v = (const unsigned char *)val;
+	size_t i;
+
+	if (!val)
+		return;
+
+	BIO_printf(n->b, "%s%s", n->sep, attr);
+	for (i = 0; i < vlen; i++) {
+		if (isalnum(v[i]) || strchr("-._~", v[i]))
+			BIO_write(n->b, &v[i], 1);
+		else
+			BIO_printf(n->b, "%%%02X", v[i]);
+	}
+	n->sep = next_sep;
+}
+
+#define NORM_PATTR(n, key, val) \
+	normalize_attr(n, key, val, (val) ? strlen(val) : 0, SEP_PATHATTRS)
+#define NORM_QATTR(n, key, val) \
+	normalize_attr(n, key, val, (val) ? strlen(val) : 0, SEP_QUERYATTRS)
+
+/*
+ * Returns the uri with its attributes decoded, encoded again and sorted
+ * by a fixed order. Unsupported attributes and the pin are not included.
+ */
+char *parsed_uri_normalize(const struct parsed_uri *puri)
+{
+	struct normalized n = { .sep = "" };
+	char *rv = NULL, *data;
+	long len;
+
+	n.b = BIO_new(BIO_s_mem());
+	if (!n.b)
+		return NULL;
+
+	BIO_puts(n.b, URI_PROTOCOL);
+	NORM_PATTR(&n, URI_P_LIBMANUF, puri->lib_manuf);
+	NORM_PATTR(&n, URI_P_LIBDESC, puri->lib_desc);
+	NORM_PATTR(&n, URI_P_LIBVER, puri->lib_ver);
+	NORM_PATTR(&n, URI_P_SLOTMANUF, puri->slt_manuf);
+	NORM_PATTR(&n, URI_P_SLOTDESC, puri->slt_desc);
+	NORM_PATTR(&n, URI_P_SLOTID, puri->slt_id);
+	NORM_PATTR(&n, URI_P_TOKTOKEN, puri->tok_token);
+	NORM_PATTR(&n, URI_P_TOKMANUF, puri->tok_manuf);
+	NORM_PATTR(&n, URI_P_TOKSERIAL, puri->tok_serial);
+	NORM_PATTR(&n, URI_P_TOKMODEL, puri->tok_model);
+	NORM_PATTR(&n, URI_P_OBJOBJECT, puri->obj_object);
+	NORM_PATTR(&n, URI_P_OBJTYPE, puri->obj_type);
+	normalize_attr(&n, URI_P_OBJID, puri->obj_id.p, puri->obj_id.plen,
+		       SEP_PATHATTRS);
+
+	n.sep = SEP_PATHQUERY;
+	NORM_QATTR(&n, URI_Q_MODNAME, puri->mod_name);
+	NORM_QATTR(&n, URI_Q_MODPATH, puri->mod_path);
+
+	len = BIO_get_mem_data(n.b, &data);
+	if (len > 0)
+		rv = OPENSSL_strndup(data, len);
+
+	BIO_free(n.b);
+	return rv;
+}
+
 void parsed_uri_free(struct parsed_uri *puri)
 {
 	if (!puri)
@@ -58,5 +58,6 @@ struct parsed_uri {
 
 struct parsed_uri *parsed_uri_new(const char *uri);
 void parsed_uri_free(struct parsed_uri *puri);
+char *parsed_uri_normalize(const struct parsed_uri *puri);
 
 #endif /*  _PKCS11SIGN_URI_H */
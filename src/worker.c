@@ -0,0 +1,750 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <openssl/async.h>
+#include <openssl/crypto.h>
+
+#include "pkcs11.h"
+#include "session.h"
+#include "worker.h"
+
+/*
+ * Token operations of an ASYNC_JOB (e.g. SSL_MODE_ASYNC) are handed over
+ * to provider worker threads. The job waits on an eventfd, which is
+ * exposed in its ASYNC_WAIT_CTX, and pauses until the worker has finished
+ * the operation. Outside of an ASYNC_JOB, operations run in the calling
+ * thread.
+ *
+ * Slots with a configured worker queue run all token operations by the
+ * workers of the queue, which own their sessions. Synchronous callers
+ * wait until the operation is finished, asynchronous callers pause as
+ * above. The bounded queue caps the token concurrency per slot. If it is
+ * full, synchronous callers wait for room, while requests of jobs are kept
+ * in a pending list: the thread of the event loop never blocks.
+ */
+
+static const int worker_wait_key;
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Signal completion, req is owned by the caller again afterwards. A job,
+ * which sees done, may finish and close its wait fd at once: the worker
+ * writes to its own copy of the fd.
+ */
+static void _worker_done(struct worker_req *req, pthread_mutex_t *mutex)
+{
+	uint64_t one = 1;
+	int fd = req->wake_fd;
+
+	if (fd < 0) {
+		pthread_mutex_lock(mutex);
+		req->done = true;
+		pthread_cond_signal(&req->cond);
+		pthread_mutex_unlock(mutex);
+		return;
+	}
+
+	__atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+	if (write(fd, &one, sizeof(one)) < 0) {
+		/* the job checks done on each resume */
+	}
+	close(fd);
+}
+
+static void *_worker_main(void *arg)
+{
+	struct worker_pool *pool = arg;
+	struct worker_req *req;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (!pool->head)
+			break;
+
+		req = pool->head;
+		pool->head = req->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		req->fn(req->arg);
+		_worker_done(req, &pool->mutex);
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/* start the threads on first use (locked) */
+static int _threads_start(pthread_t **threads, unsigned int nthreads,
+			  unsigned int *nstarted, void *(*fn)(void *),
+			  void *arg, struct dbg *dbg)
+{
+	int rc;
+
+	if (*nstarted)
+		return OSSL_RV_OK;
+
+	if (!*threads) {
+		*threads = OPENSSL_zalloc(nthreads * sizeof(pthread_t));
+		if (!*threads)
+			return OSSL_RV_ERR;
+	}
+
+	while (*nstarted < nthreads) {
+		rc = pthread_create(&(*threads)[*nstarted], NULL, fn, arg);
+		if (rc) {
+			ps_dbg_error(dbg, "pthread_create() failed: %d", rc);
+			break;
+		}
+		(*nstarted)++;
+	}
+
+	return *nstarted ? OSSL_RV_OK : OSSL_RV_ERR;
+}
+
+static int _worker_submit(struct worker_pool *pool, struct worker_req *req,
+			  struct dbg *dbg)
+{
+	int rv = OSSL_RV_ERR;
+
+	if (pthread_mutex_lock(&pool->mutex))
+		return OSSL_RV_ERR;
+
+	/* ----- locked ----- */
+	if (pool->stop ||
+	    (_threads_start(&pool->threads, pool->nthreads, &pool->nstarted,
+			    _worker_main, pool, dbg) != OSSL_RV_OK))
+		goto unlock;
+
+	req->next = NULL;
+	if (pool->tail)
+		pool->tail->next = req;
+	else
+		pool->head = req;
+	pool->tail = req;
+
+	pthread_cond_signal(&pool->cond);
+	rv = OSSL_RV_OK;
+unlock:
+	pthread_mutex_unlock(&pool->mutex);
+	/* ----- unlocked ----- */
+
+	return rv;
+}
+
+static void _wait_fd_cleanup(ASYNC_WAIT_CTX *waitctx __unused,
+			     const void *key __unused,
+			     OSSL_ASYNC_FD fd, void *custom __unused)
+{
+	close(fd);
+}
+
+/* eventfd of the current ASYNC_JOB, -1 if not within a job */
+static int _wait_fd(struct dbg *dbg)
+{
+	ASYNC_WAIT_CTX *waitctx;
+	OSSL_ASYNC_FD fd;
+	ASYNC_JOB *job;
+	void *custom;
+
+	job = ASYNC_get_current_job();
+	if (!job)
+		return -1;
+
+	waitctx = ASYNC_get_wait_ctx(job);
+	if (!waitctx)
+		return -1;
+
+	if (ASYNC_WAIT_CTX_get_fd(waitctx, &worker_wait_key, &fd, &custom))
+		return fd;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		ps_dbg_error(dbg, "eventfd() failed");
+		return -1;
+	}
+
+	if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, &worker_wait_key, fd,
+					NULL, _wait_fd_cleanup)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Wait fd of the current ASYNC_JOB for req, with a copy for the worker.
+ * Returns OSSL_RV_ERR, if not within a job.
+ */
+static int _req_wait_fd(struct worker_req *req, struct dbg *dbg)
+{
+	req->fd = _wait_fd(dbg);
+	if (req->fd < 0)
+		return OSSL_RV_ERR;
+
+	req->wake_fd = fcntl(req->fd, F_DUPFD_CLOEXEC, 0);
+	if (req->wake_fd < 0) {
+		ps_dbg_error(dbg, "dup() of wait fd failed: %d", errno);
+		req->fd = -1;
+		return OSSL_RV_ERR;
+	}
+
+	return OSSL_RV_OK;
+}
+
+/* submit failed, the worker does not own the copy */
+static void _req_wait_fd_release(struct worker_req *req)
+{
+	if (req->wake_fd >= 0)
+		close(req->wake_fd);
+	req->wake_fd = -1;
+}
+
+static void _wait_fd_drain(int fd)
+{
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0) {
+		/* nothing to drain */
+	}
+}
+
+/* pause the current ASYNC_JOB, until req is done */
+static void _wait_async(struct worker_req *req)
+{
+	struct pollfd pfd;
+
+	while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+		if (!ASYNC_pause_job()) {
+			/* unable to pause, wait for the worker */
+			pfd.fd = req->fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+		}
+		_wait_fd_drain(req->fd);
+	}
+}
+
+/*
+ * Run a request of a slot queue with the session of the worker. The
+ * session of the operation context is restored afterwards. A worker
+ * session, which may still have an active operation, is closed.
+ */
+static void _queue_run(struct worker_queue *wq, struct worker_req *req,
+		       CK_SESSION_HANDLE *hsession)
+{
+	struct op_ctx *opctx = req->opctx;
+	struct session_tslot *tslot;
+	CK_SESSION_HANDLE hsave;
+	CK_SLOT_ID ssave;
+	bool dirty;
+
+	op_ctx_fork_check(opctx);
+
+	if ((*hsession == CK_INVALID_HANDLE) &&
+	    (session_pool_get(wq->pkcs, wq->slot_id, opctx->key->pin,
+			      hsession, wq->dbg) != CKR_OK)) {
+		ps_dbg_error(wq->dbg, "slot: %lu, session_pool_get() failed",
+			     wq->slot_id);
+		return;
+	}
+
+	hsave = opctx->hsession;
+	ssave = opctx->hsession_slot;
+	tslot = opctx->tslot;
+	dirty = opctx->hsession_dirty;
+
+	opctx->hsession = *hsession;
+	opctx->hsession_slot = wq->slot_id;
+	opctx->tslot = NULL;
+	opctx->hsession_dirty = false;
+
+	if (op_ctx_object_ensure(opctx) == OSSL_RV_OK) {
+		req->fn(req->arg);
+		req->rv = OSSL_RV_OK;
+	}
+
+	if (opctx->hsession_dirty)
+		pkcs11_session_close(wq->pkcs, hsession, wq->dbg);
+
+	opctx->hsession = hsave;
+	opctx->hsession_slot = ssave;
+	opctx->tslot = tslot;
+	opctx->hsession_dirty = dirty;
+}
+
+/* append req to the ring (locked, ring not full) */
+static void _queue_put(struct worker_queue *wq, struct worker_req *req)
+{
+	unsigned int tail;
+
+	tail = (wq->head + wq->count) % wq->size;
+	wq->ring[tail] = req;
+	wq->count++;
+
+	if (wq->count > wq->depth_max)
+		wq->depth_max = wq->count;
+}
+
+/* oldest request of a job waiting for room (locked) */
+static struct worker_req *_pending_get(struct worker_queue *wq)
+{
+	struct worker_req *req = wq->pending_head;
+
+	wq->pending_head = req->next;
+	if (!wq->pending_head)
+		wq->pending_tail = NULL;
+	return req;
+}
+
+static void *_queue_main(void *arg)
+{
+	CK_SESSION_HANDLE hsession = CK_INVALID_HANDLE;
+	struct worker_queue *wq = arg;
+	struct worker_req *req;
+	uint64_t start, end;
+
+	pthread_mutex_lock(&wq->mutex);
+	for (;;) {
+		while (!wq->count && !wq->stop)
+			pthread_cond_wait(&wq->not_empty, &wq->mutex);
+		if (!wq->count)
+			break;
+
+		req = wq->ring[wq->head];
+		wq->head = (wq->head + 1) % wq->size;
+		wq->count--;
+		if (wq->pending_head)
+			_queue_put(wq, _pending_get(wq));
+		else
+			pthread_cond_signal(&wq->not_full);
+		pthread_mutex_unlock(&wq->mutex);
+
+		start = _now_ns();
+		_queue_run(wq, req, &hsession);
+		end = _now_ns();
+
+		pthread_mutex_lock(&wq->mutex);
+		wq->wait_ns += start - req->queued_ns;
+		wq->service_ns += end - start;
+		pthread_mutex_unlock(&wq->mutex);
+
+		_worker_done(req, &wq->mutex);
+
+		pthread_mutex_lock(&wq->mutex);
+	}
+	pthread_mutex_unlock(&wq->mutex);
+
+	session_pool_put(wq->pkcs, wq->slot_id, &hsession, wq->dbg);
+	return NULL;
+}
+
+/*
+ * Queue req. If the ring is full, a synchronous caller waits for room. A
+ * request of an ASYNC_JOB (wake_fd set) must not block the thread of the
+ * event loop: it is appended to the pending list, which the workers move
+ * to the ring, and the job pauses until req is done.
+ */
+static int _queue_submit(struct worker_queue *wq, struct worker_req *req)
+{
+	int rv = OSSL_RV_ERR;
+
+	if (pthread_mutex_lock(&wq->mutex))
+		return OSSL_RV_ERR;
+
+	/* ----- locked ----- */
+	if (_threads_start(&wq->threads, wq->nthreads, &wq->nstarted,
+			   _queue_main, wq, wq->dbg) != OSSL_RV_OK)
+		goto unlock;
+
+	req->queued_ns = _now_ns();
+	req->next = NULL;
+
+	if ((wq->count == wq->size) && (req->wake_fd >= 0) && !wq->stop) {
+		if (wq->pending_tail)
+			wq->pending_tail->next = req;
+		else
+			wq->pending_head = req;
+		wq->pending_tail = req;
+		wq->nreqs++;
+		wq->npending++;
+		rv = OSSL_RV_OK;
+		goto unlock;
+	}
+
+	while ((wq->count == wq->size) && !wq->stop)
+		pthread_cond_wait(&wq->not_full, &wq->mutex);
+	if (wq->stop)
+		goto unlock;
+
+	_queue_put(wq, req);
+	wq->nreqs++;
+
+	pthread_cond_signal(&wq->not_empty);
+	rv = OSSL_RV_OK;
+unlock:
+	pthread_mutex_unlock(&wq->mutex);
+	/* ----- unlocked ----- */
+
+	return rv;
+}
+
+static struct worker_queue *_queue_new(struct pkcs11_module *pkcs,
+				       CK_SLOT_ID slot_id,
+				       unsigned int nthreads,
+				       unsigned int size,
+				       struct dbg *dbg)
+{
+	struct worker_queue *wq;
+
+	wq = OPENSSL_zalloc(sizeof(struct worker_queue));
+	if (!wq)
+		return NULL;
+
+	wq->ring = OPENSSL_zalloc(size * sizeof(struct worker_req *));
+	if (!wq->ring) {
+		OPENSSL_free(wq);
+		return NULL;
+	}
+
+	pthread_mutex_init(&wq->mutex, NULL);
+	pthread_cond_init(&wq->not_empty, NULL);
+	pthread_cond_init(&wq->not_full, NULL);
+
+	wq->pkcs = pkcs;
+	wq->dbg = dbg;
+	wq->slot_id = slot_id;
+	wq->size = size;
+	wq->nthreads = nthreads;
+
+	return wq;
+}
+
+static void _queue_free(struct worker_queue *wq)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&wq->mutex);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->not_empty);
+	pthread_cond_broadcast(&wq->not_full);
+	pthread_mutex_unlock(&wq->mutex);
+
+	for (i = 0; i < wq->nstarted; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	ps_dbg_info(wq->dbg, "slot: %lu, worker queue: requests: %lu, "
+		    "pending (queue full): %lu, max depth: %u/%u, "
+		    "avg wait: %lu ns, avg service: %lu ns",
+		    wq->slot_id, wq->nreqs, wq->npending, wq->depth_max, wq->size,
+		    wq->nreqs ? wq->wait_ns / wq->nreqs : 0,
+		    wq->nreqs ? wq->service_ns / wq->nreqs : 0);
+
+	pthread_cond_destroy(&wq->not_full);
+	pthread_cond_destroy(&wq->not_empty);
+	pthread_mutex_destroy(&wq->mutex);
+
+	OPENSSL_free(wq->threads);
+	OPENSSL_free(wq->ring);
+	OPENSSL_free(wq);
+}
+
+/*
+ * Parse the slot worker configuration, a comma-separated list of
+ * <slot>:<threads>[:<queue size>] entries.
+ */
+static int _queues_parse(struct pkcs11_module *pkcs, const char *spec,
+			 struct dbg *dbg)
+{
+	struct worker_pool *pool = &pkcs->wpool;
+	struct worker_queue *wq;
+	const char *p = spec;
+	unsigned long val[3];
+	unsigned int n;
+	char *end;
+
+	while (*p) {
+		for (n = 0; n < 3; n++) {
+			if ((*p < '0') || (*p > '9'))
+				goto err;
+			errno = 0;
+			val[n] = strtoul(p, &end, 10);
+			if (errno)
+				goto err;
+			p = end;
+			if (*p != ':')
+				break;
+			p++;
+		}
+		if ((n < 1) || (n > 2) || (*p && (*p != ',')))
+			goto err;
+		if (*p)
+			p++;
+
+		if (n == 1)
+			val[2] = PS_WORKER_QUEUE_DEFAULT;
+		if (!val[1] || (val[1] > PS_WORKER_THREADS_MAX) ||
+		    !val[2] || (val[2] > PS_WORKER_QUEUE_MAX))
+			goto err;
+
+		if (worker_queue_get(pkcs, val[0]))
+			goto err;
+
+		wq = _queue_new(pkcs, val[0], val[1], val[2], dbg);
+		if (!wq)
+			return OSSL_RV_ERR;
+		wq->next = pool->queues;
+		pool->queues = wq;
+
+		ps_dbg_debug(dbg, "pkcs: %p, slot: %lu, workers: %lu, queue: %lu",
+			     pkcs, val[0], val[1], val[2]);
+	}
+
+	return OSSL_RV_OK;
+err:
+	ps_dbg_error(dbg, "pkcs: %p, invalid slot workers: %s", pkcs, spec);
+	return OSSL_RV_ERR;
+}
+
+int worker_pool_init(struct pkcs11_module *pkcs, unsigned int nthreads,
+		     const char *slots, struct dbg *dbg)
+{
+	struct worker_pool *pool = &pkcs->wpool;
+	int rc;
+
+	rc = pthread_mutex_init(&pool->mutex, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_mutex_init() failed: %d",
+			     pkcs, rc);
+		return OSSL_RV_ERR;
+	}
+
+	rc = pthread_cond_init(&pool->cond, NULL);
+	if (rc) {
+		ps_dbg_error(dbg, "pkcs: %p, pthread_cond_init() failed: %d",
+			     pkcs, rc);
+		pthread_mutex_destroy(&pool->mutex);
+		return OSSL_RV_ERR;
+	}
+
+	pool->nthreads = nthreads;
+	pool->nstarted = 0;
+	pool->threads = NULL;
+	pool->stop = false;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->queues = NULL;
+	pool->initialized = true;
+
+	ps_dbg_debug(dbg, "pkcs: %p, worker threads: %u", pkcs, nthreads);
+
+	if (slots)
+		return _queues_parse(pkcs, slots, dbg);
+
+	return OSSL_RV_OK;
+}
+
+void worker_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg)
+{
+	struct worker_pool *pool = &pkcs->wpool;
+	struct worker_queue *wq;
+	unsigned int i;
+
+	if (!pool->initialized)
+		return;
+
+	while (pool->queues) {
+		wq = pool->queues;
+		pool->queues = wq->next;
+		_queue_free(wq);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nstarted; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	ps_dbg_debug(dbg, "pkcs: %p, worker threads stopped: %u",
+		     pkcs, pool->nstarted);
+
+	OPENSSL_free(pool->threads);
+	pool->threads = NULL;
+	pool->nstarted = 0;
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	pool->initialized = false;
+}
+
+void worker_pool_lock(struct pkcs11_module *pkcs)
+{
+	struct worker_queue *wq;
+
+	if (!pkcs->wpool.initialized)
+		return;
+
+	pthread_mutex_lock(&pkcs->wpool.mutex);
+	for (wq = pkcs->wpool.queues; wq; wq = wq->next)
+		pthread_mutex_lock(&wq->mutex);
+}
+
+void worker_pool_unlock(struct pkcs11_module *pkcs)
+{
+	struct worker_queue *wq;
+
+	if (!pkcs->wpool.initialized)
+		return;
+
+	for (wq = pkcs->wpool.queues; wq; wq = wq->next)
+		pthread_mutex_unlock(&wq->mutex);
+	pthread_mutex_unlock(&pkcs->wpool.mutex);
+}
+
+/* worker threads do not exist in the atfork child (pool locked) */
+void worker_pool_forget(struct pkcs11_module *pkcs)
+{
+	struct worker_pool *pool = &pkcs->wpool;
+	struct worker_queue *wq;
+
+	if (!pool->initialized)
+		return;
+
+	pool->nstarted = 0;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (wq = pool->queues; wq; wq = wq->next) {
+		wq->nstarted = 0;
+		wq->head = 0;
+		wq->count = 0;
+		wq->pending_head = NULL;
+		wq->pending_tail = NULL;
+		pthread_cond_init(&wq->not_empty, NULL);
+		pthread_cond_init(&wq->not_full, NULL);
+	}
+}
+
+/* returns true, if operations of the calling thread are run by workers */
+bool worker_async(struct pkcs11_module *pkcs)
+{
+	return pkcs->wpool.initialized && pkcs->wpool.nthreads &&
+	       ASYNC_get_current_job();
+}
+
+/*
+ * Run fn(arg). Inside of an ASYNC_JOB, fn is run by a worker thread and
+ * the job is paused until it is finished.
+ */
+void worker_run(struct pkcs11_module *pkcs, worker_fn fn, void *arg,
+		struct dbg *dbg)
+{
+	struct worker_req req = {
+		.fn = fn,
+		.arg = arg,
+		.fd = -1,
+		.wake_fd = -1,
+		.done = false,
+	};
+
+	if (!worker_async(pkcs))
+		goto direct;
+
+	if (_req_wait_fd(&req, dbg) != OSSL_RV_OK)
+		goto direct;
+
+	if (_worker_submit(&pkcs->wpool, &req, dbg) != OSSL_RV_OK) {
+		_req_wait_fd_release(&req);
+		goto direct;
+	}
+
+	_wait_async(&req);
+	return;
+
+direct:
+	fn(arg);
+}
+
+/* the list of slot queues is fixed after initialization */
+struct worker_queue *worker_queue_get(struct pkcs11_module *pkcs,
+				      CK_SLOT_ID slot_id)
+{
+	struct worker_queue *wq;
+
+	for (wq = pkcs->wpool.queues; wq; wq = wq->next) {
+		if (wq->slot_id == slot_id)
+			return wq;
+	}
+
+	return NULL;
+}
+
+/*
+ * Run fn(arg) for opctx by a worker of the slot queue and wait until it
+ * is finished. Returns OSSL_RV_ERR, if fn has not been run.
+ */
+int worker_queue_run(struct worker_queue *wq, struct op_ctx *opctx,
+		     worker_fn fn, void *arg)
+{
+	struct worker_req req = {
+		.fn = fn,
+		.arg = arg,
+		.opctx = opctx,
+		.fd = -1,
+		.wake_fd = -1,
+		.done = false,
+		.rv = OSSL_RV_ERR,
+	};
+
+	if (_req_wait_fd(&req, wq->dbg) != OSSL_RV_OK)
+		pthread_cond_init(&req.cond, NULL);
+
+	if (_queue_submit(wq, &req) != OSSL_RV_OK) {
+		if (req.wake_fd >= 0)
+			_req_wait_fd_release(&req);
+		else
+			pthread_cond_destroy(&req.cond);
+		ps_dbg_error(wq->dbg, "slot: %lu, worker queue unavailable",
+			     wq->slot_id);
+		return OSSL_RV_ERR;
+	}
+
+	if (req.fd >= 0) {
+		_wait_async(&req);
+		return req.rv;
+	}
+
+	/* woken only by the worker of this request */
+	pthread_mutex_lock(&wq->mutex);
+	while (!req.done)
+		pthread_cond_wait(&req.cond, &wq->mutex);
+	pthread_mutex_unlock(&wq->mutex);
+	pthread_cond_destroy(&req.cond);
+
+	return req.rv;
+}
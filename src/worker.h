@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PKCS11SIGN_WORKER_H
+#define _PKCS11SIGN_WORKER_H
+
+#include "common.h"
+#include "debug.h"
+
+#define PS_WORKER_THREADS_DEFAULT	4
+#define PS_WORKER_THREADS_MAX		256
+#define PS_WORKER_QUEUE_DEFAULT		64
+#define PS_WORKER_QUEUE_MAX		65536
+
+typedef void (*worker_fn)(void *arg);
+
+int worker_pool_init(struct pkcs11_module *pkcs, unsigned int nthreads,
+		     const char *slots, struct dbg *dbg);
+void worker_pool_teardown(struct pkcs11_module *pkcs, struct dbg *dbg);
+void worker_pool_lock(struct pkcs11_module *pkcs);
+void worker_pool_unlock(struct pkcs11_module *pkcs);
+void worker_pool_forget(struct pkcs11_module *pkcs);
+
+bool worker_async(struct pkcs11_module *pkcs);
+void worker_run(struct pkcs11_module *pkcs, worker_fn fn, void *arg,
+		struct dbg *dbg);
+
+struct worker_queue *worker_queue_get(struct pkcs11_module *pkcs,
+				      CK_SLOT_ID slot_id);
+int worker_queue_run(struct worker_queue *wq, struct op_ctx *opctx,
+		     worker_fn fn, void *arg);
+
+#endif /* _PKCS11SIGN_WORKER_H */
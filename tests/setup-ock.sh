@@ -75,6 +75,8 @@ URI_TOKEN="pkcs11:token=${OCK_TOKEN}"
 URI_KEY_ECDSA="${URI_TOKEN};object=${URI_LABEL}"
 URI_KEY_ECDSA_PRV="${URI_KEY_ECDSA};type=private"
 URI_KEY_ECDSA_PUB="${URI_KEY_ECDSA};type=public"
+ID_ECDSA="e1"
+URI_KEY_ECDSA_ID_PRV="${URI_TOKEN};id=%${ID_ECDSA};type=private"
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --delete				\
@@ -82,6 +84,7 @@ ${P11TOOL} --delete				\
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --write --label ${LABEL}		\
+	   --id ${ID_ECDSA}			\
 	   --mark-private			\
 	   --load-privkey="${FILE_PEM_ECDSA_PRV}" \
 	   "${URI_TOKEN}" 2> /dev/null		\
@@ -89,6 +92,7 @@ ${P11TOOL} --write --label ${LABEL}		\
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --write --label ${LABEL}		\
+	   --id ${ID_ECDSA}			\
 	   --load-pubkey="${FILE_PEM_ECDSA_PUB}" \
 	   "${URI_TOKEN}" 2> /dev/null		\
 || exit 99
@@ -110,6 +114,8 @@ echo "## Re-import server keys (rsa)"
 URI_KEY_RSA4K="${URI_TOKEN};object=${LABEL}"
 URI_KEY_RSA4K_PRV="${URI_KEY_RSA4K};type=private"
 URI_KEY_RSA4K_PUB="${URI_KEY_RSA4K};type=public"
+ID_RSA4K="e2"
+URI_KEY_RSA4K_ID_PRV="${URI_TOKEN};id=%${ID_RSA4K};type=private"
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --delete				\
@@ -117,6 +123,7 @@ ${P11TOOL} --delete				\
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --write --label ${LABEL}		\
+	   --id ${ID_RSA4K}			\
 	   --mark-private			\
 	   --load-privkey=${FILE_PEM_RSA4K_PRV}	\
 	   "${URI_TOKEN}" 2> /dev/null		\
@@ -124,10 +131,47 @@ ${P11TOOL} --write --label ${LABEL}		\
 
 GNUTLS_PIN=${OCK_USER_PIN}			\
 ${P11TOOL} --write --label ${LABEL}		\
+	   --id ${ID_RSA4K}			\
 	   --load-pubkey=${FILE_PEM_RSA4K_PUB}	\
 	   "${URI_TOKEN}" 2> /dev/null		\
 || exit 99
 
+#######################################
+echo "## Generate key for the key index test (ec)"
+# imported by the test, after the key index is built
+LABEL="test_key_index"
+FILE_PEM_KEY_INDEX_PRV="${TMPPDIR}/${LABEL}_key.prv"
+FILE_PEM_KEY_INDEX_PUB="${TMPPDIR}/${LABEL}_key.pub"
+URI_KEY_INDEX="${URI_TOKEN};object=${LABEL}"
+URI_KEY_INDEX_PRV="${URI_KEY_INDEX};type=private"
+KEY_INDEX_IMPORT="${TMPPDIR}/key-index-import.sh"
+
+openssl genpkey -algorithm EC				\
+	-pkeyopt ec_paramgen_curve:prime256v1		\
+	-out "${FILE_PEM_KEY_INDEX_PRV}"		\
+|| exit 99
+
+openssl pkey -pubout					\
+	-in "${FILE_PEM_KEY_INDEX_PRV}"			\
+	-out "${FILE_PEM_KEY_INDEX_PUB}"		\
+|| exit 99
+
+# usage: key-index-import.sh import|delete
+tee > ${KEY_INDEX_IMPORT} << IMPORTSCRIPT
+#!/bin/bash
+GNUTLS_PIN=${OCK_USER_PIN}			\\
+${P11TOOL} --delete				\\
+	   "${URI_KEY_INDEX}" > /dev/null 2>&1
+test "\$1" = "import" || exit 0
+GNUTLS_PIN=${OCK_USER_PIN}			\\
+${P11TOOL} --write --label ${LABEL}		\\
+	   --mark-private			\\
+	   --load-privkey="${BASEDIR}/${FILE_PEM_KEY_INDEX_PRV}" \\
+	   "${URI_TOKEN}" > /dev/null 2>&1
+IMPORTSCRIPT
+chmod 700 ${KEY_INDEX_IMPORT} \
+|| exit 99
+
 #######################################
 echo "## Generate openssl config file"
 OPENSSL_CONF=${TMPPDIR}/pkcs11sign.cnf
@@ -137,12 +181,37 @@ sed -e "s|@libtoollibs[@]|${LIBSPATH}|g" \
         "${TESTSDIR}/../openssl.cnf.in" > ${OPENSSL_CONF} \
 || exit 99
 
+#######################################
+echo "## Generate openssl config file (key index)"
+OPENSSL_CONF_KEY_INDEX=${TMPPDIR}/pkcs11sign-key-index.cnf
+sed -e "/^pkcs11sign-forward/a pkcs11sign-key-index = 1" \
+	${OPENSSL_CONF} > ${OPENSSL_CONF_KEY_INDEX} \
+|| exit 99
+
+#######################################
+echo "## Generate openssl config file (store cache)"
+OPENSSL_CONF_STORE_CACHE=${TMPPDIR}/pkcs11sign-store-cache.cnf
+sed -e "/^pkcs11sign-forward/a pkcs11sign-store-cache-ttl = 2" \
+	${OPENSSL_CONF} > ${OPENSSL_CONF_STORE_CACHE} \
+|| exit 99
+
+#######################################
+echo "## Generate openssl config file (thread sessions)"
+OPENSSL_CONF_THREAD_SESSIONS=${TMPPDIR}/pkcs11sign-thread-sessions.cnf
+sed -e "/^pkcs11sign-forward/a pkcs11sign-session-affinity = thread" \
+    -e "/^pkcs11sign-forward/a pkcs11sign-session-max = 2" \
+	${OPENSSL_CONF} > ${OPENSSL_CONF_THREAD_SESSIONS} \
+|| exit 99
+
 #######################################
 echo "## Export tests variables to ${TMPPDIR}/setenv"
 tee > ${TMPPDIR}/setenv << DBGSCRIPT
 export TESTSDIR="${TESTSDIR}"
 export TMPPDIR="${BASEDIR}/${TMPPDIR}"
 export OPENSSL_CONF="${BASEDIR}/${OPENSSL_CONF}"
+export OPENSSL_CONF_KEY_INDEX="${BASEDIR}/${OPENSSL_CONF_KEY_INDEX}"
+export OPENSSL_CONF_STORE_CACHE="${BASEDIR}/${OPENSSL_CONF_STORE_CACHE}"
+export OPENSSL_CONF_THREAD_SESSIONS="${BASEDIR}/${OPENSSL_CONF_THREAD_SESSIONS}"
 export PIN_SOURCE=${BASEDIR}/${PIN_SOURCE}
 export FILE_PEM_CA_PRV="${BASEDIR}/${FILE_PEM_CA_PRV}"
 export FILE_PEM_CA_CRT="${BASEDIR}/${FILE_PEM_CA_CRT}"
@@ -153,12 +222,17 @@ export URI_KEY_ECDSA="${URI_KEY_ECDSA}?pin-source=${BASEDIR}/${PIN_SOURCE}"
 export URI_KEY_ECDSA_PRV_NOPIN="${URI_KEY_ECDSA_PRV}"
 export URI_KEY_ECDSA_PRV="${URI_KEY_ECDSA_PRV}?pin-source=${BASEDIR}/${PIN_SOURCE}"
 export URI_KEY_ECDSA_PUB="${URI_KEY_ECDSA_PUB}?pin-source=${BASEDIR}/${PIN_SOURCE}"
+export URI_KEY_ECDSA_ID_PRV="${URI_KEY_ECDSA_ID_PRV}?pin-source=${BASEDIR}/${PIN_SOURCE}"
 export FILE_PEM_RSA4K_PRV="${BASEDIR}/${FILE_PEM_RSA4K_PRV}"
 export FILE_PEM_RSA4K_PUB="${BASEDIR}/${FILE_PEM_RSA4K_PUB}"
 export FILE_PEM_RSA4K_CRT="${BASEDIR}/${FILE_PEM_RSA4K_CRT}"
 export URI_KEY_RSA4K="${URI_KEY_RSA4K}?pin-source=${BASEDIR}/${PIN_SOURCE}"
 export URI_KEY_RSA4K_PRV="${URI_KEY_RSA4K_PRV}?pin-source=${BASEDIR}/${PIN_SOURCE}"
 export URI_KEY_RSA4K_PUB="${URI_KEY_RSA4K_PUB}?pin-source=${BASEDIR}/${PIN_SOURCE}"
+export URI_KEY_RSA4K_ID_PRV="${URI_KEY_RSA4K_ID_PRV}?pin-source=${BASEDIR}/${PIN_SOURCE}"
+export FILE_PEM_KEY_INDEX_PUB="${BASEDIR}/${FILE_PEM_KEY_INDEX_PUB}"
+export URI_KEY_INDEX_PRV="${URI_KEY_INDEX_PRV}?pin-source=${BASEDIR}/${PIN_SOURCE}"
+export KEY_INDEX_IMPORT="${BASEDIR}/${KEY_INDEX_IMPORT}"
 DBGSCRIPT
 test $? -eq 0 \
 || exit 99
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include <openssl/async.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#include "utils.h"
+
+#define EXIT_SKIP	(77)
+#define NJOBS		(16)
+#define SIGMAX		(1024)
+
+struct sign_job {
+	ASYNC_JOB *job;
+	ASYNC_WAIT_CTX *waitctx;
+	EVP_PKEY *pkey;
+	unsigned char sig[SIGMAX];
+	size_t siglen;
+	bool pending;
+	int rc;
+};
+
+static const char *msg = "test message for async sign/verify";
+
+static int sign_job_fn(void *arg)
+{
+	struct sign_job *sj = *(struct sign_job **)arg;
+	EVP_MD_CTX *ctx;
+	int rc = 0;
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx)
+		return 0;
+
+	sj->siglen = sizeof(sj->sig);
+	if ((EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, sj->pkey) == 1) &&
+	    (EVP_DigestSign(ctx, sj->sig, &sj->siglen,
+			    (const unsigned char *)msg, strlen(msg)) == 1))
+		rc = 1;
+
+	EVP_MD_CTX_free(ctx);
+	return rc;
+}
+
+/* start or resume a job, returns true if the job is finished */
+static bool sign_job_step(struct sign_job *sj)
+{
+	int ret;
+
+	ret = ASYNC_start_job(&sj->job, sj->waitctx, &sj->rc,
+			      sign_job_fn, &sj, sizeof(sj));
+	switch (ret) {
+	case ASYNC_PAUSE:
+		return false;
+	case ASYNC_FINISH:
+		return true;
+	default:
+		fprintf(stderr, "fail: ASYNC_start_job() [ret=%d]\n", ret);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* wait until one of the paused jobs is signaled */
+static void sign_job_wait(struct sign_job *sjs, size_t n)
+{
+	struct pollfd pfds[NJOBS];
+	OSSL_ASYNC_FD fd;
+	size_t i, nfds = 0, numfds;
+
+	for (i = 0; i < n; i++) {
+		if (!sjs[i].pending)
+			continue;
+
+		numfds = 1;
+		if (!ASYNC_WAIT_CTX_get_all_fds(sjs[i].waitctx, NULL, &numfds) ||
+		    (numfds != 1) ||
+		    !ASYNC_WAIT_CTX_get_all_fds(sjs[i].waitctx, &fd, &numfds)) {
+			fprintf(stderr, "fail: ASYNC_WAIT_CTX_get_all_fds()\n");
+			exit(EXIT_FAILURE);
+		}
+		pfds[nfds].fd = fd;
+		pfds[nfds].events = POLLIN;
+		nfds++;
+	}
+
+	if (nfds && (poll(pfds, nfds, 10000) <= 0)) {
+		fprintf(stderr, "fail: poll() on wait fds\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void verify(EVP_PKEY *pkey, const unsigned char *sig, size_t siglen)
+{
+	EVP_MD_CTX *ctx;
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx ||
+	    (EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL, pkey) != 1) ||
+	    (EVP_DigestVerify(ctx, sig, siglen,
+			      (const unsigned char *)msg, strlen(msg)) != 1)) {
+		fprintf(stderr, "fail: EVP_DigestVerify()\n");
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+	EVP_MD_CTX_free(ctx);
+}
+
+static unsigned int async_sign_verify(const char *priv, const char *cert)
+{
+	struct sign_job sjs[NJOBS] = { 0 };
+	EVP_PKEY *spkey, *vpkey;
+	unsigned int npaused = 0;
+	size_t i, npending = 0;
+
+	spkey = uri_pkey_get1(priv);
+	vpkey = uri_pkey_get1(cert);
+
+	/* all jobs in flight from a single thread */
+	for (i = 0; i < NJOBS; i++) {
+		sjs[i].pkey = spkey;
+		sjs[i].waitctx = ASYNC_WAIT_CTX_new();
+		if (!sjs[i].waitctx)
+			exit(EXIT_FAILURE);
+
+		sjs[i].pending = !sign_job_step(&sjs[i]);
+		if (sjs[i].pending) {
+			npaused++;
+			npending++;
+		}
+	}
+
+	while (npending) {
+		sign_job_wait(sjs, NJOBS);
+
+		for (i = 0; i < NJOBS; i++) {
+			if (!sjs[i].pending || !sign_job_step(&sjs[i]))
+				continue;
+			sjs[i].pending = false;
+			npending--;
+		}
+	}
+
+	for (i = 0; i < NJOBS; i++) {
+		if (sjs[i].rc != 1) {
+			fprintf(stderr, "fail: async sign [job=%lu, uri=%s]\n",
+				i, priv);
+			exit(EXIT_FAILURE);
+		}
+		verify(vpkey, sjs[i].sig, sjs[i].siglen);
+		ASYNC_WAIT_CTX_free(sjs[i].waitctx);
+	}
+
+	EVP_PKEY_free(spkey);
+	EVP_PKEY_free(vpkey);
+	return npaused;
+}
+
+static char *test_keys[][2] = {
+	/* ecdsa */
+	{ "FILE_PEM_ECDSA_PRV", "FILE_PEM_ECDSA_CRT"},
+	{ "URI_KEY_ECDSA_PRV", "FILE_PEM_ECDSA_CRT"},
+	/* rsa */
+	{ "FILE_PEM_RSA4K_PRV", "FILE_PEM_RSA4K_CRT"},
+	{ "URI_KEY_RSA4K_PRV", "FILE_PEM_RSA4K_CRT"},
+};
+
+int main(void)
+{
+	unsigned int npaused;
+	size_t i, nelem;
+
+	if (!ASYNC_is_capable()) {
+		fprintf(stderr, "skip: async jobs not supported\n");
+		exit(EXIT_SKIP);
+	}
+
+	if (getenv("PKCS11SIGN_DEBUG"))
+		info();
+
+	nelem = sizeof(test_keys) / sizeof(test_keys[0]);
+	for (i = 0; i < nelem; i++) {
+		char *env_p, *env_c, *priv, *cert;
+
+		env_p = test_keys[i][0];
+		env_c = test_keys[i][1];
+
+		priv = getenv(env_p);
+		cert = getenv(env_c);
+
+		if (!priv || !cert) {
+			fprintf(stderr, "skip: [%ld] async sign/verify with %s/%s\n",
+				i, env_p, env_c);
+			continue;
+		}
+
+		npaused = async_sign_verify(priv, cert);
+		fprintf(stderr, "pass: [%ld] async sign/verify with %s/%s (paused: %u/%d)\n",
+			i, env_p, env_c, npaused, NJOBS);
+	}
+
+	return 0;
+}
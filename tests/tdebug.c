@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/core.h>
+
+#include "common.h"
+#include "debug.h"
+
+#define OPS		20000000
+#define MAX_THREADS	8
+#define MSGS		20000
+/* paced logging: bursts per thread, fill a ring within the flush period */
+#define BURST		128
+#define BURST_PAUSE_US	1000
+#define MAX_DROP_PERMILLE	10
+
+/*
+ * Debug macros with the level checks at the call site: the message and its
+ * arguments are evaluated only if it is printed. The benchmark compares a
+ * disabled ps_dbg_debug() with the plain function call (the previous
+ * expansion of the macro) for a loop over the keys of an OSSL_PARAM array.
+ *
+ * Enabled messages of a debug context from ps_dbg_init() are written by the
+ * logger thread. The threads check the count and order of their messages:
+ * without pauses, they outrun the logger and messages are dropped (and
+ * counted). With pauses between bursts, the early wake-up of the logger
+ * must keep the drops below MAX_DROP_PERMILLE. The benchmark compares the
+ * logger with the previous stdio output (several fprintf() and a fflush()
+ * per line).
+ */
+static unsigned long evaluated;
+static pthread_barrier_t barrier;
+static struct dbg *log_dbg;
+static FILE *stdio_stream;
+static bool paced;
+
+static const char *arg(const char *s)
+{
+	evaluated++;
+	return s;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long lines(FILE *stream)
+{
+	long n = 0;
+	int c;
+
+	rewind(stream);
+	while ((c = fgetc(stream)) != EOF)
+		if (c == '\n')
+			n++;
+	rewind(stream);
+	return n;
+}
+
+static void check(struct dbg *dbg, unsigned int level,
+		  long expected_lines, unsigned long expected_args)
+{
+	static const unsigned char data[20] = { 0 };
+	long n;
+
+	evaluated = 0;
+	if (dbg->stream) {
+		rewind(dbg->stream);
+		if (ftruncate(fileno(dbg->stream), 0)) {
+			fprintf(stderr, "fail: ftruncate()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dbg->level = level;
+
+	ps_dbg_error(dbg, "error: %s", arg("e"));
+	ps_dbg_warn(dbg, "warn: %s", arg("w"));
+	ps_dbg_info(dbg, "info: %s", arg("i"));
+	ps_dbg_debug(dbg, "debug: %s", arg("d"));
+	/* three lines of 8 bytes */
+	ps_dbg_debug_dump(dbg, (evaluated++, data), sizeof(data));
+
+	n = dbg->stream ? lines(dbg->stream) : 0;
+	if ((n != expected_lines) || (evaluated != expected_args)) {
+		fprintf(stderr, "fail: level %u (lines: %ld, arguments: %lu)\n",
+			level, n, evaluated);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static double bench(struct dbg *dbg, const OSSL_PARAM *params, bool plain)
+{
+	const OSSL_PARAM *p;
+	double start;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < OPS; i++) {
+		for (p = params; p && p->key; p++) {
+			if (plain)
+				ps_dbg_println(DBG_DEBUG, dbg, __FILE__,
+					       __LINE__, __func__,
+					       "param: %s (0x%x)",
+					       p->key, p->data_type);
+			else
+				ps_dbg_debug(dbg, "param: %s (0x%x)",
+					     p->key, p->data_type);
+		}
+		/* keep the loop */
+		__asm__ __volatile__("" : : "r"(params) : "memory");
+	}
+	return (now_ns() - start) / OPS;
+}
+
+/* previous ps_dbg_println() */
+static void stdio_println(FILE *stream, const char *file, int line,
+			  const char *func, unsigned long i)
+{
+	fprintf(stream, "[%d] ", DBG_DEBUG);
+	fprintf(stream, "file: %s, line: %d, ", file, line);
+	fprintf(stream, "func: %s, ", func);
+	fprintf(stream, "message: %lu", i);
+	fwrite("\n", 1, 1, stream);
+	fflush(stream);
+}
+
+static void *log_run(void *arg)
+{
+	unsigned long i, n = (unsigned long)arg;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < n; i++) {
+		if (stdio_stream)
+			stdio_println(stdio_stream, __FILE__, __LINE__,
+				      __func__, i);
+		else
+			ps_dbg_debug(log_dbg, "message: %lu", i);
+		if (paced && !((i + 1) % BURST))
+			usleep(BURST_PAUSE_US);
+	}
+	return NULL;
+}
+
+/* thread exit: after the ring of the thread is released */
+static void exit_log(void *arg)
+{
+	ps_dbg_debug(log_dbg, "message: %lu", (unsigned long)arg);
+}
+
+static void *exit_run(void *arg)
+{
+	pthread_key_t key = *(pthread_key_t *)arg;
+
+	ps_dbg_debug(log_dbg, "message: %lu", 0UL);
+	pthread_setspecific(key, (void *)1UL);
+	return NULL;
+}
+
+/* messages per second of all threads */
+static double log_bench(unsigned int nthreads, unsigned long n)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned int i;
+	double start;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, log_run, (void *)n)) {
+			fprintf(stderr, "fail: pthread_create()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	return nthreads * n / ((now_ns() - start) / 1e9);
+}
+
+/*
+ * All messages are written or counted as dropped, in order per thread.
+ * Returns the number of dropped messages.
+ */
+static unsigned long check_log(const char *path, unsigned int nthreads,
+			       unsigned long n)
+{
+	struct {
+		int tid;
+		long last;
+	} seen[MAX_THREADS + 1] = { 0 };
+	unsigned long msgs = 0, dropped = 0, d;
+	char line[1024];
+	unsigned int i;
+	const char *s;
+	long msg;
+	FILE *f;
+	int tid;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "fail: fopen(%s)\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		s = strstr(line, "tid: ");
+		if (!s || (sscanf(s, "tid: %d,", &tid) != 1))
+			goto bad;
+		if (sscanf(strstr(line, ", ") + 2, "%lu debug messages dropped",
+			   &d) == 1) {
+			dropped += d;
+			continue;
+		}
+
+		s = strstr(line, "message: ");
+		if (!s || (sscanf(s, "message: %ld", &msg) != 1))
+			goto bad;
+		for (i = 0; seen[i].tid && (seen[i].tid != tid); i++)
+			;
+		if (i == MAX_THREADS)
+			goto bad;
+		if (!seen[i].tid) {
+			seen[i].tid = tid;
+			seen[i].last = -1;
+		}
+		if (msg <= seen[i].last)
+			goto bad;
+		seen[i].last = msg;
+		msgs++;
+	}
+	fclose(f);
+
+	if (msgs + dropped != nthreads * n) {
+		fprintf(stderr, "fail: logger (messages: %lu, dropped: %lu)\n",
+			msgs, dropped);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "info: %u threads, %lu messages%s: %lu written, "
+		"%lu dropped\n", nthreads, nthreads * n,
+		paced ? " (paced)" : "", msgs, dropped);
+	return dropped;
+
+bad:
+	fprintf(stderr, "fail: logger output: %s", line);
+	exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_utf8_string("digest", NULL, 0),
+		OSSL_PARAM_utf8_string("properties", NULL, 0),
+		OSSL_PARAM_int("pad-mode", NULL),
+		OSSL_PARAM_END,
+	};
+	char path[] = "/tmp/tdebug.XXXXXX";
+	struct dbg dbg = { 0 }, ldbg = { 0 };
+	double plain, inlined, async, stdio;
+	unsigned int nthreads;
+	pthread_key_t exit_key;
+	pthread_t thread;
+	int fd;
+
+	/* logging off: no argument evaluated */
+	check(&dbg, DBG_DEBUG, 0, 0);
+	fprintf(stderr, "pass: [0] no debug stream\n");
+
+	dbg.stream = tmpfile();
+	if (!dbg.stream) {
+		fprintf(stderr, "fail: tmpfile()\n");
+		return EXIT_FAILURE;
+	}
+
+	check(&dbg, DBG_ERROR, 1, 1);
+	check(&dbg, DBG_INFO, 3, 3);
+	check(&dbg, DBG_DEBUG, 7, 5);
+	fprintf(stderr, "pass: [1] debug levels\n");
+
+	dbg.level = DBG_ERROR;
+	plain = bench(&dbg, params, true);
+	inlined = bench(&dbg, params, false);
+	fprintf(stderr, "info: %zu disabled debug messages: function call "
+		"%5.2f ns, inline level check %5.2f ns\n",
+		sizeof(params) / sizeof(params[0]) - 1, plain, inlined);
+
+	fclose(dbg.stream);
+
+	/* logger thread */
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "fail: mkstemp()\n");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	setenv("PKCS11SIGN_DEBUG", path, 1);
+	setenv("PKCS11SIGN_DEBUG_LEVEL", "3", 1);
+	log_dbg = &ldbg;
+
+	ps_dbg_init(log_dbg);
+	log_bench(MAX_THREADS, MSGS);
+	ps_dbg_exit(log_dbg);
+	check_log(path, MAX_THREADS, MSGS);
+	fprintf(stderr, "pass: [2] logger thread\n");
+
+	paced = true;
+	ps_dbg_init(log_dbg);
+	log_bench(MAX_THREADS, MSGS / 4);
+	ps_dbg_exit(log_dbg);
+	if (check_log(path, MAX_THREADS, MSGS / 4) * 1000 >
+	    MAX_DROP_PERMILLE * MAX_THREADS * (MSGS / 4)) {
+		fprintf(stderr, "fail: logger drops more than %d/1000 paced messages\n",
+			MAX_DROP_PERMILLE);
+		return EXIT_FAILURE;
+	}
+	paced = false;
+	fprintf(stderr, "pass: [3] logger wake-up\n");
+
+	/*
+	 * The key of the ring is created by the first message, the
+	 * destructor of a later key runs after the ring is released.
+	 */
+	ps_dbg_init(log_dbg);
+	ps_dbg_debug(log_dbg, "message: %lu", 0UL);
+	if (pthread_key_create(&exit_key, exit_log) ||
+	    pthread_create(&thread, NULL, exit_run, &exit_key)) {
+		fprintf(stderr, "fail: pthread_create()\n");
+		return EXIT_FAILURE;
+	}
+	pthread_join(thread, NULL);
+	pthread_key_delete(exit_key);
+	ps_dbg_exit(log_dbg);
+	/* one message of the main thread, two of the exiting thread */
+	check_log(path, 3, 1);
+	fprintf(stderr, "pass: [4] messages at thread exit\n");
+
+	for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+		ps_dbg_init(log_dbg);
+		async = log_bench(nthreads, MSGS);
+		ps_dbg_exit(log_dbg);
+
+		stdio_stream = fopen(path, "w");
+		if (!stdio_stream) {
+			fprintf(stderr, "fail: fopen(%s)\n", path);
+			return EXIT_FAILURE;
+		}
+		stdio = log_bench(nthreads, MSGS);
+		fclose(stdio_stream);
+		stdio_stream = NULL;
+
+		fprintf(stderr, "info: %u threads: logger %6.2f M msgs/s, "
+			"stdio %6.2f M msgs/s\n", nthreads, async / 1e6,
+			stdio / 1e6);
+	}
+
+	unlink(path);
+	return EXIT_SUCCESS;
+}
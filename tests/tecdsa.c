@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "ossl.h"
+
+#define BENCH_ROUNDS	(200000)
+#define RAW_MAX		(2 * 66)
+
+/* reference encoding via ECDSA_SIG (allocating) */
+static int ecdsa_signature_ref(const unsigned char *raw, size_t rawlen,
+			       unsigned char *sig, size_t *siglen)
+{
+	unsigned char *der = sig;
+	ECDSA_SIG *ec_sig;
+	int derlen = 0;
+
+	ec_sig = ECDSA_SIG_new();
+	if (!ec_sig)
+		return 0;
+
+	if (ECDSA_SIG_set0(ec_sig,
+			   BN_bin2bn(raw, rawlen / 2, NULL),
+			   BN_bin2bn(raw + rawlen / 2, rawlen / 2, NULL)) != 1)
+		goto out;
+
+	derlen = i2d_ECDSA_SIG(ec_sig, NULL);
+	if ((derlen <= 0) || ((size_t)derlen > *siglen)) {
+		derlen = 0;
+		goto out;
+	}
+
+	derlen = i2d_ECDSA_SIG(ec_sig, &der);
+	*siglen = derlen;
+out:
+	ECDSA_SIG_free(ec_sig);
+	return (derlen > 0);
+}
+
+static void raw_fill(unsigned char *raw, size_t rawlen, int variant)
+{
+	size_t n = rawlen / 2;
+
+	if (RAND_bytes(raw, rawlen) != 1) {
+		fprintf(stderr, "fail: RAND_bytes()\n");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (variant) {
+	case 0:
+		/* both values negative as signed integers */
+		raw[0] |= 0x80;
+		raw[n] |= 0x80;
+		break;
+	case 1:
+		/* both values positive */
+		raw[0] &= 0x7f;
+		raw[n] &= 0x7f;
+		break;
+	case 2:
+		/* leading zero bytes in r */
+		memset(raw, 0, n / 2);
+		raw[n / 2] |= 0x80;
+		break;
+	case 3:
+		/* leading zero bytes in s */
+		memset(raw + n, 0, n / 2);
+		break;
+	case 4:
+		/* r is zero */
+		memset(raw, 0, n);
+		break;
+	default:
+		break;
+	}
+}
+
+static void check_encoding(size_t rawlen, int variant)
+{
+	unsigned char raw[RAW_MAX], ref[RAW_MAX + 16], sig[RAW_MAX + 16];
+	size_t reflen = sizeof(ref), siglen = 0;
+
+	raw_fill(raw, rawlen, variant);
+
+	if (!ecdsa_signature_ref(raw, rawlen, ref, &reflen)) {
+		fprintf(stderr, "fail: reference encoding [len: %lu, variant: %d]\n",
+			rawlen, variant);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* size query */
+	if ((ossl_ecdsa_signature(raw, rawlen, NULL, &siglen) != OSSL_RV_OK) ||
+	    (siglen != reflen) ||
+	    (siglen > ossl_ecdsa_signature_size(rawlen / 2))) {
+		fprintf(stderr, "fail: size query [len: %lu, variant: %d]\n",
+			rawlen, variant);
+		exit(EXIT_FAILURE);
+	}
+
+	/* separate buffer */
+	siglen = sizeof(sig);
+	if ((ossl_ecdsa_signature(raw, rawlen, sig, &siglen) != OSSL_RV_OK) ||
+	    (siglen != reflen) || memcmp(sig, ref, reflen)) {
+		fprintf(stderr, "fail: encoding [len: %lu, variant: %d]\n",
+			rawlen, variant);
+		exit(EXIT_FAILURE);
+	}
+
+	/* in place, as used for token signatures */
+	memcpy(sig, raw, rawlen);
+	siglen = sizeof(sig);
+	if ((ossl_ecdsa_signature(sig, rawlen, sig, &siglen) != OSSL_RV_OK) ||
+	    (siglen != reflen) || memcmp(sig, ref, reflen)) {
+		fprintf(stderr, "fail: in-place encoding [len: %lu, variant: %d]\n",
+			rawlen, variant);
+		exit(EXIT_FAILURE);
+	}
+
+	/* short buffer */
+	siglen = reflen - 1;
+	if (ossl_ecdsa_signature(raw, rawlen, sig, &siglen) != OSSL_RV_ERR) {
+		fprintf(stderr, "fail: short buffer [len: %lu, variant: %d]\n",
+			rawlen, variant);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench(size_t rawlen, bool ref)
+{
+	unsigned char raw[RAW_MAX], sig[RAW_MAX + 16];
+	size_t siglen;
+	double start;
+	int i, rc;
+
+	raw_fill(raw, rawlen, 0);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		siglen = sizeof(sig);
+		if (ref)
+			rc = ecdsa_signature_ref(raw, rawlen, sig, &siglen);
+		else
+			rc = ossl_ecdsa_signature(raw, rawlen, sig, &siglen);
+		if (rc != 1) {
+			fprintf(stderr, "fail: benchmark encoding\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return (now_ns() - start) / BENCH_ROUNDS;
+}
+
+static const struct {
+	const char *curve;
+	size_t rawlen;
+} curves[] = {
+	{ "P-256", 2 * 32 },
+	{ "P-384", 2 * 48 },
+	{ "P-521", 2 * 66 },
+};
+
+int main(void)
+{
+	size_t i, nelem;
+	int variant, round;
+
+	nelem = sizeof(curves) / sizeof(curves[0]);
+	for (i = 0; i < nelem; i++) {
+		for (round = 0; round < 100; round++)
+			for (variant = 0; variant < 6; variant++)
+				check_encoding(curves[i].rawlen, variant);
+		fprintf(stderr, "pass: [%ld] ecdsa raw-to-der encoding %s\n",
+			i, curves[i].curve);
+	}
+
+	for (i = 0; i < nelem; i++) {
+		fprintf(stderr, "info: [%ld] ecdsa raw-to-der %s: "
+			"%.1f ns/op (ECDSA_SIG: %.1f ns/op)\n",
+			i, curves[i].curve,
+			bench(curves[i].rawlen, false),
+			bench(curves[i].rawlen, true));
+	}
+
+	return 0;
+}
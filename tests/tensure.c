@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "debug.h"
+#include "pkcs11.h"
+
+#define SESSION		1
+#define MAX_THREADS	16
+#define RACE_THREADS	8
+#define OPS		2000000
+
+/*
+ * In-process token with a no-op C_Sign(). The threads call pkcs11_sign()
+ * concurrently, the first calls race for the module initialization. The
+ * benchmark compares the wrapper with a loop, which additionally writes
+ * one shared cache line per call: the time per call of the wrapper does
+ * not grow with the number of threads, if it writes no shared line.
+ */
+static unsigned long init_calls;
+static unsigned long shared_counter;
+
+static CK_RV initialize(CK_VOID_PTR args __unused)
+{
+	__atomic_add_fetch(&init_calls, 1, __ATOMIC_SEQ_CST);
+	/* widen the race of the first calls */
+	usleep(1000);
+	return CKR_OK;
+}
+
+static CK_RV sign(CK_SESSION_HANDLE session, CK_BYTE_PTR data __unused,
+		  CK_ULONG datalen __unused, CK_BYTE_PTR sig __unused,
+		  CK_ULONG_PTR siglen)
+{
+	if (session != SESSION)
+		return CKR_SESSION_HANDLE_INVALID;
+
+	*siglen = 0;
+	return CKR_OK;
+}
+
+static CK_FUNCTION_LIST fns = {
+	.C_Initialize = initialize,
+	.C_Sign = sign,
+};
+
+static struct pkcs11_module pkcs = {
+	.soname = "tensure",
+	.fns = &fns,
+	.state = PKCS11_UNINITIALIZED,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct dbg dbg;
+static pthread_barrier_t barrier;
+static bool contended;
+static unsigned long failures;
+
+/* no fork handling in this test */
+unsigned int atfork_generation(void)
+{
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+	unsigned long i, n = (unsigned long)arg;
+	size_t siglen;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < n; i++) {
+		siglen = 0;
+		if (pkcs11_sign(&pkcs, SESSION, NULL, 0, NULL, &siglen,
+				&dbg) != CKR_OK)
+			__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		if (contended)
+			__atomic_add_fetch(&shared_counter, 1,
+					   __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static double bench(unsigned int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long n = OPS / nthreads;
+	unsigned int i;
+	double start;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, run, (void *)n)) {
+			fprintf(stderr, "fail: pthread_create()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	/* wall time per call of one thread */
+	return (now_ns() - start) / n;
+}
+
+int main(void)
+{
+	unsigned int nthreads, ncpus;
+	double plain, shared;
+
+	ps_dbg_init(&dbg);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > MAX_THREADS)
+		ncpus = MAX_THREADS;
+
+	/* concurrent first calls */
+	bench(RACE_THREADS);
+	if ((init_calls != 1) || failures) {
+		fprintf(stderr, "fail: module initialization (C_Initialize: %lu, failures: %lu)\n",
+			init_calls, failures);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "pass: [0] module initialized once by %u threads\n",
+		RACE_THREADS);
+
+	/* reset after fork */
+	pkcs11_module_fork_reset(&pkcs);
+	bench(RACE_THREADS);
+	if ((init_calls != 2) || failures) {
+		fprintf(stderr, "fail: module initialization after reset (C_Initialize: %lu, failures: %lu)\n",
+			init_calls, failures);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "pass: [1] module initialized again after reset\n");
+
+	for (nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+		contended = false;
+		plain = bench(nthreads);
+		contended = true;
+		shared = bench(nthreads);
+		fprintf(stderr, "info: %2u threads: pkcs11_sign() %6.1f ns/call, "
+			"with a shared cache line %6.1f ns/call\n",
+			nthreads, plain, shared);
+	}
+
+	ps_dbg_exit(&dbg);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
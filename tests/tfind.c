@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/crypto.h>
+
+#include "common.h"
+#include "debug.h"
+#include "pkcs11.h"
+
+#define SESSION		1
+#define ROUNDS		10
+/* simulated latency of a token round trip (remote HSM) */
+#define LATENCY_NS	20000
+
+/*
+ * In-process token with NOBJS matching objects. The benchmark calls
+ * pkcs11_find_objects() directly, it counts the C_FindObjects() calls.
+ */
+static struct {
+	CK_ULONG nobjs;
+	CK_ULONG pos;
+	bool active;
+	long latency_ns;
+	unsigned long calls;
+} token;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void round_trip(void)
+{
+	double end = now_ns() + token.latency_ns;
+
+	while (now_ns() < end)
+		;
+}
+
+static CK_RV find_init(CK_SESSION_HANDLE session,
+		       CK_ATTRIBUTE_PTR templ __unused,
+		       CK_ULONG ntempl __unused)
+{
+	if (session != SESSION)
+		return CKR_SESSION_HANDLE_INVALID;
+	if (token.active)
+		return CKR_OPERATION_ACTIVE;
+
+	round_trip();
+	token.active = true;
+	token.pos = 0;
+	return CKR_OK;
+}
+
+static CK_RV find(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR objs,
+		  CK_ULONG max, CK_ULONG_PTR nobjs)
+{
+	if (session != SESSION)
+		return CKR_SESSION_HANDLE_INVALID;
+	if (!token.active)
+		return CKR_OPERATION_NOT_INITIALIZED;
+
+	round_trip();
+	token.calls++;
+	for (*nobjs = 0; (*nobjs < max) && (token.pos < token.nobjs); )
+		objs[(*nobjs)++] = ++token.pos;
+	return CKR_OK;
+}
+
+static CK_RV find_final(CK_SESSION_HANDLE session)
+{
+	if (session != SESSION)
+		return CKR_SESSION_HANDLE_INVALID;
+
+	round_trip();
+	token.active = false;
+	return CKR_OK;
+}
+
+static CK_FUNCTION_LIST fns = {
+	.C_FindObjectsInit = find_init,
+	.C_FindObjects = find,
+	.C_FindObjectsFinal = find_final,
+};
+
+/* no fork handling in this test */
+unsigned int atfork_generation(void)
+{
+	return 0;
+}
+
+static void check(struct pkcs11_module *pkcs, struct dbg *dbg,
+		  CK_ULONG nobjs, unsigned int batch)
+{
+	CK_OBJECT_HANDLE_PTR objs = NULL;
+	CK_ULONG n = 0, i;
+
+	token.nobjs = nobjs;
+	pkcs->find_batch = batch;
+
+	if ((pkcs11_find_objects(pkcs, SESSION, NULL, NULL, 0, NULL,
+				 &objs, &n, dbg) != CKR_OK) ||
+	    (n != nobjs) || token.active) {
+		fprintf(stderr, "fail: find %lu objects (batch: %u, found: %lu)\n",
+			nobjs, batch, n);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (objs[i] != i + 1) {
+			fprintf(stderr, "fail: find %lu objects (batch: %u, handle %lu: %lu)\n",
+				nobjs, batch, i, objs[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	OPENSSL_free(objs);
+}
+
+static void bench(struct pkcs11_module *pkcs, struct dbg *dbg,
+		  CK_ULONG nobjs, unsigned int batch, long latency_ns)
+{
+	double start, ms;
+	int i;
+
+	token.latency_ns = latency_ns;
+	token.calls = 0;
+
+	start = now_ns();
+	for (i = 0; i < ROUNDS; i++)
+		check(pkcs, dbg, nobjs, batch);
+	ms = (now_ns() - start) / ROUNDS / 1e6;
+
+	fprintf(stderr, "info: find %lu objects, batch %4u, latency %2ld us: "
+		"%5lu calls, %8.3f ms\n", nobjs, batch, latency_ns / 1000,
+		token.calls / ROUNDS, ms);
+}
+
+static const CK_ULONG sizes[] = { 0, 1, 63, 64, 65, 10000, 50000 };
+static const unsigned int batches[] = { 1, 8, 64, 512, PS_FIND_BATCH_MAX };
+
+int main(void)
+{
+	struct pkcs11_module pkcs = {
+		.soname = "tfind",
+		.fns = &fns,
+		.state = PKCS11_INITIALIZED,
+	};
+	struct dbg dbg = { 0 };
+	size_t i, j;
+
+	ps_dbg_init(&dbg);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < sizeof(batches) / sizeof(batches[0]); j++)
+			check(&pkcs, &dbg, sizes[i], batches[j]);
+		fprintf(stderr, "pass: [%ld] find %lu objects\n", i, sizes[i]);
+	}
+
+	for (i = 1; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		bench(&pkcs, &dbg, 10000, batches[i], 0);
+		bench(&pkcs, &dbg, 10000, batches[i], LATENCY_NS);
+	}
+
+	ps_dbg_exit(&dbg);
+	return 0;
+}
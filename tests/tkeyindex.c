@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/store.h>
+
+#include "utils.h"
+
+#define EXIT_SKIP	(77)
+#define SIGMAX		(1024)
+
+/*
+ * Key lookups with pkcs11sign-key-index = 1: the first lookup builds the
+ * index of the token, the other lookups by label and by id are resolved
+ * from it. A key imported after the index is built is not in the index,
+ * it must be found by the object search after the miss. All keys are
+ * checked by a signature, which is verified with the public key of the
+ * file.
+ */
+static const char *msg = "test message for key index sign/verify";
+
+/* as uri_pkey_get1(), but returns NULL if there is no key */
+static EVP_PKEY *uri_pkey_find(const char *uri)
+{
+	OSSL_STORE_INFO *info;
+	OSSL_STORE_CTX *sctx;
+	EVP_PKEY *pkey = NULL;
+
+	sctx = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL);
+	if (!sctx)
+		return NULL;
+
+	while (!pkey && !OSSL_STORE_eof(sctx)) {
+		info = OSSL_STORE_load(sctx);
+		if (!info)
+			break;
+		if (OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_PKEY)
+			pkey = OSSL_STORE_INFO_get1_PKEY(info);
+		OSSL_STORE_INFO_free(info);
+	}
+
+	OSSL_STORE_close(sctx);
+	ERR_clear_error();
+	return pkey;
+}
+
+static void sign_verify(const char *env_p, const char *env_c)
+{
+	unsigned char sig[SIGMAX];
+	EVP_PKEY *spkey, *vpkey;
+	const char *priv, *cert;
+	size_t siglen = sizeof(sig);
+	EVP_MD_CTX *ctx;
+
+	priv = getenv(env_p);
+	cert = getenv(env_c);
+	if (!priv || !cert) {
+		fprintf(stderr, "skip: sign/verify with %s/%s\n", env_p, env_c);
+		exit(EXIT_SKIP);
+	}
+
+	spkey = uri_pkey_get1(priv);
+	vpkey = uri_pkey_get1(cert);
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx ||
+	    (EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, spkey) != 1) ||
+	    (EVP_DigestSign(ctx, sig, &siglen, (const unsigned char *)msg,
+			    strlen(msg)) != 1) ||
+	    (EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL, vpkey) != 1) ||
+	    (EVP_DigestVerify(ctx, sig, siglen, (const unsigned char *)msg,
+			      strlen(msg)) != 1)) {
+		fprintf(stderr, "fail: sign/verify with %s/%s\n", env_p, env_c);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	EVP_MD_CTX_free(ctx);
+	EVP_PKEY_free(spkey);
+	EVP_PKEY_free(vpkey);
+}
+
+static void key_import(const char *cmd, const char *arg)
+{
+	char buf[4096];
+
+	snprintf(buf, sizeof(buf), "%s %s", cmd, arg);
+	if (system(buf)) {
+		fprintf(stderr, "fail: %s\n", buf);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static char *test_keys[][2] = {
+	/* by label */
+	{ "URI_KEY_ECDSA_PRV", "FILE_PEM_ECDSA_CRT"},
+	{ "URI_KEY_RSA4K_PRV", "FILE_PEM_RSA4K_CRT"},
+	/* by id */
+	{ "URI_KEY_ECDSA_ID_PRV", "FILE_PEM_ECDSA_CRT"},
+	{ "URI_KEY_RSA4K_ID_PRV", "FILE_PEM_RSA4K_CRT"},
+};
+
+int main(void)
+{
+	const char *conf, *import, *uri;
+	EVP_PKEY *pkey;
+	size_t i, nelem;
+
+	/* before the configuration is loaded */
+	conf = getenv("OPENSSL_CONF_KEY_INDEX");
+	import = getenv("KEY_INDEX_IMPORT");
+	uri = getenv("URI_KEY_INDEX_PRV");
+	if (!conf || !import || !uri) {
+		fprintf(stderr, "skip: no key index configuration\n");
+		exit(EXIT_SKIP);
+	}
+	setenv("OPENSSL_CONF", conf, 1);
+
+	if (getenv("PKCS11SIGN_DEBUG"))
+		info();
+
+	key_import(import, "delete");
+
+	nelem = sizeof(test_keys) / sizeof(test_keys[0]);
+	for (i = 0; i < nelem; i++) {
+		sign_verify(test_keys[i][0], test_keys[i][1]);
+		fprintf(stderr, "pass: [%ld] key index sign/verify with %s/%s\n",
+			i, test_keys[i][0], test_keys[i][1]);
+	}
+
+	/* miss: the key is not on the token */
+	pkey = uri_pkey_find(uri);
+	if (pkey) {
+		fprintf(stderr, "fail: key found before import [uri=%s]\n", uri);
+		exit(EXIT_FAILURE);
+	}
+
+	/* miss: the key is on the token, but not in the index */
+	key_import(import, "import");
+	sign_verify("URI_KEY_INDEX_PRV", "FILE_PEM_KEY_INDEX_PUB");
+	fprintf(stderr, "pass: [%ld] key index sign/verify with key imported later\n",
+		i++);
+
+	/* hit: the key found by the search was added */
+	sign_verify("URI_KEY_INDEX_PRV", "FILE_PEM_KEY_INDEX_PUB");
+	fprintf(stderr, "pass: [%ld] key index sign/verify with key added to the index\n",
+		i);
+
+	key_import(import, "delete");
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+
+#include "common.h"
+#include "debug.h"
+#include "object.h"
+
+#define MAX_THREADS	64
+#define OPS		4000000
+#define HELD_REFS	1000
+
+/*
+ * Key references of operation contexts: each operation init takes a
+ * reference on the (shared) key, the free of the context drops it. The
+ * benchmark runs this pair with 1 to MAX_THREADS threads on one key, with
+ * operation references (obj_ref_get()) and with plain references
+ * (obj_get()), which all update the same cache line.
+ */
+static struct provider_ctx pctx;
+static pthread_barrier_t barrier;
+static struct obj *key;
+static bool plain;
+
+/* no fork handling in this test */
+unsigned int atfork_generation(void)
+{
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+	unsigned long i, n = (unsigned long)arg;
+	int ref;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < n; i++) {
+		if (plain) {
+			obj_get(key);
+			obj_free(key);
+		} else {
+			ref = obj_ref_get(key);
+			obj_ref_put(key, ref);
+		}
+	}
+	return NULL;
+}
+
+static double bench(unsigned int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long n = OPS / nthreads;
+	unsigned int i;
+	double start;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, run, (void *)n)) {
+			fprintf(stderr, "fail: pthread_create()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	/* operation inits per second of all threads */
+	return OPS / ((now_ns() - start) / 1e9);
+}
+
+static void check_release(void)
+{
+	static int refs[HELD_REFS];
+	struct obj *obj;
+	int i;
+
+	obj = obj_new_init(&pctx, 0, "1234");
+	for (i = 0; i < HELD_REFS; i++)
+		refs[i] = obj_ref_get(obj);
+
+	/* last plain reference: the shards are folded into refcnt */
+	obj_free(obj);
+	if ((obj->refcnt != HELD_REFS) || !obj->refs_dead) {
+		fprintf(stderr, "fail: release with operation references (refcnt: %u)\n",
+			obj->refcnt);
+		exit(EXIT_FAILURE);
+	}
+
+	/* operation references on dead shards */
+	i = obj_ref_get(obj);
+	obj_ref_put(obj, i);
+	if (obj->refcnt != HELD_REFS) {
+		fprintf(stderr, "fail: dead shard reference (refcnt: %u)\n",
+			obj->refcnt);
+		exit(EXIT_FAILURE);
+	}
+
+	/* the last put frees the object */
+	for (i = 0; i < HELD_REFS; i++)
+		obj_ref_put(obj, refs[i]);
+}
+
+int main(void)
+{
+	unsigned int nthreads;
+	double ops, ops_plain;
+
+	check_release();
+	fprintf(stderr, "pass: [0] release with operation references\n");
+
+	key = obj_new_init(&pctx, 0, NULL);
+	if (!key)
+		return EXIT_FAILURE;
+
+	for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+		plain = false;
+		ops = bench(nthreads);
+		plain = true;
+		ops_plain = bench(nthreads);
+		fprintf(stderr, "info: %2u threads: %6.1f M inits/s, "
+			"plain references %6.1f M inits/s\n",
+			nthreads, ops / 1e6, ops_plain / 1e6);
+	}
+
+	if (key->refcnt != 1) {
+		fprintf(stderr, "fail: references left (refcnt: %u)\n",
+			key->refcnt);
+		return EXIT_FAILURE;
+	}
+	obj_free(key);
+	fprintf(stderr, "pass: [1] shared key references\n");
+
+	return EXIT_SUCCESS;
+}
@@ -4,14 +4,49 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/store.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
 
+#include "pkcs11sign.h"
 #include "utils.h"
 
 #define EXIT_SKIP	(77)
+#define BATCH_ITEMS	(8)
+#define BENCH_ITERS	(256)
+/* more threads than pkcs11sign-session-max of OPENSSL_CONF_THREAD_SESSIONS */
+#define MT_THREADS	(8)
+#define MT_ROUNDS	(2)
+#define MT_ITERS	(16)
+
+/* allocations by libcrypto and the provider (OPENSSL_malloc() and friends) */
+static bool alloc_counting;
+static unsigned long nallocs;
+
+static void *count_malloc(size_t num, const char *file, int line)
+{
+	(void)file; (void)line;
+	nallocs++;
+	return malloc(num);
+}
+
+static void *count_realloc(void *addr, size_t num, const char *file, int line)
+{
+	(void)file; (void)line;
+	nallocs++;
+	return realloc(addr, num);
+}
+
+static void count_free(void *addr, const char *file, int line)
+{
+	(void)file; (void)line;
+	free(addr);
+}
 
 static EVP_MD_CTX *create_context(void)
 {
@@ -154,6 +189,228 @@ void sign_verify(const char *priv, const char *cert, bool debug)
 	OPENSSL_free(sig);
 }
 
+static void configure_pkey_context(EVP_PKEY_CTX *ctx, EVP_PKEY *pkey)
+{
+	if (EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) != 1) {
+		fprintf(stderr, "fail: EVP_PKEY_CTX_set_signature_md() [ctx=%p]\n",
+			ctx);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!EVP_PKEY_is_a(pkey, "RSA"))
+		return;
+
+	if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PSS_PADDING) != 1) {
+		fprintf(stderr, "fail: EVP_PKEY_CTX_set_rsa_padding() [ctx=%p]\n",
+			ctx);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void batch_sign_verify(const char *priv, const char *cert)
+{
+	unsigned char md[BATCH_ITEMS][SHA256_DIGEST_LENGTH];
+	struct ps_sign_batch_item items[BATCH_ITEMS] = { 0 };
+	OSSL_PARAM params[2];
+	EVP_PKEY *spkey, *vpkey;
+	EVP_PKEY_CTX *ctx;
+	char msg[64];
+	size_t i, siglen;
+
+	spkey = uri_pkey_get1(priv);
+	vpkey = uri_pkey_get1(cert);
+
+	ctx = EVP_PKEY_CTX_new_from_pkey(NULL, spkey, NULL);
+	if (!ctx || (EVP_PKEY_sign_init(ctx) != 1)) {
+		fprintf(stderr, "fail: EVP_PKEY_sign_init() [uri=%s]\n", priv);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+	configure_pkey_context(ctx, spkey);
+
+	/* advertised for keys on the token */
+	if (!strncmp(priv, "pkcs11:", strlen("pkcs11:")) &&
+	    !OSSL_PARAM_locate_const(EVP_PKEY_CTX_gettable_params(ctx),
+				     PS_SIGNATURE_PARAM_BATCH)) {
+		fprintf(stderr, "fail: %s not gettable [uri=%s]\n",
+			PS_SIGNATURE_PARAM_BATCH, priv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (EVP_PKEY_sign(ctx, NULL, &siglen, md[0], sizeof(md[0])) != 1) {
+		fprintf(stderr, "fail: EVP_PKEY_sign() [ctx=%p]\n", ctx);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < BATCH_ITEMS; i++) {
+		snprintf(msg, sizeof(msg), "test message %lu for batch sign", i);
+		SHA256((const unsigned char *)msg, strlen(msg), md[i]);
+
+		items[i].tbs = md[i];
+		items[i].tbslen = sizeof(md[i]);
+		items[i].sigsize = siglen;
+		items[i].sig = OPENSSL_zalloc(siglen);
+		if (!items[i].sig)
+			exit(EXIT_FAILURE);
+	}
+
+	params[0] = OSSL_PARAM_construct_octet_string(PS_SIGNATURE_PARAM_BATCH,
+						      items, sizeof(items));
+	params[1] = OSSL_PARAM_construct_end();
+	if (EVP_PKEY_CTX_get_params(ctx, params) != 1) {
+		fprintf(stderr, "fail: EVP_PKEY_CTX_get_params(%s) [ctx=%p]\n",
+			PS_SIGNATURE_PARAM_BATCH, ctx);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+	EVP_PKEY_CTX_free(ctx);
+
+	ctx = EVP_PKEY_CTX_new_from_pkey(NULL, vpkey, NULL);
+	if (!ctx || (EVP_PKEY_verify_init(ctx) != 1)) {
+		fprintf(stderr, "fail: EVP_PKEY_verify_init() [uri=%s]\n", cert);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+	configure_pkey_context(ctx, vpkey);
+
+	for (i = 0; i < BATCH_ITEMS; i++) {
+		if ((items[i].status != 1) ||
+		    (EVP_PKEY_verify(ctx, items[i].sig, items[i].siglen,
+				     md[i], sizeof(md[i])) != 1)) {
+			fprintf(stderr, "fail: batch item %lu [status=%d]\n",
+				i, items[i].status);
+			ERR_print_errors_fp(stderr);
+			exit(EXIT_FAILURE);
+		}
+		OPENSSL_free(items[i].sig);
+	}
+
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(spkey);
+	EVP_PKEY_free(vpkey);
+}
+
+/* allocations per sign operation with a new signature context each */
+static void sign_alloc_bench(const char *priv, size_t idx)
+{
+	const char *msg = "test message for sign/verify";
+	unsigned char sig[1024];
+	unsigned long n = 0;
+	EVP_MD_CTX *ctx;
+	EVP_PKEY *pkey;
+	size_t siglen;
+	int i;
+
+	pkey = uri_pkey_get1(priv);
+
+	/* first round warms up sessions, handles and caches */
+	for (i = -1; i < BENCH_ITERS; i++) {
+		if (i == 0)
+			n = nallocs;
+
+		ctx = create_context();
+		configure_sign_context(ctx, pkey, priv);
+		siglen = sizeof(sig);
+		if (EVP_DigestSign(ctx, sig, &siglen, (const unsigned char *)msg,
+				   strlen(msg)) != 1) {
+			fprintf(stderr, "fail: EVP_DigestSign() [uri: %s]\n",
+				priv);
+			ERR_print_errors_fp(stderr);
+			exit(EXIT_FAILURE);
+		}
+		EVP_MD_CTX_free(ctx);
+	}
+	n = nallocs - n;
+
+	fprintf(stderr, "info: [%ld] sign allocations: %.1f/op (%d ops)\n",
+		idx, (double)n / BENCH_ITERS, BENCH_ITERS);
+
+	EVP_PKEY_free(pkey);
+}
+
+struct mt_args {
+	EVP_PKEY *spkey;
+	EVP_PKEY *vpkey;
+	bool failed;
+};
+
+static void *mt_sign_run(void *arg)
+{
+	const char *msg = "test message for multi-threaded sign/verify";
+	struct mt_args *args = arg;
+	unsigned char sig[1024];
+	EVP_MD_CTX *ctx;
+	size_t siglen;
+	int i;
+
+	for (i = 0; i < MT_ITERS; i++) {
+		ctx = EVP_MD_CTX_new();
+		siglen = sizeof(sig);
+		if (!ctx ||
+		    (EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL,
+					args->spkey) != 1) ||
+		    (EVP_DigestSign(ctx, sig, &siglen,
+				    (const unsigned char *)msg,
+				    strlen(msg)) != 1) ||
+		    (EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL,
+					  args->vpkey) != 1) ||
+		    (EVP_DigestVerify(ctx, sig, siglen,
+				      (const unsigned char *)msg,
+				      strlen(msg)) != 1))
+			args->failed = true;
+		EVP_MD_CTX_free(ctx);
+		if (args->failed)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Sign/verify in several rounds of threads. The threads share the key and
+ * exit at the end of each round, so that sessions kept per thread are
+ * closed and opened again by the threads of the next round.
+ */
+static void mt_sign_verify(const char *priv, const char *cert)
+{
+	struct mt_args args[MT_THREADS] = { 0 };
+	pthread_t threads[MT_THREADS];
+	EVP_PKEY *spkey, *vpkey;
+	int i, round;
+
+	spkey = uri_pkey_get1(priv);
+	vpkey = uri_pkey_get1(cert);
+
+	for (round = 0; round < MT_ROUNDS; round++) {
+		for (i = 0; i < MT_THREADS; i++) {
+			args[i].spkey = spkey;
+			args[i].vpkey = vpkey;
+			if (pthread_create(&threads[i], NULL, mt_sign_run,
+					   &args[i])) {
+				fprintf(stderr, "fail: pthread_create()\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < MT_THREADS; i++) {
+			pthread_join(threads[i], NULL);
+			if (args[i].failed) {
+				fprintf(stderr, "fail: multi-threaded sign/verify "
+					"[uri=%s, round=%d, thread=%d]\n",
+					priv, round, i);
+				ERR_print_errors_fp(stderr);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	EVP_PKEY_free(spkey);
+	EVP_PKEY_free(vpkey);
+}
+
 static char *test_keys[][2] = {
 	/* ecdsa */
 	{ "FILE_PEM_ECDSA_PRV", "FILE_PEM_ECDSA_CRT"},
@@ -167,6 +424,21 @@ int main(void)
 {
 	size_t i, nelem;
 	bool debug;
+#ifdef TEST_THREAD_SESSIONS
+	const char *conf;
+
+	/* before the configuration is loaded */
+	conf = getenv("OPENSSL_CONF_THREAD_SESSIONS");
+	if (!conf) {
+		fprintf(stderr, "skip: no thread sessions configuration\n");
+		exit(EXIT_SKIP);
+	}
+	setenv("OPENSSL_CONF", conf, 1);
+#endif
+
+	/* before any allocation of libcrypto */
+	alloc_counting = (CRYPTO_set_mem_functions(count_malloc, count_realloc,
+						   count_free) == 1);
 
 	debug = (getenv("PKCS11SIGN_DEBUG")) ? true : false;
 	if (debug) info();
@@ -193,6 +465,17 @@ int main(void)
 		sign_verify(priv, cert, debug);
 		fprintf(stderr, "pass: [%ld] sign/verify with %s/%s\n",
 			i, env_p, env_c);
+
+		batch_sign_verify(priv, cert);
+		fprintf(stderr, "pass: [%ld] batch sign/verify with %s/%s\n",
+			i, env_p, env_c);
+
+		mt_sign_verify(priv, cert);
+		fprintf(stderr, "pass: [%ld] multi-threaded sign/verify with %s/%s\n",
+			i, env_p, env_c);
+
+		if (alloc_counting)
+			sign_alloc_bench(priv, i);
 	}
 
 	return 0;
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) IBM Corp. 2023
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/store.h>
+
+#include "utils.h"
+
+#define EXIT_SKIP	(77)
+#define SIGMAX		(1024)
+/* pkcs11sign-store-cache-ttl of OPENSSL_CONF_STORE_CACHE */
+#define CACHE_TTL	(2)
+
+/*
+ * Key lookups with pkcs11sign-store-cache-ttl: the first load of a uri
+ * searches the token, a second load of the same uri is a cache hit and
+ * must return a usable key. After the key is deleted from the token, a
+ * load within the ttl still returns the key from the cache. A child
+ * process after fork and a load after the ttl miss the cache and must not
+ * find the key.
+ */
+static const char *msg = "test message for store cache sign/verify";
+
+/*
+ * Returns the first key of the uri or NULL. All objects are loaded, only
+ * complete lookups are cached.
+ */
+static EVP_PKEY *uri_pkey_find(const char *uri)
+{
+	OSSL_STORE_INFO *info;
+	OSSL_STORE_CTX *sctx;
+	EVP_PKEY *pkey = NULL;
+
+	sctx = OSSL_STORE_open(uri, NULL, NULL, NULL, NULL);
+	if (!sctx)
+		return NULL;
+
+	while (!OSSL_STORE_eof(sctx)) {
+		info = OSSL_STORE_load(sctx);
+		if (!info)
+			break;
+		if (!pkey &&
+		    (OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_PKEY))
+			pkey = OSSL_STORE_INFO_get1_PKEY(info);
+		OSSL_STORE_INFO_free(info);
+	}
+
+	OSSL_STORE_close(sctx);
+	ERR_clear_error();
+	return pkey;
+}
+
+static void sign_verify(const char *env_p, const char *env_c)
+{
+	unsigned char sig[SIGMAX];
+	EVP_PKEY *spkey, *vpkey;
+	const char *priv, *cert;
+	size_t siglen = sizeof(sig);
+	EVP_MD_CTX *ctx;
+
+	priv = getenv(env_p);
+	cert = getenv(env_c);
+	if (!priv || !cert) {
+		fprintf(stderr, "skip: sign/verify with %s/%s\n", env_p, env_c);
+		exit(EXIT_SKIP);
+	}
+
+	spkey = uri_pkey_find(priv);
+	vpkey = uri_pkey_get1(cert);
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || !spkey ||
+	    (EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, spkey) != 1) ||
+	    (EVP_DigestSign(ctx, sig, &siglen, (const unsigned char *)msg,
+			    strlen(msg)) != 1) ||
+	    (EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL, vpkey) != 1) ||
+	    (EVP_DigestVerify(ctx, sig, siglen, (const unsigned char *)msg,
+			      strlen(msg)) != 1)) {
+		fprintf(stderr, "fail: sign/verify with %s/%s\n", env_p, env_c);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	EVP_MD_CTX_free(ctx);
+	EVP_PKEY_free(spkey);
+	EVP_PKEY_free(vpkey);
+}
+
+static void key_import(const char *cmd, const char *arg)
+{
+	char buf[4096];
+
+	snprintf(buf, sizeof(buf), "%s %s", cmd, arg);
+	if (system(buf)) {
+		fprintf(stderr, "fail: %s\n", buf);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* fails if the key is (not) found, as expected by found */
+static void check_find(const char *uri, int found, const char *what)
+{
+	EVP_PKEY *pkey;
+
+	pkey = uri_pkey_find(uri);
+	if (!pkey != !found) {
+		fprintf(stderr, "fail: key %sfound %s [uri=%s]\n",
+			pkey ? "" : "not ", what, uri);
+		exit(EXIT_FAILURE);
+	}
+	EVP_PKEY_free(pkey);
+}
+
+int main(void)
+{
+	const char *conf, *import, *uri;
+	int status;
+	pid_t pid;
+
+	/* before the configuration is loaded */
+	conf = getenv("OPENSSL_CONF_STORE_CACHE");
+	import = getenv("KEY_INDEX_IMPORT");
+	uri = getenv("URI_KEY_INDEX_PRV");
+	if (!conf || !import || !uri) {
+		fprintf(stderr, "skip: no store cache configuration\n");
+		exit(EXIT_SKIP);
+	}
+	setenv("OPENSSL_CONF", conf, 1);
+
+	if (getenv("PKCS11SIGN_DEBUG"))
+		info();
+
+	key_import(import, "import");
+
+	/* miss, then hit: both keys must be usable */
+	sign_verify("URI_KEY_INDEX_PRV", "FILE_PEM_KEY_INDEX_PUB");
+	fprintf(stderr, "pass: [0] store cache sign/verify (miss)\n");
+	sign_verify("URI_KEY_INDEX_PRV", "FILE_PEM_KEY_INDEX_PUB");
+	fprintf(stderr, "pass: [1] store cache sign/verify (hit)\n");
+
+	/* hit: the key is no longer on the token, but in the cache */
+	key_import(import, "delete");
+	check_find(uri, 1, "in the cache after delete");
+	fprintf(stderr, "pass: [2] store cache hit after delete\n");
+
+	/* miss: the cache of the parent is invalid in the child */
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fail: fork()\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid) {
+		check_find(uri, 0, "in the child after fork");
+		exit(EXIT_SUCCESS);
+	}
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) ||
+	    (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+		fprintf(stderr, "fail: store cache in the child after fork\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "pass: [3] store cache miss after fork\n");
+
+	/* the parent still hits, until the entry expires */
+	check_find(uri, 1, "in the cache of the parent");
+	sleep(CACHE_TTL + 1);
+	check_find(uri, 0, "after the ttl");
+	fprintf(stderr, "pass: [4] store cache miss after ttl\n");
+
+	return 0;
+}